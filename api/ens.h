@@ -9,7 +9,7 @@
  * A library that provides application level email logging. The main goal of
  * this library is to provide functionality to programmers for sending log
  * type emails in their programs. The library handles the logic which
- * determines  when emails should be sent and can operate in two modes as
+ * determines  when emails should be sent and can operate in three modes as
  * described below:
  *
  * ---------------------------------------------------------------------------
@@ -26,12 +26,27 @@
  * configured. Any email that is attempted to be sent before the interval has
  * expired is queued and when the timer expires, an email is sent with all the
  * queued emails concatenated into a single email.
+ *
+ * ---------------------------------------------------------------------------
+ * ENS_GROUP_MODE_SAMPLE
+ * ---------------------------------------------------------------------------
+ * Like ENS_GROUP_MODE_COLLECT, but for intervals that see too many emails to
+ * keep. Only a fixed number of the emails are kept, picked at random so that
+ * every email is as likely to be kept as any other, optionally along with the
+ * first and last few. The email that's sent says how many emails there were
+ * in all.
  * ---------------------------------------------------------------------------
  */
 
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
 /**
  * Error codes.
  */
+#define ENS_ERROR_FULL                 (-3) //!< The group or the context has as many emails queued as it's allowed.
+#define ENS_ERROR_DUPLICATE            (-2) //!< The group sent the same email within its duplicate window.
 #define ENS_ERROR_NOT_READY            (-1) //!< The group's interval hasn't expired yet.
 #define ENS_ERROR_OK                   0    //!< The operation completed successfully.
 #define ENS_ERROR_MEMORY               1    //!< A dynamic memory allocation failed.
@@ -46,6 +61,7 @@
 #define ENS_ERROR_FILE_OPEN            10   //!< The group is writing to a file but the file couldn't be opened.
 #define ENS_ERROR_THREAD               11   //!< The ENS context's thread couldn't be started.
 #define ENS_ERROR_FILE                 12   //!< There was an problem with opening or writing to a group's file.
+#define ENS_ERROR_FORMAT               13   //!< The body couldn't be formatted.
 
 /**
  * Log levels.
@@ -61,6 +77,15 @@
  */
 #define ENS_GROUP_MODE_DROP    0                    //<! Drop messages between the interval.
 #define ENS_GROUP_MODE_COLLECT 1                    //!< Collect messages between the interval.
+#define ENS_GROUP_MODE_SAMPLE  2                    //!< Collect a random sample of the messages between the interval.
+
+/**
+ * What a group does with an email that would take it or the context over its
+ * limits. See ENS_GROUP_OPTION_OVERFLOW.
+ */
+#define ENS_OVERFLOW_DROP_NEWEST 0 //!< Reject the email.
+#define ENS_OVERFLOW_DROP_OLDEST 1 //!< Drop the group's oldest queued emails to make room, or reject the email for DROP and SAMPLE groups and groups that coalesce.
+#define ENS_OVERFLOW_TRUNCATE    2 //!< Shorten the email's body to fit, rejecting the email if nothing of the body fits.
 
 /**
  * The ENS context.
@@ -81,6 +106,35 @@ typedef int ens_group_id_t;
  */
 typedef void (*ens_log_function_t)(int level, const char *msg, void *user_data);
 
+/**
+ * The function type used to free buffers that the ENS context has taken
+ * ownership of.
+ *
+ * @param[in] data The buffer to free.
+ */
+typedef void (*ens_free_function_t)(void *data);
+
+/**
+ * A reference counted email body that can be queued for any number of
+ * emails without being copied. See ens_body_init().
+ */
+typedef struct ens_body_t ens_body_t;
+
+/**
+ * A reference to a registered group that emails can be sent through without
+ * the group being looked up each time. See ens_group_acquire().
+ */
+typedef struct ens_group_handle_t ens_group_handle_t;
+
+/**
+ * An email for ens_group_send_batch() or ens_send_batch().
+ */
+typedef struct {
+    ens_group_id_t id;   //!< The group ID to queue the email for. Only used by ens_send_batch().
+    const char *subject; //!< The subject of the email.
+    const char *body;    //!< The body of the email.
+} ens_message_t;
+
 /**
  * Options that effect the entire ENS context.
  */ 
@@ -96,8 +150,25 @@ typedef enum {
     ENS_OPTION_LOG_FUNCTION,  //!< Sets a callback function to for logging.
     ENS_OPTION_LOG_LEVEL,     //!< Sets the maximum logging level for the logging function.
     ENS_OPTION_LOG_USER_DATA, //!< Sets user data for the logging function.
+    ENS_OPTION_WORKER_THREADS,//!< Sets the number of threads that send emails. 0 sends them on the context's thread.
+    ENS_OPTION_ASYNC,         //!< Sends all emails concurrently from the context's thread using non-blocking I/O.
+    ENS_OPTION_CONNECTION_IDLE_TIMEOUT, //!< Sets how many seconds an SMTP connection is kept open for reuse. 0 disables reuse.
+    ENS_OPTION_MAX_HOST_CONNECTIONS,    //!< Sets the maximum number of connections kept open to each SMTP host.
+    ENS_OPTION_TLS_SESSIONS_FILE,       //!< Sets a file that TLS sessions are saved to and resumed from when the context is started again.
+    ENS_OPTION_MAX_EMAILS,              //!< Sets how many emails every group together can have queued. 0 means no limit. Takes an <tt>int</tt>.
+    ENS_OPTION_MAX_BYTES,               //!< Sets how many bytes every group's queued emails together can take up. 0 means no limit. Takes an <tt>int</tt>.
 } ens_option_t;
 
+/**
+ * Information that can be retrieved from the ENS context.
+ */
+typedef enum {
+    ENS_INFO_CONNECTION_HITS,   //!< The number of emails sent over an already open connection. Takes a <tt>uint64_t *</tt>.
+    ENS_INFO_CONNECTION_MISSES, //!< The number of emails that opened a new connection. Takes a <tt>uint64_t *</tt>.
+    ENS_INFO_QUEUED_EMAILS,     //!< The number of emails every group together has queued. Takes a <tt>uint64_t *</tt>.
+    ENS_INFO_QUEUED_BYTES,      //!< The number of bytes every group's queued emails together take up. Takes a <tt>uint64_t *</tt>.
+} ens_info_t;
+
 /**
  * Options that effect the group within the ENS context.
  */
@@ -110,9 +181,30 @@ typedef enum {
     ENS_GROUP_OPTION_PASSWORD,  //!< Sets the SMTP password credentials for this group.
     ENS_GROUP_OPTION_INTERVAL,  //!< Sets the interval and which emails are sent for this group.
     ENS_GROUP_OPTION_FILE,      //!< Sets the file path to write emails to instead of sending them.
-    ENS_GROUP_OPTION_CA_PATH    //!< Sets the path for the certificate authority.
+    ENS_GROUP_OPTION_CA_PATH,   //!< Sets the path for the certificate authority.
+    ENS_GROUP_OPTION_THREAD_BATCH, //!< Sets how many emails each sending thread batches up before handing them off. 0 disables batching.
+    ENS_GROUP_OPTION_DEFERRED_FORMAT, //!< Sets whether ens_group_sendf() formats the body when the email is sent instead of when it's queued. Takes an <tt>int</tt>.
+    ENS_GROUP_OPTION_COALESCE,  //!< Sets how many different emails a digest counts repeats of. 0 disables coalescing. Takes an <tt>int</tt>.
+    ENS_GROUP_OPTION_DUPLICATE_WINDOW,     //!< Sets how many seconds a DROP group rejects an email it's already sent. 0 disables it. Takes an <tt>int</tt>.
+    ENS_GROUP_OPTION_DUPLICATE_CAPACITY,   //!< Sets how many different emails each duplicate window is sized for. Defaults to 1024. Takes an <tt>int</tt>.
+    ENS_GROUP_OPTION_DUPLICATE_ERROR_RATE, //!< Sets how many new emails in a million may be taken for duplicates. Defaults to 10000. Takes an <tt>int</tt>.
+    ENS_GROUP_OPTION_MAX_EMAILS,           //!< Sets how many emails the group can have queued. 0 means no limit. Takes an <tt>int</tt>.
+    ENS_GROUP_OPTION_MAX_BYTES,            //!< Sets how many bytes the group's queued emails can take up. 0 means no limit. Takes an <tt>int</tt>.
+    ENS_GROUP_OPTION_OVERFLOW,             //!< Sets what's done with an email that would go over a limit, one of the ENS_OVERFLOW values. Takes an <tt>int</tt>.
+    ENS_GROUP_OPTION_SAMPLE_SIZE,          //!< Sets how many randomly picked emails a SAMPLE group keeps. Defaults to 10. Takes an <tt>int</tt>.
+    ENS_GROUP_OPTION_SAMPLE_EDGES,         //!< Sets how many of the first and of the last emails a SAMPLE group keeps as well. Defaults to 0. Takes an <tt>int</tt>.
 } ens_group_option_t;
 
+/**
+ * Information that can be retrieved about a group.
+ */
+typedef enum {
+    ENS_GROUP_INFO_QUEUED_EMAILS,    //!< The number of emails the group has queued. Takes a <tt>uint64_t *</tt>.
+    ENS_GROUP_INFO_QUEUED_BYTES,     //!< The number of bytes the group's queued emails take up. Takes a <tt>uint64_t *</tt>.
+    ENS_GROUP_INFO_EMAILS_DROPPED,   //!< The number of emails rejected or dropped for going over a limit. Takes a <tt>uint64_t *</tt>.
+    ENS_GROUP_INFO_EMAILS_TRUNCATED, //!< The number of emails whose bodies were truncated to stay under a limit. Takes a <tt>uint64_t *</tt>.
+} ens_group_info_t;
+
 /**
  * @brief Returns the major version of the library.
  *
@@ -161,10 +253,26 @@ void ens_free(ens_t *ens);
 /**
  * @brief Start the ENS context for use.
  *
- * Starts the ENS context's thread that handles and sends emails.
- * 
+ * Starts the ENS context's thread that handles and sends emails. If
+ * ENS_OPTION_WORKER_THREADS is set, that many worker threads are also started
+ * and the context's thread hands each group off to them when its interval
+ * expires, so a slow SMTP server for one group doesn't hold up the others. A
+ * group is only ever sent by one worker at a time.
+ *
+ * If ENS_OPTION_ASYNC is set, no worker threads are started. Instead the
+ * context's thread drives every SMTP transaction at once with non-blocking
+ * I/O, so hundreds of groups can be sending without hundreds of threads.
+ *
  * If any groups are writing emails to files, they're opened here.
  *
+ * TLS sessions and DNS lookups are shared by every group in the context. If
+ * ENS_OPTION_TLS_SESSIONS_FILE is set, the TLS sessions saved in that file are
+ * loaded here, so a restarted process resumes its sessions with the SMTP hosts
+ * instead of doing a full handshake with each of them. The file is rewritten
+ * whenever a new TLS connection is made. Saving sessions requires cURL 8.12
+ * or newer built with SSL session export support; otherwise a warning is
+ * logged and sessions are only resumed until the process exits.
+ *
  * @param[in] ens The ENS context.
  * @return ENS_ERROR_OK: The ENS context was started successfully.
  *         ENS_ERROR_ALREADY_RUNNING: The ENS context is already running.
@@ -247,6 +355,12 @@ int ens_group_unregister(ens_t *ens, ens_group_id_t id);
  *         ENS_ERROR_NOT_READY: The email was not queued because the group's
  *                              mode is ENS_GROUP_MODE_DROP and its timeout
  *                              has not expired yet.
+ *         ENS_ERROR_DUPLICATE: The email was not queued because the group
+ *                              sent the same email within its duplicate
+ *                              window.
+ *         ENS_ERROR_FULL: The email was not queued because the group or
+ *                         the context has as many emails queued as it's
+ *                         allowed.
  */
 int ens_group_send(ens_t *ens, ens_group_id_t id, const char *subject, const char *body);
 
@@ -256,20 +370,257 @@ int ens_group_send(ens_t *ens, ens_group_id_t id, const char *subject, const cha
  * Does the same thing as ens_group_send() but lets you specify and printf()
  * styled formatted string for the body of the email.
  *
+ * If ENS_GROUP_OPTION_DEFERRED_FORMAT is set for the group, the arguments are
+ * copied and the body is only formatted if the email is actually sent, which
+ * keeps the formatting off the calling thread. <tt>%s</tt> arguments and
+ * the format string are copied. Each different format string is parsed once
+ * and kept until the context is freed, so formats built at runtime should be
+ * few. Format strings that use positional arguments, <tt>%n</tt>, <tt>%m</tt> or
+ * wide characters are always formatted right away. A deferred body is only
+ * the duplicate of one sent with the same format string and arguments.
+ *
  * @param[in] ens The ENS context.
  * @param[in] id The group ID to queue an email for.
  * @param[in] subject The subject of the email.
  * @param[in] fmt The printf() styled format string for the body of the email.
  * @return ENS_ERROR_OK The email was queued succesfully.
  *         ENS_ERROR_MEMORY: Memory allocation failed.
+ *         ENS_ERROR_FORMAT: The body couldn't be formatted.
  *         ENS_ERROR_NOT_REGISTERED: The group is not registered.
  *         ENS_ERROR_NOT_READY: The email was not queued because the group's
  *                              mode is ENS_GROUP_MODE_DROP and its timeout
  *                              has not expired yet.
+ *         ENS_ERROR_DUPLICATE: The email was not queued because the group
+ *                              sent the same email within its duplicate
+ *                              window.
+ *         ENS_ERROR_FULL: The email was not queued because the group or
+ *                         the context has as many emails queued as it's
+ *                         allowed.
 
  */
 int ens_group_sendf(ens_t *ens, ens_group_id_t id, const char *subject, const char *fmt, ...);
 
+/**
+ * @brief Queues an email for the group with a body made of several pieces.
+ *
+ * Does the same thing as ens_group_send() but the body is the pieces in
+ * <tt>iov</tt> one after another, so they don't need to be joined together
+ * first. They're copied straight into the email. The pieces are text and must
+ * not contain NUL characters.
+ *
+ * @param[in] ens The ENS context.
+ * @param[in] id The group ID to queue an email for.
+ * @param[in] subject The subject of the email.
+ * @param[in] iov The pieces of the body.
+ * @param[in] iovcnt The number of pieces.
+ * @return ENS_ERROR_OK The email was queued succesfully.
+ *         ENS_ERROR_MEMORY: Memory allocation failed.
+ *         ENS_ERROR_NOT_REGISTERED: The group is not registered.
+ *         ENS_ERROR_NOT_READY: The email was not queued because the group's
+ *                              mode is ENS_GROUP_MODE_DROP and its timeout
+ *                              has not expired yet.
+ *         ENS_ERROR_DUPLICATE: The email was not queued because the group
+ *                              sent the same email within its duplicate
+ *                              window.
+ *         ENS_ERROR_FULL: The email was not queued because the group or
+ *                         the context has as many emails queued as it's
+ *                         allowed.
+ */
+int ens_group_sendv(ens_t *ens, ens_group_id_t id, const char *subject, const struct iovec *iov, int iovcnt);
+
+/**
+ * @brief Queues several emails for the group within this ENS context.
+ *
+ * Does the same thing as calling ens_group_send() for each message, in order,
+ * but the group is only looked up and locked once for the whole batch. The
+ * <tt>id</tt> of each message is ignored. If the group can't be scheduled for
+ * lack of memory, that's logged and the emails stay queued, so their results
+ * are still ENS_ERROR_OK and they're counted as queued.
+ *
+ * @param[in] ens The ENS context.
+ * @param[in] id The group ID to queue the emails for.
+ * @param[in] msgs The emails.
+ * @param[in] n The number of emails.
+ * @param[out] results If not <tt>NULL</tt>, room for <tt>n</tt> results, set
+ *                     to what ens_group_send() would have returned for each
+ *                     message.
+ * @return The number of emails that were queued.
+ */
+size_t ens_group_send_batch(ens_t *ens, ens_group_id_t id, const ens_message_t *msgs, size_t n, int *results);
+
+/**
+ * @brief Queues several emails for any groups within this ENS context.
+ *
+ * Does the same thing as ens_group_send_batch() but each message is queued
+ * for the group in its <tt>id</tt>. Each run of messages for the same group
+ * is locked once, so sort the messages by group to get the most out of it.
+ *
+ * @param[in] ens The ENS context.
+ * @param[in] msgs The emails.
+ * @param[in] n The number of emails.
+ * @param[out] results If not <tt>NULL</tt>, room for <tt>n</tt> results, set
+ *                     to what ens_group_send() would have returned for each
+ *                     message.
+ * @return The number of emails that were queued.
+ */
+size_t ens_send_batch(ens_t *ens, const ens_message_t *msgs, size_t n, int *results);
+
+/**
+ * @brief Gets a handle to the group identified by <tt>id</tt> within this ENS
+ * context.
+ *
+ * Sending through the handle with ens_group_send_h() or ens_group_sendf_h()
+ * skips looking the group up and locking the context's groups, so it's meant
+ * to be acquired once and kept by code that sends often. The handle keeps the
+ * group's memory alive even if the group is unregistered, after which sends
+ * through it fail with ENS_ERROR_NOT_REGISTERED. Registering the same ID again
+ * makes a new group that the old handle doesn't refer to. The handle must be
+ * released with ens_group_release() before the context is freed.
+ *
+ * @param[in] ens The ENS context.
+ * @param[in] id The group ID.
+ * @return The handle, or <tt>NULL</tt> if the group is not registered or
+ * memory allocation failed.
+ */
+ens_group_handle_t * ens_group_acquire(ens_t *ens, ens_group_id_t id);
+
+/**
+ * @brief Releases a handle from ens_group_acquire().
+ *
+ * @param[in] handle The handle.
+ */
+void ens_group_release(ens_group_handle_t *handle);
+
+/**
+ * @brief Queues an email for the handle's group.
+ *
+ * Does the same thing as ens_group_send().
+ *
+ * @param[in] handle The group's handle.
+ * @param[in] subject The subject of the email.
+ * @param[in] body The body of the email.
+ * @return ENS_ERROR_OK The email was queued succesfully.
+ *         ENS_ERROR_MEMORY: Memory allocation failed.
+ *         ENS_ERROR_NOT_REGISTERED: The group has been unregistered.
+ *         ENS_ERROR_NOT_READY: The email was not queued because the group's
+ *                              mode is ENS_GROUP_MODE_DROP and its timeout
+ *                              has not expired yet.
+ *         ENS_ERROR_DUPLICATE: The email was not queued because the group
+ *                              sent the same email within its duplicate
+ *                              window.
+ *         ENS_ERROR_FULL: The email was not queued because the group or
+ *                         the context has as many emails queued as it's
+ *                         allowed.
+ */
+int ens_group_send_h(ens_group_handle_t *handle, const char *subject, const char *body);
+
+/**
+ * @brief Queues an email for the handle's group.
+ *
+ * Does the same thing as ens_group_sendf().
+ *
+ * @param[in] handle The group's handle.
+ * @param[in] subject The subject of the email.
+ * @param[in] fmt The printf() styled format string for the body of the email.
+ * @return ENS_ERROR_OK The email was queued succesfully.
+ *         ENS_ERROR_MEMORY: Memory allocation failed.
+ *         ENS_ERROR_FORMAT: The body couldn't be formatted.
+ *         ENS_ERROR_NOT_REGISTERED: The group has been unregistered.
+ *         ENS_ERROR_NOT_READY: The email was not queued because the group's
+ *                              mode is ENS_GROUP_MODE_DROP and its timeout
+ *                              has not expired yet.
+ *         ENS_ERROR_DUPLICATE: The email was not queued because the group
+ *                              sent the same email within its duplicate
+ *                              window.
+ *         ENS_ERROR_FULL: The email was not queued because the group or
+ *                         the context has as many emails queued as it's
+ *                         allowed.
+ */
+int ens_group_sendf_h(ens_group_handle_t *handle, const char *subject, const char *fmt, ...);
+
+/**
+ * @brief Queues an email for the group without copying its subject or body.
+ *
+ * Does the same thing as ens_group_send() but takes ownership of the subject
+ * and body instead of copying them. <tt>free_fn</tt> is called on each of them
+ * once the email has been sent or discarded, which may be on another thread.
+ * The context always takes ownership, even if the email isn't queued, so the
+ * caller must not touch either buffer after calling this.
+ *
+ * @param[in] ens The ENS context.
+ * @param[in] id The group ID to queue an email for.
+ * @param[in] subject The subject of the email.
+ * @param[in] body The body of the email.
+ * @param[in] free_fn The function to free the subject and body with, or
+ *                    <tt>NULL</tt> to use free().
+ * @return ENS_ERROR_OK The email was queued succesfully.
+ *         ENS_ERROR_MEMORY: Memory allocation failed.
+ *         ENS_ERROR_NOT_REGISTERED: The group is not registered.
+ *         ENS_ERROR_NOT_READY: The email was not queued because the group's
+ *                              mode is ENS_GROUP_MODE_DROP and its timeout
+ *                              has not expired yet.
+ *         ENS_ERROR_DUPLICATE: The email was not queued because the group
+ *                              sent the same email within its duplicate
+ *                              window.
+ *         ENS_ERROR_FULL: The email was not queued because the group or
+ *                         the context has as many emails queued as it's
+ *                         allowed.
+ */
+int ens_group_send_owned(ens_t *ens, ens_group_id_t id, char *subject, char *body, ens_free_function_t free_fn);
+
+/**
+ * @brief Creates a body that can be shared by many emails.
+ *
+ * Takes ownership of <tt>body</tt> and wraps it in a reference counted
+ * ens_body_t that can be passed to ens_group_send_shared() any number of
+ * times, for any group or context, without the body being copied. The body
+ * starts with one reference that belongs to the caller and must be given up
+ * with ens_body_unref(). <tt>free_fn</tt> is called on the body once the
+ * last reference is gone. If this fails the body is freed right away.
+ *
+ * @param[in] body The body of the email.
+ * @param[in] free_fn The function to free the body with, or <tt>NULL</tt> to
+ *                    use free().
+ * @return The shared body, or <tt>NULL</tt> if memory allocation failed.
+ */
+ens_body_t * ens_body_init(char *body, ens_free_function_t free_fn);
+
+/**
+ * @brief Gives up the caller's reference to a shared body.
+ *
+ * Emails that are still queued keep their own references, so the body is only
+ * freed once they're done with it.
+ *
+ * @param[in] body The shared body.
+ */
+void ens_body_unref(ens_body_t *body);
+
+/**
+ * @brief Queues an email for the group with a shared body.
+ *
+ * Does the same thing as ens_group_send() but references the shared body
+ * instead of copying it. The subject is still copied. The caller keeps its
+ * own reference to the body.
+ *
+ * @param[in] ens The ENS context.
+ * @param[in] id The group ID to queue an email for.
+ * @param[in] subject The subject of the email.
+ * @param[in] body The shared body of the email.
+ * @return ENS_ERROR_OK The email was queued succesfully.
+ *         ENS_ERROR_MEMORY: Memory allocation failed.
+ *         ENS_ERROR_NOT_REGISTERED: The group is not registered.
+ *         ENS_ERROR_NOT_READY: The email was not queued because the group's
+ *                              mode is ENS_GROUP_MODE_DROP and its timeout
+ *                              has not expired yet.
+ *         ENS_ERROR_DUPLICATE: The email was not queued because the group
+ *                              sent the same email within its duplicate
+ *                              window.
+ *         ENS_ERROR_FULL: The email was not queued because the group or
+ *                         the context has as many emails queued as it's
+ *                         allowed.
+ */
+int ens_group_send_shared(ens_t *ens, ens_group_id_t id, const char *subject, ens_body_t *body);
+
 /**
  * @brief Set an option for this ENS context.
  *
@@ -285,12 +636,81 @@ int ens_group_sendf(ens_t *ens, ens_group_id_t id, const char *subject, const ch
  */
 int ens_set_option(ens_t *ens, ens_option_t option, ...);
 
+/**
+ * @brief Get information about this ENS context.
+ *
+ * Retrieves information about the ENS context, such as how often SMTP
+ * connections were reused. SMTP connections are kept open for
+ * ENS_OPTION_CONNECTION_IDLE_TIMEOUT seconds after an email is sent and are
+ * reused by any group sending to the same host with the same username and
+ * certificate authority.
+ *
+ * @param[in] ens The ENS context.
+ * @param[in] info The information to retrieve.
+ * @param[out] ... A pointer to store the information in.
+ * @return ENS_ERROR_OK: The information was retrieved successfully.
+ *         ENS_ERROR_UNKNOWN_OPTION: An unknown info was supplied.
+ */
+int ens_get_info(ens_t *ens, ens_info_t info, ...);
+
 /**
  * @brief Set an option for the group identified by <tt>id</tt> witin this ENS
  * context.
  *
  * Sets an option for the group within this ENS context.
  *
+ * ENS_GROUP_OPTION_THREAD_BATCH is meant for COLLECT groups that many threads
+ * send to at once. Each thread keeps its own batch of up to that many emails
+ * for the group, which is handed off when it fills up, when the group's
+ * interval expires, or when the thread exits, so sending threads don't fight
+ * over the group's queue. Each thread's emails stay in the order they were
+ * sent, and the emails in a digest are ordered by when they were sent. DROP
+ * groups ignore this option.
+ *
+ * ENS_GROUP_OPTION_DEFERRED_FORMAT defers the formatting done by
+ * ens_group_sendf() until the email is sent. See ens_group_sendf() for what
+ * that requires of the format string.
+ *
+ * ENS_GROUP_OPTION_COALESCE makes a COLLECT group include each different email
+ * in a digest only once, with a line saying how many times it was sent and
+ * when it was first and last sent. Emails are the same only if their subjects
+ * and bodies match exactly. Once the digest has that many different emails,
+ * any new ones are left out and the digest ends with a count of them and an
+ * estimate of how many of them were different. Coalescing bypasses
+ * ENS_GROUP_OPTION_THREAD_BATCH, and DROP groups ignore it.
+ *
+ * ENS_GROUP_OPTION_DUPLICATE_WINDOW makes a DROP group reject an email with
+ * ENS_ERROR_DUPLICATE if an email with the same subject and body was accepted
+ * within the window, checked before the email is copied. The group remembers
+ * emails in Bloom filters, so memory use is fixed by
+ * ENS_GROUP_OPTION_DUPLICATE_CAPACITY and
+ * ENS_GROUP_OPTION_DUPLICATE_ERROR_RATE, and an email is remembered for
+ * between one and two windows. Past the capacity, more new emails are wrongly
+ * rejected. Setting any of these options forgets every email sent so far.
+ * COLLECT groups ignore them.
+ *
+ * ENS_GROUP_OPTION_MAX_EMAILS and ENS_GROUP_OPTION_MAX_BYTES limit the emails
+ * the group has queued, alongside ENS_OPTION_MAX_EMAILS and
+ * ENS_OPTION_MAX_BYTES for every group together. An email counts from when
+ * it's queued until it's been sent, and its bytes are its subject and body
+ * plus some overhead. A body shared with ens_group_send_shared() isn't
+ * counted. ENS_GROUP_OPTION_OVERFLOW says what happens to an email that would
+ * go over a limit: it's rejected with ENS_ERROR_FULL, the group's oldest
+ * emails are dropped to make room, or its body is truncated. Emails still
+ * in a sending thread's ENS_GROUP_OPTION_THREAD_BATCH can't be dropped to
+ * make room, and only COLLECT groups that don't use ENS_GROUP_OPTION_COALESCE
+ * drop their oldest emails. ens_group_get_info() tells how much the group has queued and
+ * how many emails were dropped or truncated.
+ *
+ * ENS_GROUP_OPTION_SAMPLE_SIZE and ENS_GROUP_OPTION_SAMPLE_EDGES size what a
+ * SAMPLE group keeps of each interval's emails, with reservoir sampling, so
+ * neither its memory nor the email it sends grows with the number of emails.
+ * The first and last emails are kept on top of the sample, which is taken
+ * from the ones in between, and every email kept is sent in the order it was
+ * sent in. Changes apply from the next interval. A SAMPLE group ignores
+ * ENS_GROUP_OPTION_THREAD_BATCH and ENS_GROUP_OPTION_COALESCE, and doesn't
+ * drop its oldest emails to make room, since it already drops emails.
+ *
  * @param[in] ens The ENS context
  * @param[in] id The group ID to set the option for.
  * @param[in] option The option.
@@ -300,3 +720,20 @@ int ens_set_option(ens_t *ens, ens_option_t option, ...);
  *         Various other others.
  */
 int ens_group_set_option(ens_t *ens, ens_group_id_t id, ens_group_option_t option, ...);
+
+/**
+ * @brief Get information about the group identified by <tt>id</tt> within
+ * this ENS context.
+ *
+ * Retrieves information about the group, such as how many emails it has
+ * queued and how much memory they take up.
+ *
+ * @param[in] ens The ENS context.
+ * @param[in] id The group ID to get the information for.
+ * @param[in] info The information to retrieve.
+ * @param[out] ... A pointer to store the information in.
+ * @return ENS_ERROR_OK: The information was retrieved successfully.
+ *         ENS_ERROR_NOT_REGISTERED: The group is not registered.
+ *         ENS_ERROR_UNKNOWN_OPTION: An unknown info was supplied.
+ */
+int ens_group_get_info(ens_t *ens, ens_group_id_t id, ens_group_info_t info, ...);
@@ -0,0 +1,171 @@
+/**
+ * @file arena.c
+ */
+
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include "arena.h"
+
+/**
+ * @brief A block of memory that allocations are bumped out of.
+ */
+typedef struct arena_block_t {
+    struct arena_block_t *next;                 //!< The next block in the arena or on the spare list.
+    atomic_size_t used;                         //!< The number of bytes claimed, which may run past the end.
+    alignas(max_align_t) unsigned char data[];  //!< The memory handed out.
+} arena_block_t;
+
+/**
+ * @brief The arena.
+ *
+ * Allocations only touch the current block. The mutex is taken when the
+ * current block fills up and a new one has to be installed.
+ */
+struct arena_t {
+    arena_block_t *_Atomic current; //!< The block being allocated from.
+    arena_block_t *blocks;          //!< Every block in use, newest first.
+    arena_block_t *spare;           //!< Blocks kept for reuse.
+    unsigned int spare_count;       //!< The number of spare blocks.
+    unsigned int spare_max;         //!< The maximum number of spare blocks.
+    size_t block_size;              //!< The usable size of each block.
+    pthread_mutex_t mutex;          //!< Held while changing blocks.
+};
+
+arena_t *
+arena_init(size_t block_size, unsigned int spare_max) {
+    arena_t *arena;
+
+    arena = calloc(1, sizeof(*arena));
+    if (arena == NULL) {
+        return NULL;
+    }
+
+    if (pthread_mutex_init(&arena->mutex, NULL) != 0) {
+        free(arena);
+        return NULL;
+    }
+
+    atomic_init(&arena->current, NULL);
+    arena->spare_max = spare_max;
+    arena->block_size = block_size;
+
+    return arena;
+}
+
+static void
+arena_blocks_free(arena_block_t *block) {
+    arena_block_t *next;
+
+    while (block != NULL) {
+        next = block->next;
+        free(block);
+        block = next;
+    }
+}
+
+void
+arena_free(arena_t *arena) {
+    if (arena == NULL) {
+        return;
+    }
+
+    arena_blocks_free(arena->blocks);
+    arena_blocks_free(arena->spare);
+    pthread_mutex_destroy(&arena->mutex);
+
+    free(arena);
+}
+
+/**
+ * Replaces the full block with a spare or a new one, unless another thread
+ * already did.
+ */
+static bool
+arena_grow(arena_t *arena, arena_block_t *full) {
+    arena_block_t *block;
+    bool success = true;
+
+    pthread_mutex_lock(&arena->mutex);
+
+    if (atomic_load_explicit(&arena->current, memory_order_relaxed) != full) {
+        goto done;
+    }
+
+    if (arena->spare != NULL) {
+        block = arena->spare;
+        arena->spare = block->next;
+        --arena->spare_count;
+    }
+    else {
+        block = malloc(sizeof(*block) + arena->block_size);
+        if (block == NULL) {
+            success = false;
+            goto done;
+        }
+    }
+
+    atomic_init(&block->used, 0);
+    block->next = arena->blocks;
+    arena->blocks = block;
+
+    atomic_store_explicit(&arena->current, block, memory_order_release);
+
+done:
+    pthread_mutex_unlock(&arena->mutex);
+
+    return success;
+}
+
+void *
+arena_alloc(arena_t *arena, size_t size) {
+    arena_block_t *block;
+    size_t offset;
+
+    //keep every allocation aligned for any type
+    size = (size + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+    if (size == 0 || size > arena->block_size) {
+        return NULL;
+    }
+
+    for (;;) {
+        block = atomic_load_explicit(&arena->current, memory_order_acquire);
+        if (block != NULL) {
+            offset = atomic_fetch_add_explicit(&block->used, size, memory_order_relaxed);
+            if (offset + size <= arena->block_size) {
+                return block->data + offset;
+            }
+        }
+
+        if (!arena_grow(arena, block)) {
+            return NULL;
+        }
+    }
+}
+
+void
+arena_reset(arena_t *arena) {
+    arena_block_t *block, *next;
+
+    pthread_mutex_lock(&arena->mutex);
+
+    for (block = arena->blocks; block != NULL; block = next) {
+        next = block->next;
+
+        if (arena->spare_count < arena->spare_max) {
+            block->next = arena->spare;
+            arena->spare = block;
+            ++arena->spare_count;
+        }
+        else {
+            free(block);
+        }
+    }
+
+    arena->blocks = NULL;
+    atomic_store_explicit(&arena->current, NULL, memory_order_relaxed);
+
+    pthread_mutex_unlock(&arena->mutex);
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+/**
+ * @file arena.h
+ * @author Scott Newman
+ *
+ * @brief A bump allocator that is freed all at once.
+ *
+ * Memory is handed out from fixed size blocks by bumping an offset, so an
+ * allocation is a single atomic add and several threads may allocate from the
+ * arena at the same time. Individual allocations are never freed. Instead the
+ * whole arena is reset in one go, and its blocks are kept for reuse up to a
+ * limit.
+ */
+
+#include <stddef.h>
+
+typedef struct arena_t arena_t;
+
+/**
+ * @brief Initializes the arena.
+ *
+ * No blocks are allocated until the first allocation.
+ *
+ * @param[in] block_size The size of each block in bytes. This is also the
+ * largest allocation the arena can make.
+ * @param[in] spare_max The maximum number of blocks kept for reuse when the
+ * arena is reset.
+ * @return A pointer to the arena, or <tt>NULL</tt> if not enough memory was
+ * available.
+ */
+arena_t * arena_init(size_t block_size, unsigned int spare_max);
+
+/**
+ * @brief Frees the arena and all of the memory allocated from it.
+ *
+ * @param[in] arena The arena.
+ */
+void arena_free(arena_t *arena);
+
+/**
+ * @brief Allocates memory from the arena.
+ *
+ * The memory is suitably aligned for any type. This function may be called
+ * from several threads at once.
+ *
+ * @param[in] arena The arena.
+ * @param[in] size The number of bytes to allocate.
+ * @return A pointer to the memory, or <tt>NULL</tt> if the size is bigger than
+ * a block or not enough memory was available.
+ */
+void * arena_alloc(arena_t *arena, size_t size);
+
+/**
+ * @brief Frees everything allocated from the arena.
+ *
+ * No other thread may be using the arena or any memory allocated from it.
+ *
+ * @param[in] arena The arena.
+ */
+void arena_reset(arena_t *arena);
@@ -4,12 +4,66 @@
 #include <string.h>
 #include "buffer.h"
 
+#define BUFFER_CHUNK_MIN 256 //!< The smallest chunk that's allocated.
+
+/**
+ * @brief A piece of the buffer's data.
+ */
+typedef struct buffer_chunk_t {
+    struct buffer_chunk_t *next; //!< The next chunk.
+    size_t capacity;             //!< The size of data.
+    size_t len;                  //!< The number of bytes used.
+    unsigned char data[];        //!< The chunk's data.
+} buffer_chunk_t;
+
+/**
+ * @brief The buffer.
+ *
+ * The data is kept in a chain of chunks that are never moved once they're
+ * written, so growing the buffer doesn't copy what's already there. Each new
+ * chunk is at least as big as everything before it, so there are only ever a
+ * few of them.
+ */
 struct buffer_t {
-    unsigned char *data;
-    size_t capacity;
-    size_t len;
+    buffer_chunk_t *head; //!< The first chunk.
+    buffer_chunk_t *tail; //!< The chunk being written to.
+    size_t len;           //!< The total number of bytes in every chunk.
 };
 
+/**
+ * Adds a chunk with room for at least <tt>len</tt> bytes to the end of the
+ * buffer.
+ */
+static buffer_chunk_t *
+buffer_chunk_add(buffer_t *buffer, size_t len) {
+    buffer_chunk_t *chunk;
+    size_t capacity;
+
+    capacity = buffer->len > BUFFER_CHUNK_MIN ? buffer->len : BUFFER_CHUNK_MIN;
+    if (capacity < len) {
+        capacity = len;
+    }
+
+    chunk = malloc(sizeof(*chunk) + capacity);
+    if (chunk == NULL) {
+        return NULL;
+    }
+
+    chunk->next = NULL;
+    chunk->capacity = capacity;
+    chunk->len = 0;
+
+    if (buffer->tail != NULL) {
+        buffer->tail->next = chunk;
+    }
+    else {
+        buffer->head = chunk;
+    }
+    buffer->tail = chunk;
+
+    return chunk;
+}
+
 buffer_t *
 buffer_init() {
     return buffer_init_ex(0);
@@ -24,18 +78,23 @@ buffer_init_ex(size_t capacity) {
         return NULL;
     }
 
-    if (capacity > 0) {
-        buffer->data = malloc(capacity);
-        if (buffer->data == NULL) {
-            free(buffer);
-            return false;
-        }
-
-        buffer->capacity = capacity;
+    if (capacity > 0 && buffer_chunk_add(buffer, capacity) == NULL) {
+        free(buffer);
+        return NULL;
     }
 
     return buffer;
+}
+
+static void
+buffer_chunks_free(buffer_chunk_t *chunk) {
+    buffer_chunk_t *next;
 
+    while (chunk != NULL) {
+        next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
 }
 
 void
@@ -44,9 +103,7 @@ buffer_free(buffer_t *buffer) {
         return;
     }
 
-    if (buffer->data != NULL) {
-        free(buffer->data);
-    }
+    buffer_chunks_free(buffer->head);
 
     free(buffer);
 }
@@ -56,65 +113,114 @@ buffer_length(buffer_t *buffer) {
     return buffer->len;
 }
 
-const unsigned char *
-buffer_data(buffer_t *buffer) {
-    return buffer->data;
-}
+int
+buffer_iovec(buffer_t *buffer, struct iovec *iov, int iovcnt) {
+    buffer_chunk_t *chunk;
+    int count = 0;
 
-static bool
-buffer_grow(buffer_t *buffer, size_t len) {
-    unsigned char *new_data;
-    size_t new_capacity;
+    for (chunk = buffer->head; chunk != NULL; chunk = chunk->next) {
+        if (chunk->len == 0) {
+            continue;
+        }
 
-    if (buffer->capacity == 0) {
-        new_capacity = len * 4;
-    }
-    else {
-        new_capacity = (buffer->capacity * 2) + (len * 2);
+        if (count < iovcnt) {
+            iov[count].iov_base = chunk->data;
+            iov[count].iov_len = chunk->len;
+        }
+        ++count;
     }
 
-    new_data = realloc(buffer->data, new_capacity);
-    if (new_data == NULL) {
-        return false;
-    }
+    return count;
+}
 
-    buffer->data = new_data;
-    buffer->capacity = new_capacity;
+void
+buffer_clear(buffer_t *buffer) {
+    buffer_chunk_t *next;
+
+    //keep the last chunk since it's the biggest
+    while (buffer->head != buffer->tail) {
+        next = buffer->head->next;
+        free(buffer->head);
+        buffer->head = next;
+    }
 
-    return true;
+    if (buffer->tail != NULL) {
+        buffer->tail->len = 0;
+    }
+    buffer->len = 0;
 }
 
 bool
 buffer_write(buffer_t *buffer, unsigned char *data, size_t len) {
-    if (buffer->len + len > buffer->capacity) {
-        if (!buffer_grow(buffer, len)) {
-            return false;
+    buffer_chunk_t *chunk;
+    size_t n;
+
+    chunk = buffer->tail;
+    buffer->len += len;
+
+    //fill up what's left of the last chunk before adding another
+    if (chunk != NULL) {
+        n = chunk->capacity - chunk->len;
+        if (n > len) {
+            n = len;
         }
+
+        memcpy(chunk->data + chunk->len, data, n);
+        chunk->len += n;
+        data += n;
+        len -= n;
     }
 
-    memcpy(buffer->data + buffer->len, data, len);
-    buffer->len += len;
+    if (len > 0) {
+        chunk = buffer_chunk_add(buffer, len);
+        if (chunk == NULL) {
+            buffer->len -= len;
+            return false;
+        }
+
+        memcpy(chunk->data, data, len);
+        chunk->len = len;
+    }
 
     return true;
 }
 
 bool
 buffer_writef(buffer_t *buffer, const char *fmt, ...) {
-    char *buf;
+    buffer_chunk_t *chunk;
+    size_t room = 0;
     va_list ap;
     int len;
-    bool success;
 
+    chunk = buffer->tail;
+    if (chunk != NULL) {
+        room = chunk->capacity - chunk->len;
+    }
+
+    //format straight into the last chunk, with room for vsnprintf()'s NUL
     va_start(ap, fmt);
-    len = vasprintf(&buf, fmt, ap);
+    len = vsnprintf(chunk != NULL ? (char *)chunk->data + chunk->len : NULL, room, fmt, ap);
     va_end(ap);
 
-    if (len == -1) {
+    if (len < 0) {
         return false;
     }
 
-    success = buffer_write(buffer, (unsigned char *)buf, len);
-    free(buf);
+    //it didn't fit, so it goes in a new chunk and the rest of this one is
+    //left unused
+    if ((size_t)len >= room) {
+        chunk = buffer_chunk_add(buffer, len + 1);
+        if (chunk == NULL) {
+            return false;
+        }
+
+        va_start(ap, fmt);
+        vsnprintf((char *)chunk->data, len + 1, fmt, ap);
+        va_end(ap);
+    }
 
-    return success;
+    chunk->len += len;
+    buffer->len += len;
+
+    return true;
 }
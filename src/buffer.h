@@ -8,6 +8,7 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <sys/uio.h>
 
 typedef struct buffer_t buffer_t;
 
@@ -42,12 +43,24 @@ void buffer_free(buffer_t *buffer);
 size_t buffer_length(buffer_t *buffer);
 
 /**
- * Returns a pointer to the buffer's data.
+ * Describes the buffer's data, which is kept in several chunks, as an iovec
+ * array that can be handed to writev() or copied out piece by piece. The
+ * pointers stay valid until the buffer is cleared or freed.
  *
  * @param[in] buffer The buffer.
- * @return A pointer to the buffer's data.
+ * @param[out] iov Room for <tt>iovcnt</tt> entries.
+ * @param[in] iovcnt The number of entries in <tt>iov</tt>.
+ * @return The number of entries the whole buffer needs, which is more than
+ * <tt>iovcnt</tt> if only some of it was described.
  */
-const unsigned char * buffer_data(buffer_t *buffer);
+int buffer_iovec(buffer_t *buffer, struct iovec *iov, int iovcnt);
+
+/**
+ * Empties the buffer, keeping its memory for the next writes.
+ *
+ * @param[in] buffer The buffer.
+ */
+void buffer_clear(buffer_t *buffer);
 
 /**
  * Writes <tt>len</tt> bytes of data from the pointer pointing to
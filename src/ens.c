@@ -7,11 +7,23 @@
 #include <string.h>
 #include <time.h>
 #include <errno.h>
+#include <math.h>
+#include <dlfcn.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <curl/curl.h>
 #include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include "alist.h"
+#include "arena.h"
 #include "buffer.h"
+#include "format.h"
+#include "heap.h"
+#include "hmap.h"
+#include "pool.h"
 #include "queue.h"
 #include "../api/ens.h"
 
@@ -25,13 +37,65 @@
 #define ENS_PASSWORD_MAX_LEN 255
 #define ENS_PATH_MAX_LEN     255
 
+#define ENS_POOL_KEY_MAX_LEN (ENS_HOST_MAX_LEN + ENS_USERNAME_MAX_LEN + ENS_PATH_MAX_LEN + 2)
+
+#define ENS_ASYNC_EVENTS 64
+
+#define ENS_EMAIL_CLASS_MIN_SHIFT 6         //the smallest size class is 64 bytes
+#define ENS_EMAIL_CLASSES         11        //and the largest is 64 KiB
+#define ENS_EMAIL_MAGAZINE_SIZE   64        //emails a thread keeps for itself per size class
+#define ENS_EMAIL_CACHE_BYTES     (1 << 20) //bytes kept on the shared free list per size class
+
+#define ENS_EPOCH_BLOCK_SIZE  65536 //bytes in each block of a COLLECT group's arena
+#define ENS_EPOCH_SPARE_MAX   16    //blocks each arena keeps after it's reset
+#define ENS_EPOCH_EMAIL_MAX   4096  //bigger emails are allocated on their own
+
+#define ENS_DROP_GATES_SHIFT 10 //the context has 1024 DROP gates
+#define ENS_DROP_GATES       (1 << ENS_DROP_GATES_SHIFT)
+
+//the value of a gate while the group with the ID has an email waiting
+#define ENS_DROP_GATE_ARMED(id) ((uint64_t)(uint32_t)(id) << 32 | 1)
+
+#define ENS_FORMATS_SHIFT 8 //the context caches up to 256 parsed format strings
+#define ENS_FORMATS       (1 << ENS_FORMATS_SHIFT)
+#define ENS_FORMAT_PROBES 8 //slots looked at for each format string
+
+#define ENS_COALESCE_MAX       (1 << 20) //the most distinct emails a digest can coalesce
+#define ENS_COALESCE_SLOTS     16        //slots a coalescing table starts with, doubled as it fills
+#define ENS_COALESCE_SEEN_BITS 4096      //bits for estimating how many distinct emails a full coalescing table dropped
+
+#define ENS_SAMPLE_SIZE     10        //emails a SAMPLE group's reservoir holds by default
+#define ENS_SAMPLE_SIZE_MAX (1 << 16) //for the reservoir and for each of the first and last emails
+
+#define ENS_DEDUP_CAPACITY         1024      //emails a duplicate filter is sized for by default
+#define ENS_DEDUP_CAPACITY_MAX     (1 << 20)
+#define ENS_DEDUP_ERROR_RATE       10000     //parts per million of new emails taken for duplicates by default
+#define ENS_DEDUP_ERROR_RATE_MAX   999999
+#define ENS_DEDUP_HASHES_MAX       16
+
+#define ENS_KEY_BUF_LEN 512 //bodies that are captured or formatted before their email is made are kept on the stack up to this size
+
+#define ENS_FNV_OFFSET 14695981039346656037ULL
+#define ENS_FNV_PRIME  1099511628211ULL
+
+#define ENS_TLS_SESSIONS_MAGIC     "ENSTLS1\n"
+#define ENS_TLS_SESSIONS_FIELD_MAX 65536
+
 typedef struct {
-    uint64_t emails_sent;
-    uint64_t emails_total;
+    atomic_uint_fast64_t emails_sent;
+    atomic_uint_fast64_t emails_total;
+    atomic_uint_fast64_t emails_dropped;   //rejected or dropped for going over a limit
+    atomic_uint_fast64_t emails_truncated; //queued with a shortened body to stay under a limit
 } ens_group_stats_t;
 
+//queued emails and bytes, or the most allowed, where 0 means no limit
 typedef struct {
-    int mode;
+    atomic_size_t emails;
+    atomic_size_t bytes;
+} ens_usage_t;
+
+typedef struct {
+    atomic_int mode;
     time_t interval;
     alist_t *to;
     char host[ENS_HOST_MAX_LEN - 7 + 1]; //save room for smtp://
@@ -41,38 +105,306 @@ typedef struct {
     char ca_path[ENS_PATH_MAX_LEN + 1];
 } ens_config_t;
 
+//looked up at runtime since they were only added in cURL 8.12
+typedef CURLcode (*ens_ssls_export_cb_t)(CURL *, void *, const char *, const unsigned char *, size_t, const unsigned char *, size_t, curl_off_t, int, const char *, size_t);
+typedef CURLcode (*ens_ssls_export_t)(CURL *, ens_ssls_export_cb_t, void *);
+typedef CURLcode (*ens_ssls_import_t)(CURL *, const char *, const unsigned char *, size_t, const unsigned char *, size_t);
+
+typedef struct ens_shard_t ens_shard_t;
+typedef struct ens_coalesce_t ens_coalesce_t;
+typedef struct ens_dedup_t ens_dedup_t;
+typedef struct ens_sample_t ens_sample_t;
+
+//one of a COLLECT group's two arenas, reset once every email from it is freed
+typedef struct {
+    arena_t *arena;
+    atomic_uint writers; //threads allocating from the arena right now
+    atomic_uint live;    //emails allocated from the arena and not yet freed
+} ens_epoch_t;
+
+//a group's rendered TO and FROM, shared with the deliveries still using it
+typedef struct {
+    atomic_uint refs;
+    struct curl_slist *to;  //CURLOPT_MAIL_RCPT
+    buffer_t *headers;      //for the SMTP stream
+    buffer_t *file_headers; //for the group's file
+} ens_envelope_t;
+
 typedef struct {
     ens_group_id_t id;
     ens_config_t config;
     volatile time_t expires;
+    unsigned int schedule_index;
+    atomic_bool registered;           //read without any lock by sends through a handle
+    bool busy;
+    atomic_uint refs;
     ens_group_stats_t stats;
-    queue_t *emails;
+    queue_mpsc_t *emails;
+    atomic_uint pending;
+    atomic_uint thread_batch;
+    atomic_bool deferred_format;
+    ens_shard_t *shards;
+    int shard_key;                    //finds a thread's shard for the group, never reused
+    ens_epoch_t epochs[2];
+    atomic_uint epoch;                //epochs[epoch & 1] is the current one
     pthread_mutex_t emails_mutex;
+    ens_envelope_t *envelope;         //rendered when first needed, guarded by emails_mutex
+    atomic_uint coalesce_max;         //0 if repeated emails aren't coalesced
+    ens_coalesce_t *coalesce;         //created by the first email after each delivery
+    atomic_uint sample_size;          //SAMPLE groups' reservoir size
+    atomic_uint sample_edges;         //how many of the first and last emails SAMPLE groups keep
+    ens_sample_t *sample;             //created by the first email after each delivery
+    pthread_mutex_t coalesce_mutex;   //held while coalescing, sampling, dropping the oldest email and draining the queue
+    ens_dedup_t *_Atomic dedup;       //read without any lock by sends, NULL if duplicates aren't suppressed
+    ens_dedup_t *dedup_retired;       //filters that have been replaced, guarded by emails_mutex
+    unsigned int dedup_window;        //the duplicate filter's settings, guarded by emails_mutex
+    unsigned int dedup_capacity;
+    unsigned int dedup_error_rate;
+    ens_usage_t queued;               //the emails from the time they're queued until they're freed
+    ens_usage_t queued_max;
+    atomic_int overflow;              //what's done with an email that would go over a limit
+    ens_usage_t *context_queued;      //the context's count, which outlives the group
     char f_path[ENS_PATH_MAX_LEN + 1];
     FILE *f;
 } ens_group_t;
 
 struct ens_t {
     ens_config_t config;
+    ens_usage_t queued;     //every group's queued emails together
+    ens_usage_t queued_max;
     ens_log_function_t log_function;
     int log_level;
     void *log_user_data;
-    volatile bool running;
+    atomic_bool running;
     pthread_t thread;
-    alist_t *groups;
+    hmap_t *groups;
     pthread_rwlock_t groups_lock;
+    heap_t *schedule;
+    pthread_mutex_t schedule_mutex;
+    pthread_cond_t schedule_cond;
+    unsigned int worker_threads;
+    pthread_t *workers;
+    queue_t *work;
+    pthread_mutex_t work_mutex;
+    pthread_cond_t work_cond;
+    bool async;
+    int wake_fd;
+    int epoll_fd;
+    CURLM *multi;
+    int64_t multi_expires;
+    alist_t *transfers;
+    pool_t *pool;
+    pthread_mutex_t pool_mutex;
+    time_t pool_idle_timeout;
+    unsigned int max_host_connections;
+    atomic_uint_fast64_t connection_hits;
+    atomic_uint_fast64_t connection_misses;
+    CURLSH *share;
+    pthread_mutex_t share_mutex[CURL_LOCK_DATA_LAST];
+    char tls_sessions_path[ENS_PATH_MAX_LEN + 1];
+    pthread_mutex_t tls_sessions_mutex;
+    ens_ssls_export_t ssls_export;
+    ens_ssls_import_t ssls_import;
+    atomic_uint_fast64_t drop_gates[ENS_DROP_GATES]; //see ens_drop_gate()
+    format_t *_Atomic formats[ENS_FORMATS];          //see ens_format_get()
+};
+
+struct ens_body_t {
+    atomic_uint refs;
+    char *body;
+    ens_free_function_t free_function;
+};
+
+//a group reference that sends go through without a lookup
+struct ens_group_handle_t {
+    ens_t *ens;
+    ens_group_t *group;
 };
 
+//where an email's subject and body are kept
+typedef enum {
+    ENS_EMAIL_INLINE,   //both are copied into the email
+    ENS_EMAIL_OWNED,    //both are the caller's buffers, freed with free_function
+    ENS_EMAIL_SHARED,   //the subject is copied and the body is shared
+    ENS_EMAIL_DEFERRED, //the subject is copied and the body is a record of printf() arguments
+} ens_email_storage_t;
+
+//an email with its subject and body in one allocation, recycled by size class
 typedef struct {
+    queue_mpsc_node_t link; //first so a node can be cast back to its email
+    uint64_t timestamp;
+    ens_epoch_t *epoch;     //the arena the email came from, if any
+    struct ens_coalesce_entry_t *coalesced; //the repeats of the email, if its group coalesces them
+    unsigned int size_class;
+    size_t bytes;           //what the email counts for against its group's limits
+    ens_email_storage_t storage;
     char *subject;
     char *body;
+    union {
+        ens_free_function_t free_function; //ENS_EMAIL_OWNED
+        ens_body_t *shared;                //ENS_EMAIL_SHARED
+        const format_t *format;            //ENS_EMAIL_DEFERRED
+    };
+    char data[];
 } ens_email_t;
 
+//what an email is made from when it's sent
+typedef struct {
+    const char *subject;
+    const char *body;
+    ens_email_storage_t storage;
+    ens_free_function_t free_function; //ENS_EMAIL_OWNED
+    ens_body_t *shared;                //ENS_EMAIL_SHARED
+    va_list *ap;                       //ENS_EMAIL_DEFERRED
+    const struct iovec *iov;           //ENS_EMAIL_INLINE, the pieces of the body if it's NULL
+    int iovcnt;
+} ens_email_source_t;
+
+//the email a source would make, as it's hashed and compared before it's made
+typedef struct {
+    const char *subject;
+    const char *body;          //NULL if the body is in iov
+    size_t body_len;
+    const struct iovec *iov;
+    int iovcnt;
+    const format_t *format;    //set if the body is a record of printf() arguments
+    uint64_t hash;
+    bool truncated;            //the email made from it only has the start of the body
+    char *made;                //the body if it had to be captured or formatted, in buf if it fits
+    char buf[ENS_KEY_BUF_LEN];
+} ens_email_key_t;
+
+//a distinct email seen since the group was last sent, and how often
+typedef struct ens_coalesce_entry_t {
+    uint64_t hash;              //0 if the slot is empty
+    ens_email_t *email;         //the first one, which is the one queued
+    size_t body_len;            //the number of bytes of the body that are compared
+    bool truncated;             //only the start of the body was kept, so the hash stands in for the rest
+    unsigned int occurrences;
+    time_t first_seen;
+    time_t last_seen;
+} ens_coalesce_entry_t;
+
+//a coalescing group's distinct emails, and a count of the ones that didn't fit
+struct ens_coalesce_t {
+    ens_coalesce_t *next;          //a table taken earlier by the same delivery
+    ens_coalesce_entry_t *entries; //open addressing, at most half full
+    unsigned int mask;
+    unsigned int count;
+    unsigned int max;
+    unsigned int dropped;
+    uint64_t dropped_seen[ENS_COALESCE_SEEN_BITS / 64];
+};
+
+//a SAMPLE group's first and last emails and a reservoir of the ones between
+struct ens_sample_t {
+    uint64_t total;              //every email, which also numbers them
+    uint64_t middle;             //the emails that were neither first nor last
+    uint64_t random;             //xorshift64 state
+    unsigned int size;           //the reservoir's size
+    unsigned int edges;          //how many of the first and last emails are kept
+    unsigned int first_count;
+    unsigned int last_start;     //the oldest of the last emails, which are a ring
+    unsigned int last_count;
+    unsigned int reservoir_count;
+    ens_email_t **first;
+    ens_email_t **last;
+    ens_email_t **reservoir;
+    ens_email_t *emails[];       //every array above
+};
+
+//a DROP group's recent emails, as one Bloom filter per window
+struct ens_dedup_t {
+    ens_dedup_t *retired;              //the next filter that's been replaced
+    unsigned int window;               //seconds
+    unsigned int hashes;               //bits set for each email
+    uint64_t mask;                     //bits in each filter, less one
+    atomic_uint_fast64_t generation;   //the window the newer filter covers
+    pthread_mutex_t rotate_mutex;      //held while the older filter is cleared
+    atomic_uint_fast64_t *words;       //both filters, the newer one at (generation & 1)
+};
+
+//a thread's magazines of free emails, one per size class
+typedef struct {
+    queue_mpsc_node_t *emails[ENS_EMAIL_CLASSES];
+    unsigned int counts[ENS_EMAIL_CLASSES];
+} ens_email_cache_t;
+
+//only pushed onto or taken whole, so there's no ABA problem
+static queue_mpsc_node_t *_Atomic ens_email_free_lists[ENS_EMAIL_CLASSES];
+static atomic_uint ens_email_free_counts[ENS_EMAIL_CLASSES];
+
+static __thread ens_email_cache_t ens_email_cache;
+static __thread bool ens_email_cache_registered;
+static pthread_key_t ens_email_cache_key;
+static pthread_once_t ens_email_cache_once = PTHREAD_ONCE_INIT;
+static bool ens_email_cache_key_created;
+
+//a thread's batch of emails for a group with ENS_GROUP_OPTION_THREAD_BATCH set
+struct ens_shard_t {
+    _Alignas(64) queue_mpsc_node_t *_Atomic batch; //newest email first
+    unsigned int count;                            //only used by the thread
+    atomic_uint refs;
+    atomic_bool orphaned;                          //the thread exited
+    atomic_bool detached;                          //the group was freed
+    pthread_mutex_t mutex;                         //held while flushing or detaching
+    ens_group_t *group;
+    ens_shard_t *next;                             //guarded by the group's emails_mutex
+    int key;                                       //the group's shard_key
+};
+
+//the shards a thread has made, one per sharded group it sent to
+typedef struct {
+    ens_shard_t **shards;
+    unsigned int size;
+    unsigned int capacity;
+    hmap_t *index;                    //the shards by their key
+} ens_thread_shards_t;
+
+static atomic_int ens_shard_keys;
+
+//only for its destructor, lookups use the thread-local pointer
+static pthread_key_t ens_shards_key;
+static pthread_once_t ens_shards_once = PTHREAD_ONCE_INIT;
+static bool ens_shards_key_created;
+static __thread ens_thread_shards_t *ens_thread_shards;
+
+#define ENS_READ_IOV_MAX 64 //buffers grow geometrically, so this is far more chunks than any part has
+
+//how far email_read() has gotten through the email
+typedef enum {
+    ENS_READ_HEADERS, //the group's To: and From: lines
+    ENS_READ_SUBJECT, //the digest's subject line, COLLECT and SAMPLE groups only
+    ENS_READ_EMAILS,  //one email at a time
+    ENS_READ_DROPPED, //what the coalescing table had no room for
+    ENS_READ_DONE,
+    ENS_READ_ABORT,   //rendering failed, so the transfer is aborted
+} ens_read_state_t;
+
 typedef struct {
     ens_t *ens;
     ens_group_t *group;
+    int mode;
+    bool file;
+    bool tls;
+    time_t now;
+    queue_mpsc_node_t *emails;
+    queue_mpsc_node_t *emails_last;
+    unsigned int emails_count;
     buffer_t *buffer;
-} ens_curl_context_t;
+    ens_envelope_t *envelope;
+    ens_coalesce_t *coalesce;       //the repeats of the emails being sent, if the group coalesces them
+    uint64_t emails_left_out;       //the emails a SAMPLE group didn't keep
+    ens_read_state_t read_state;
+    struct iovec read_iov[ENS_READ_IOV_MAX]; //the chunks of the part of the email being copied out
+    int read_iovcnt;
+    int read_index;
+    size_t read_offset;                      //into read_iov[read_index]
+    unsigned int emails_read;
+    CURL *curl;
+    char pool_key[ENS_POOL_KEY_MAX_LEN + 1];
+    char error[CURL_ERROR_SIZE];
+} ens_delivery_t;
 
 int
 ens_version_major() {
@@ -89,664 +421,3840 @@ ens_version_patch() {
     return ENS_VERSION_PATCH;
 }
 
+//gives the chain to the shared free list, or frees it if the list is full
 static void
-ens_group_free(ens_group_t *group) {
-    if (group == NULL) {
+ens_email_cache_release(unsigned int size_class, queue_mpsc_node_t *first, unsigned int count) {
+    queue_mpsc_node_t *last, *next, *head;
+
+    if (atomic_load_explicit(&ens_email_free_counts[size_class], memory_order_relaxed) * (1U << (size_class + ENS_EMAIL_CLASS_MIN_SHIFT)) >= ENS_EMAIL_CACHE_BYTES) {
+        while (first != NULL) {
+            next = atomic_load_explicit(&first->next, memory_order_relaxed);
+            free(first);
+            first = next;
+        }
         return;
     }
 
-    if (group->config.to != NULL) {
-        alist_free_func(group->config.to, free);
+    for (last = first; (next = atomic_load_explicit(&last->next, memory_order_relaxed)) != NULL; last = next) {
     }
 
-    //zero out sensitive memory before unlocking the pages
-    memset(group->config.username, 0, sizeof(group->config.username));
-    memset(group->config.password, 0, sizeof(group->config.password));
+    atomic_fetch_add_explicit(&ens_email_free_counts[size_class], count, memory_order_relaxed);
 
-    munlock(group->config.username, sizeof(group->config.username));
-    munlock(group->config.password, sizeof(group->config.password));
+    head = atomic_load_explicit(&ens_email_free_lists[size_class], memory_order_relaxed);
+    do {
+        atomic_store_explicit(&last->next, head, memory_order_relaxed);
+    } while (!atomic_compare_exchange_weak_explicit(&ens_email_free_lists[size_class], &head, first, memory_order_release, memory_order_relaxed));
+}
 
-    if (group->emails != NULL) {
-        queue_free_func(group->emails, free);
-    }
+//gives an exiting thread's magazines to the shared free lists
+static void
+ens_email_cache_destructor(void *data) {
+    ens_email_cache_t *cache = data;
+    unsigned int i;
 
-    if (group->f != NULL) {
-        fclose(group->f);
+    for (i = 0; i < ENS_EMAIL_CLASSES; i++) {
+        if (cache->emails[i] != NULL) {
+            ens_email_cache_release(i, cache->emails[i], cache->counts[i]);
+            cache->emails[i] = NULL;
+            cache->counts[i] = 0;
+        }
     }
 
-    pthread_mutex_destroy(&group->emails_mutex);
+    ens_email_cache_registered = false;
+}
 
-    free(group);
+static void
+ens_email_cache_key_create() {
+    ens_email_cache_key_created = pthread_key_create(&ens_email_cache_key, ens_email_cache_destructor) == 0;
 }
 
-static ens_group_t *
-ens_group_init(ens_t *ens) {
-    ens_group_t *group;
-    unsigned int i;
-    char *to;
+//returns NULL if the magazines can't be given back when the thread exits
+static ens_email_cache_t *
+ens_email_cache_get() {
+    if (!ens_email_cache_registered) {
+        pthread_once(&ens_email_cache_once, ens_email_cache_key_create);
+        if (!ens_email_cache_key_created || pthread_setspecific(ens_email_cache_key, &ens_email_cache) != 0) {
+            return NULL;
+        }
 
-    group = calloc(1, sizeof(*group));
-    if (group == NULL) {
-        return NULL;
+        ens_email_cache_registered = true;
     }
 
-    group->config.mode = ens->config.mode;
-    group->config.interval = ens->config.interval;
+    return &ens_email_cache;
+}
 
-    group->config.to = alist_init();
-    if (group->config.to == NULL) {
-        goto fail;
+//sets the subject and body pointers but not their contents
+static ens_email_t *
+ens_email_init(size_t subject_len, size_t body_len) {
+    ens_email_cache_t *cache;
+    ens_email_t *email;
+    queue_mpsc_node_t *node;
+    unsigned int size_class, count;
+    size_t size;
+
+    size = sizeof(*email) + subject_len + 1 + body_len + 1;
+
+    for (size_class = 0; size_class < ENS_EMAIL_CLASSES; size_class++) {
+        if (size <= (size_t)1 << (size_class + ENS_EMAIL_CLASS_MIN_SHIFT)) {
+            break;
+        }
     }
-    for (i = 0; i < alist_size(ens->config.to); i++) {
-        to = strdup(alist_get(ens->config.to, i));
-        if (to == NULL) {
-            goto fail;
+
+    email = NULL;
+
+    cache = size_class < ENS_EMAIL_CLASSES ? ens_email_cache_get() : NULL;
+    if (cache != NULL) {
+        //refill the magazine with everything on the shared free list
+        if (cache->emails[size_class] == NULL) {
+            node = atomic_exchange_explicit(&ens_email_free_lists[size_class], NULL, memory_order_acquire);
+            cache->emails[size_class] = node;
+            for (count = 0; node != NULL; count++) {
+                node = atomic_load_explicit(&node->next, memory_order_relaxed);
+            }
+
+            atomic_fetch_sub_explicit(&ens_email_free_counts[size_class], count, memory_order_relaxed);
+            cache->counts[size_class] = count;
         }
 
-        if (!alist_add(group->config.to, to)) {
-            free(to);
-            goto fail;
+        node = cache->emails[size_class];
+        if (node != NULL) {
+            cache->emails[size_class] = atomic_load_explicit(&node->next, memory_order_relaxed);
+            --cache->counts[size_class];
+            email = (ens_email_t *)node;
         }
     }
 
-    if (ens->config.host[0] != '\0') {
-        strcpy(group->config.host, ens->config.host);
+    if (size_class < ENS_EMAIL_CLASSES) {
+        size = (size_t)1 << (size_class + ENS_EMAIL_CLASS_MIN_SHIFT);
     }
 
-    if (ens->config.from[0] != '\0') {
-        strcpy(group->config.from, ens->config.from);
+    if (email == NULL) {
+        email = malloc(size);
+        if (email == NULL) {
+            return NULL;
+        }
     }
 
-    if (mlock(group->config.username, sizeof(group->config.username)) != 0) {
-        goto fail;
-    }
-    if (ens->config.username[0] != '\0') {
-        strcpy(group->config.username, ens->config.username);
-    }
+    email->timestamp = 0;
+    email->epoch = NULL;
+    email->size_class = size_class;
+    email->storage = ENS_EMAIL_INLINE;
+    email->subject = email->data;
+    email->body = email->data + subject_len + 1;
 
-    if (mlock(group->config.password, sizeof(group->config.password)) != 0) {
-        goto fail;
+    return email;
+}
+
+//a full magazine goes to the shared free list for producers to reuse
+static void
+ens_email_free(ens_email_t *email) {
+    ens_email_cache_t *cache;
+    unsigned int size_class;
+
+    if (email == NULL) {
+        return;
     }
-    if (ens->config.password[0] != '\0') {
-        strcpy(group->config.password, ens->config.password);
+
+    switch (email->storage) {
+        case ENS_EMAIL_INLINE:
+            break;
+        case ENS_EMAIL_OWNED:
+            email->free_function(email->subject);
+            email->free_function(email->body);
+            break;
+        case ENS_EMAIL_SHARED:
+            ens_body_unref(email->shared);
+            break;
+        case ENS_EMAIL_DEFERRED:
+            break;
     }
 
-    if (ens->config.ca_path[0] != '\0') {
-        strcpy(group->config.ca_path, ens->config.ca_path);
+    //the arena's memory is reclaimed all at once when it's reset
+    if (email->epoch != NULL) {
+        atomic_fetch_sub(&email->epoch->live, 1);
+        return;
     }
 
-    group->emails = queue_init();
-    if (group->emails == NULL) {
-        goto fail;
+    size_class = email->size_class;
+    if (size_class >= ENS_EMAIL_CLASSES) {
+        free(email);
+        return;
     }
 
-    if (pthread_mutex_init(&group->emails_mutex, NULL) != 0) {
-        goto fail;
+    cache = ens_email_cache_get();
+    if (cache == NULL) {
+        free(email);
+        return;
     }
 
-    return group;
+    atomic_store_explicit(&email->link.next, cache->emails[size_class], memory_order_relaxed);
+    cache->emails[size_class] = &email->link;
 
-fail:
-    ens_group_free(group);
-    return NULL;
+    if (++cache->counts[size_class] >= ENS_EMAIL_MAGAZINE_SIZE) {
+        ens_email_cache_release(size_class, cache->emails[size_class], cache->counts[size_class]);
+        cache->emails[size_class] = NULL;
+        cache->counts[size_class] = 0;
+    }
 }
 
+//returns NULL if the email has to be allocated on its own
 static ens_email_t *
-ens_email_init() {
+ens_email_init_epoch(ens_group_t *group, size_t subject_len, size_t body_len) {
+    ens_epoch_t *epoch;
     ens_email_t *email;
+    unsigned int current;
+    size_t size;
 
-    email = calloc(1, sizeof(*email));
-    if (email == NULL) {
+    size = sizeof(*email) + subject_len + 1 + body_len + 1;
+    if (size > ENS_EPOCH_EMAIL_MAX) {
         return NULL;
     }
 
+    //make sure the epoch didn't move on before the writer was counted
+    for (;;) {
+        current = atomic_load(&group->epoch);
+        epoch = &group->epochs[current & 1];
+
+        atomic_fetch_add(&epoch->writers, 1);
+        if (atomic_load(&group->epoch) == current) {
+            break;
+        }
+        atomic_fetch_sub(&epoch->writers, 1);
+    }
+
+    email = arena_alloc(epoch->arena, size);
+    if (email != NULL) {
+        atomic_fetch_add(&epoch->live, 1);
+
+        email->timestamp = 0;
+        email->epoch = epoch;
+        email->size_class = ENS_EMAIL_CLASSES;
+        email->storage = ENS_EMAIL_INLINE;
+        email->subject = email->data;
+        email->body = email->data + subject_len + 1;
+    }
+
+    atomic_fetch_sub(&epoch->writers, 1);
+
     return email;
 }
 
-static void
-ens_email_free(ens_email_t *email) {
-    if (email == NULL) {
-        return;
+//only the thread delivering the group may reset its retired arena
+static bool
+ens_epoch_reset(ens_epoch_t *epoch) {
+    if (atomic_load(&epoch->writers) != 0 || atomic_load(&epoch->live) != 0) {
+        return false;
     }
 
-    if (email->subject != NULL) {
-        free(email->subject);
+    arena_reset(epoch->arena);
+
+    return true;
+}
+
+//stays on the current arena while an email from the other is still being queued
+static void
+ens_epoch_advance(ens_group_t *group) {
+    unsigned int current;
+
+    current = atomic_load(&group->epoch);
+    if (ens_epoch_reset(&group->epochs[(current + 1) & 1])) {
+        atomic_store(&group->epoch, current + 1);
     }
-    if (email->body != NULL) {
-        free(email->body);
+}
+
+//counts nothing and returns false if the email would go over the limits
+static bool
+ens_usage_reserve(ens_usage_t *usage, ens_usage_t *max, size_t bytes) {
+    size_t max_emails, max_bytes, emails, total;
+
+    max_emails = atomic_load_explicit(&max->emails, memory_order_relaxed);
+    max_bytes = atomic_load_explicit(&max->bytes, memory_order_relaxed);
+
+    emails = atomic_fetch_add_explicit(&usage->emails, 1, memory_order_relaxed) + 1;
+    total = atomic_fetch_add_explicit(&usage->bytes, bytes, memory_order_relaxed) + bytes;
+
+    //near the limit, emails that are taken back can make others fail too
+    if ((max_emails > 0 && emails > max_emails) || (max_bytes > 0 && total > max_bytes)) {
+        atomic_fetch_sub_explicit(&usage->emails, 1, memory_order_relaxed);
+        atomic_fetch_sub_explicit(&usage->bytes, bytes, memory_order_relaxed);
+        return false;
     }
 
-    free(email);
+    return true;
 }
 
-void
-ens_free(ens_t *ens) {
-    ens_group_t *group;
-    unsigned int i;
+static void
+ens_usage_release(ens_usage_t *usage, size_t bytes) {
+    atomic_fetch_sub_explicit(&usage->emails, 1, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&usage->bytes, bytes, memory_order_relaxed);
+}
 
-    if (ens == NULL) {
-        return;
+//counts the email against both the group's limits and the context's
+static bool
+ens_group_reserve(ens_t *ens, ens_group_t *group, size_t bytes) {
+    if (!ens_usage_reserve(&group->queued, &group->queued_max, bytes)) {
+        return false;
     }
 
-    if (ens->config.to != NULL) {
-        alist_free_func(ens->config.to, free);
+    if (!ens_usage_reserve(&ens->queued, &ens->queued_max, bytes)) {
+        ens_usage_release(&group->queued, bytes);
+        return false;
     }
 
-    //zero sensitive fields before unlocking pages
-    memset(ens->config.username, 0, sizeof(ens->config.username));
-    memset(ens->config.password, 0, sizeof(ens->config.password));
+    return true;
+}
 
-    munlock(ens->config.username, sizeof(ens->config.username));
-    munlock(ens->config.password, sizeof(ens->config.password));
+static void
+ens_group_unreserve(ens_group_t *group, size_t bytes) {
+    ens_usage_release(&group->queued, bytes);
+    ens_usage_release(group->context_queued, bytes);
+}
 
-    if (ens->groups != NULL) {
-        for (i = 0; i < alist_size(ens->groups); i++) {
-            group = alist_get(ens->groups, i);
-            ens_group_free(group);
+static void
+ens_group_email_free(ens_group_t *group, ens_email_t *email) {
+    ens_group_unreserve(group, email->bytes);
+    ens_email_free(email);
+}
+
+//without a group the emails are freed without being uncounted
+static void
+ens_shard_batch_free(ens_group_t *group, queue_mpsc_node_t *node) {
+    queue_mpsc_node_t *next;
+
+    while (node != NULL) {
+        next = atomic_load_explicit(&node->next, memory_order_relaxed);
+        if (group != NULL) {
+            ens_group_email_free(group, (ens_email_t *)node);
+        }
+        else {
+            ens_email_free((ens_email_t *)node);
         }
-        alist_free(ens->groups);
+        node = next;
     }
+}
 
-    pthread_rwlock_destroy(&ens->groups_lock);
+static void
+ens_shard_unref(ens_shard_t *shard) {
+    if (atomic_fetch_sub(&shard->refs, 1) == 1) {
+        //the group may already be gone
+        ens_shard_batch_free(NULL, atomic_exchange(&shard->batch, NULL));
+        pthread_mutex_destroy(&shard->mutex);
+        free(shard);
+    }
+}
 
-    free(ens);
+static void
+ens_envelope_unref(ens_envelope_t *envelope) {
+    if (envelope == NULL || atomic_fetch_sub(&envelope->refs, 1) != 1) {
+        return;
+    }
+
+    curl_slist_free_all(envelope->to);
+    buffer_free(envelope->headers);
+    buffer_free(envelope->file_headers);
+    free(envelope);
 }
 
-ens_t *
-ens_init() {
-    ens_t *ens;
+//the group's emails_mutex must be held
+static ens_envelope_t *
+ens_envelope_init(ens_group_t *group) {
+    ens_envelope_t *envelope;
+    struct curl_slist *to;
+    const char *recipient;
+    unsigned int i;
 
-    ens = calloc(1, sizeof(*ens));
-    if (ens == NULL) {
+    envelope = calloc(1, sizeof(*envelope));
+    if (envelope == NULL) {
         return NULL;
     }
 
-    ens->config.mode = ENS_GROUP_MODE_DROP;
-    ens->config.interval = 30;
-    ens->config.to = alist_init();
-    if (ens->config.to == NULL) {
-        goto fail;
-    }
-    if (mlock(ens->config.username, sizeof(ens->config.username)) != 0) {
-        goto fail;
-    }
-    if (mlock(ens->config.password, sizeof(ens->config.password)) != 0) {
+    atomic_init(&envelope->refs, 1);
+    envelope->headers = buffer_init();
+    envelope->file_headers = buffer_init();
+    if (envelope->headers == NULL || envelope->file_headers == NULL) {
         goto fail;
     }
-    ens->log_level = ENS_LOG_LEVEL_WARN;
 
-    ens->groups = alist_init(ens->groups);
-    if (ens->groups == NULL) {
-        goto fail;
+    for (i = 0; i < alist_size(group->config.to); i++) {
+        recipient = alist_get(group->config.to, i);
+
+        to = curl_slist_append(envelope->to, recipient);
+        if (to == NULL) {
+            goto fail;
+        }
+        envelope->to = to;
+
+        if (!buffer_writef(envelope->headers, "To: %s\r\n", recipient) ||
+            !buffer_writef(envelope->file_headers, "To: %s\n", recipient)) {
+            goto fail;
+        }
     }
 
-    if (pthread_rwlock_init(&ens->groups_lock, NULL) != 0) {
+    if (!buffer_writef(envelope->headers, "From: %s\r\n", group->config.from) ||
+        !buffer_writef(envelope->file_headers, "From: %s\n", group->config.from)) {
         goto fail;
     }
 
-    return ens;
+    return envelope;
 
 fail:
-    ens_free(ens);
+    ens_envelope_unref(envelope);
     return NULL;
 }
 
-static int
-ens_log(ens_t *ens, int err, int level, const char *fmt, ...) {
-    char msg[256];
-    va_list ap;
-
-    if (ens->log_function == NULL) {
-        return err;
-    }
-    if (level > ens->log_level) {
-        return err;
+//renders the envelope again if TO or FROM changed, with the emails_mutex held
+static ens_envelope_t *
+ens_envelope_get(ens_group_t *group) {
+    if (group->envelope == NULL) {
+        group->envelope = ens_envelope_init(group);
+        if (group->envelope == NULL) {
+            return NULL;
+        }
     }
 
-    va_start(ap, fmt);
-    vsnprintf(msg, sizeof(msg), fmt, ap);
-    va_end(ap);
+    atomic_fetch_add(&group->envelope->refs, 1);
 
-    ens->log_function(level, msg, ens->log_user_data);
-    return err;
+    return group->envelope;
 }
 
-//TODO: Need to do multiple writes if the email is bigger than size * nmemb bytes.
-static size_t
-email_read(void *ptr, size_t size, size_t nmemb, void *user_data) {
-    bool success;
-    unsigned int i;
-    ens_email_t *email;
-    ens_curl_context_t *context;
+//called after TO or FROM changes, with the emails_mutex held
+static void
+ens_envelope_invalidate(ens_group_t *group) {
+    ens_envelope_unref(group->envelope);
+    group->envelope = NULL;
+}
 
-    context = (ens_curl_context_t *)user_data;
-    if (buffer_length(context->buffer) > 0) {
+static ens_coalesce_t *
+ens_coalesce_init(unsigned int max) {
+    ens_coalesce_t *coalesce;
+    unsigned int slots;
+
+    coalesce = calloc(1, sizeof(*coalesce));
+    if (coalesce == NULL) {
+        return NULL;
+    }
+
+    //the table grows as it fills, up to twice as many slots as the maximum
+    for (slots = 2; slots < max * 2 && slots < ENS_COALESCE_SLOTS; slots *= 2) {
+    }
+
+    coalesce->entries = calloc(slots, sizeof(*coalesce->entries));
+    if (coalesce->entries == NULL) {
+        free(coalesce);
+        return NULL;
+    }
+
+    coalesce->mask = slots - 1;
+    coalesce->max = max;
+
+    return coalesce;
+}
+
+//moves each entry and points its email at where it went
+static bool
+ens_coalesce_grow(ens_coalesce_t *coalesce) {
+    ens_coalesce_entry_t *entries, *entry;
+    unsigned int mask, i, j;
+
+    mask = coalesce->mask * 2 + 1;
+    entries = calloc(mask + 1, sizeof(*entries));
+    if (entries == NULL) {
+        return false;
+    }
+
+    for (i = 0; i <= coalesce->mask; i++) {
+        if (coalesce->entries[i].hash == 0) {
+            continue;
+        }
+
+        for (j = coalesce->entries[i].hash & mask; entries[j].hash != 0; j = (j + 1) & mask) {
+        }
+
+        entry = &entries[j];
+        *entry = coalesce->entries[i];
+        if (entry->email != NULL) {
+            entry->email->coalesced = entry;
+        }
+    }
+
+    free(coalesce->entries);
+    coalesce->entries = entries;
+    coalesce->mask = mask;
+
+    return true;
+}
+
+static void
+ens_coalesce_free(ens_coalesce_t *coalesce) {
+    ens_coalesce_t *next;
+
+    while (coalesce != NULL) {
+        next = coalesce->next;
+        free(coalesce->entries);
+        free(coalesce);
+        coalesce = next;
+    }
+}
+
+//error_rate is in parts per million
+static ens_dedup_t *
+ens_dedup_init(unsigned int window, unsigned int capacity, unsigned int error_rate) {
+    ens_dedup_t *dedup;
+    double bits;
+    uint64_t size;
+
+    dedup = calloc(1, sizeof(*dedup));
+    if (dedup == NULL) {
+        return NULL;
+    }
+
+    //both filters are checked, so each gets half the error rate
+    bits = -(double)capacity * log(error_rate / 2e6) / (M_LN2 * M_LN2);
+    for (size = 64; size < bits; size *= 2) {
+    }
+
+    dedup->hashes = (unsigned int)lround((double)size / capacity * M_LN2);
+    if (dedup->hashes < 1) {
+        dedup->hashes = 1;
+    }
+    else if (dedup->hashes > ENS_DEDUP_HASHES_MAX) {
+        dedup->hashes = ENS_DEDUP_HASHES_MAX;
+    }
+
+    dedup->window = window;
+    dedup->mask = size - 1;
+    dedup->generation = time(NULL) / window;
+
+    dedup->words = calloc(size / 64 * 2, sizeof(*dedup->words));
+    if (dedup->words == NULL || pthread_mutex_init(&dedup->rotate_mutex, NULL) != 0) {
+        free(dedup->words);
+        free(dedup);
+        return NULL;
+    }
+
+    return dedup;
+}
+
+//frees the filter and every filter retired after it
+static void
+ens_dedup_free(ens_dedup_t *dedup) {
+    ens_dedup_t *retired;
+
+    while (dedup != NULL) {
+        retired = dedup->retired;
+        pthread_mutex_destroy(&dedup->rotate_mutex);
+        free(dedup->words);
+        free(dedup);
+        dedup = retired;
+    }
+}
+
+static ens_sample_t *
+ens_sample_init(unsigned int size, unsigned int edges) {
+    ens_sample_t *sample;
+
+    sample = calloc(1, sizeof(*sample) + sizeof(*sample->emails) * (size + edges * 2));
+    if (sample == NULL) {
+        return NULL;
+    }
+
+    sample->size = size;
+    sample->edges = edges;
+    sample->first = sample->emails;
+    sample->last = sample->emails + edges;
+    sample->reservoir = sample->emails + edges * 2;
+
+    //xorshift64 only needs a seed that isn't 0
+    sample->random = ((uint64_t)time(NULL) << 32 ^ (uintptr_t)sample) | 1;
+
+    return sample;
+}
+
+static void
+ens_sample_free(ens_group_t *group, ens_sample_t *sample) {
+    unsigned int i;
+
+    if (sample == NULL) {
+        return;
+    }
+
+    for (i = 0; i < sample->first_count; i++) {
+        ens_group_email_free(group, sample->first[i]);
+    }
+    for (i = 0; i < sample->last_count; i++) {
+        ens_group_email_free(group, sample->last[(sample->last_start + i) % sample->edges]);
+    }
+    for (i = 0; i < sample->reservoir_count; i++) {
+        ens_group_email_free(group, sample->reservoir[i]);
+    }
+
+    free(sample);
+}
+
+static void
+ens_group_free(ens_group_t *group) {
+    queue_mpsc_node_t *node;
+    ens_shard_t *shard;
+    unsigned int i;
+
+    if (group == NULL) {
+        return;
+    }
+
+    //producer threads that are still alive must stop flushing into the group
+    while ((shard = group->shards) != NULL) {
+        group->shards = shard->next;
+
+        pthread_mutex_lock(&shard->mutex);
+        shard->detached = true;
+        pthread_mutex_unlock(&shard->mutex);
+
+        ens_shard_batch_free(group, atomic_exchange(&shard->batch, NULL));
+        ens_shard_unref(shard);
+    }
+
+    if (group->config.to != NULL) {
+        alist_free_func(group->config.to, free);
+    }
+    ens_envelope_unref(group->envelope);
+
+    //zero out sensitive memory before unlocking the pages
+    memset(group->config.username, 0, sizeof(group->config.username));
+    memset(group->config.password, 0, sizeof(group->config.password));
+
+    munlock(group->config.username, sizeof(group->config.username));
+    munlock(group->config.password, sizeof(group->config.password));
+
+    if (group->emails != NULL) {
+        while ((node = queue_mpsc_pop(group->emails)) != NULL) {
+            ens_group_email_free(group, (ens_email_t *)node);
+        }
+        queue_mpsc_free(group->emails);
+    }
+    ens_sample_free(group, group->sample);
+
+    //the emails allocated from the arenas are gone by now
+    for (i = 0; i < 2; i++) {
+        arena_free(group->epochs[i].arena);
+    }
+    ens_coalesce_free(group->coalesce);
+    ens_dedup_free(group->dedup);
+    ens_dedup_free(group->dedup_retired);
+
+    if (group->f != NULL) {
+        fclose(group->f);
+    }
+
+    pthread_mutex_destroy(&group->emails_mutex);
+    pthread_mutex_destroy(&group->coalesce_mutex);
+
+    free(group);
+}
+
+static ens_group_t *
+ens_group_init(ens_t *ens) {
+    ens_group_t *group;
+    unsigned int i;
+    char *to;
+
+    group = calloc(1, sizeof(*group));
+    if (group == NULL) {
+        return NULL;
+    }
+
+    group->config.mode = ens->config.mode;
+    group->config.interval = ens->config.interval;
+    group->dedup_capacity = ENS_DEDUP_CAPACITY;
+    group->context_queued = &ens->queued;
+    group->dedup_error_rate = ENS_DEDUP_ERROR_RATE;
+    group->sample_size = ENS_SAMPLE_SIZE;
+    group->shard_key = atomic_fetch_add(&ens_shard_keys, 1);
+
+    group->config.to = alist_init();
+    if (group->config.to == NULL) {
+        goto fail;
+    }
+    for (i = 0; i < alist_size(ens->config.to); i++) {
+        to = strdup(alist_get(ens->config.to, i));
+        if (to == NULL) {
+            goto fail;
+        }
+
+        if (!alist_add(group->config.to, to)) {
+            free(to);
+            goto fail;
+        }
+    }
+
+    if (ens->config.host[0] != '\0') {
+        strcpy(group->config.host, ens->config.host);
+    }
+
+    if (ens->config.from[0] != '\0') {
+        strcpy(group->config.from, ens->config.from);
+    }
+
+    if (mlock(group->config.username, sizeof(group->config.username)) != 0) {
+        goto fail;
+    }
+    if (ens->config.username[0] != '\0') {
+        strcpy(group->config.username, ens->config.username);
+    }
+
+    if (mlock(group->config.password, sizeof(group->config.password)) != 0) {
+        goto fail;
+    }
+    if (ens->config.password[0] != '\0') {
+        strcpy(group->config.password, ens->config.password);
+    }
+
+    if (ens->config.ca_path[0] != '\0') {
+        strcpy(group->config.ca_path, ens->config.ca_path);
+    }
+
+    group->emails = queue_mpsc_init();
+    if (group->emails == NULL) {
+        goto fail;
+    }
+
+    for (i = 0; i < 2; i++) {
+        group->epochs[i].arena = arena_init(ENS_EPOCH_BLOCK_SIZE, ENS_EPOCH_SPARE_MAX);
+        if (group->epochs[i].arena == NULL) {
+            goto fail;
+        }
+    }
+
+    if (pthread_mutex_init(&group->emails_mutex, NULL) != 0) {
+        goto fail;
+    }
+    if (pthread_mutex_init(&group->coalesce_mutex, NULL) != 0) {
+        goto fail;
+    }
+
+    group->schedule_index = HEAP_INDEX_NONE;
+    group->refs = 1;
+
+    return group;
+
+fail:
+    ens_group_free(group);
+    return NULL;
+}
+
+static void
+ens_group_ref(ens_group_t *group) {
+    atomic_fetch_add(&group->refs, 1);
+}
+
+//freed once the context and its thread are both done with it
+static void
+ens_group_unref(ens_group_t *group) {
+    if (atomic_fetch_sub(&group->refs, 1) == 1) {
+        ens_group_free(group);
+    }
+}
+
+void
+ens_free(ens_t *ens) {
+    unsigned int i;
+
+    if (ens == NULL) {
+        return;
+    }
+
+    if (ens->config.to != NULL) {
+        alist_free_func(ens->config.to, free);
+    }
+
+    //zero sensitive fields before unlocking pages
+    memset(ens->config.username, 0, sizeof(ens->config.username));
+    memset(ens->config.password, 0, sizeof(ens->config.password));
+
+    munlock(ens->config.username, sizeof(ens->config.username));
+    munlock(ens->config.password, sizeof(ens->config.password));
+
+    if (ens->groups != NULL) {
+        hmap_free_func(ens->groups, (void (*)(void *))ens_group_unref);
+    }
+
+    //the emails that were deferred with these are gone now
+    for (i = 0; i < ENS_FORMATS; i++) {
+        format_free(ens->formats[i]);
+    }
+
+    pthread_rwlock_destroy(&ens->groups_lock);
+
+    if (ens->schedule != NULL) {
+        heap_free(ens->schedule);
+    }
+
+    pthread_mutex_destroy(&ens->schedule_mutex);
+    pthread_cond_destroy(&ens->schedule_cond);
+
+    if (ens->work != NULL) {
+        queue_free_func(ens->work, (void (*)(void *))ens_group_unref);
+    }
+
+    pthread_mutex_destroy(&ens->work_mutex);
+    pthread_cond_destroy(&ens->work_cond);
+
+    if (ens->wake_fd != -1) {
+        close(ens->wake_fd);
+    }
+
+    if (ens->transfers != NULL) {
+        alist_free(ens->transfers);
+    }
+
+    pool_free_func(ens->pool, (void (*)(void *))curl_easy_cleanup);
+    pthread_mutex_destroy(&ens->pool_mutex);
+
+    //every handle using the share has been cleaned up by now
+    if (ens->share != NULL) {
+        curl_share_cleanup(ens->share);
+    }
+    for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        pthread_mutex_destroy(&ens->share_mutex[i]);
+    }
+
+    pthread_mutex_destroy(&ens->tls_sessions_mutex);
+
+    free(ens);
+}
+
+static int
+ens_group_compare_expires(const void *a, const void *b) {
+    const ens_group_t *group_a = a, *group_b = b;
+
+    if (group_a->expires < group_b->expires) {
+        return -1;
+    }
+
+    return group_a->expires > group_b->expires;
+}
+
+static void
+ens_group_set_schedule_index(void *data, unsigned int index) {
+    ((ens_group_t *)data)->schedule_index = index;
+}
+
+static void
+ens_share_lock(CURL *curl, curl_lock_data data, curl_lock_access access, void *user_data) {
+    pthread_mutex_lock(&((ens_t *)user_data)->share_mutex[data]);
+}
+
+static void
+ens_share_unlock(CURL *curl, curl_lock_data data, void *user_data) {
+    pthread_mutex_unlock(&((ens_t *)user_data)->share_mutex[data]);
+}
+
+ens_t *
+ens_init() {
+    ens_t *ens;
+    pthread_rwlockattr_t groups_lock_attr;
+    unsigned int i;
+    bool success;
+
+    ens = calloc(1, sizeof(*ens));
+    if (ens == NULL) {
+        return NULL;
+    }
+
+    ens->wake_fd = -1;
+    ens->epoll_fd = -1;
+
+    ens->config.mode = ENS_GROUP_MODE_DROP;
+    ens->config.interval = 30;
+    ens->config.to = alist_init();
+    if (ens->config.to == NULL) {
+        goto fail;
+    }
+    if (mlock(ens->config.username, sizeof(ens->config.username)) != 0) {
+        goto fail;
+    }
+    if (mlock(ens->config.password, sizeof(ens->config.password)) != 0) {
+        goto fail;
+    }
+    ens->log_level = ENS_LOG_LEVEL_WARN;
+
+    ens->groups = hmap_init();
+    if (ens->groups == NULL) {
+        goto fail;
+    }
+
+    //writers go first so registering and unregistering can't starve
+    pthread_rwlockattr_init(&groups_lock_attr);
+    pthread_rwlockattr_setkind_np(&groups_lock_attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    success = pthread_rwlock_init(&ens->groups_lock, &groups_lock_attr) == 0;
+    pthread_rwlockattr_destroy(&groups_lock_attr);
+    if (!success) {
+        goto fail;
+    }
+
+    ens->schedule = heap_init(ens_group_compare_expires, ens_group_set_schedule_index);
+    if (ens->schedule == NULL) {
+        goto fail;
+    }
+
+    if (pthread_mutex_init(&ens->schedule_mutex, NULL) != 0) {
+        goto fail;
+    }
+
+    if (pthread_cond_init(&ens->schedule_cond, NULL) != 0) {
+        goto fail;
+    }
+
+    ens->work = queue_init();
+    if (ens->work == NULL) {
+        goto fail;
+    }
+
+    if (pthread_mutex_init(&ens->work_mutex, NULL) != 0) {
+        goto fail;
+    }
+
+    if (pthread_cond_init(&ens->work_cond, NULL) != 0) {
+        goto fail;
+    }
+
+    ens->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ens->wake_fd == -1) {
+        goto fail;
+    }
+
+    ens->transfers = alist_init();
+    if (ens->transfers == NULL) {
+        goto fail;
+    }
+
+    ens->pool_idle_timeout = 60;
+    ens->max_host_connections = 4;
+    ens->pool = pool_init(ens->max_host_connections);
+    if (ens->pool == NULL) {
+        goto fail;
+    }
+
+    if (pthread_mutex_init(&ens->pool_mutex, NULL) != 0) {
+        goto fail;
+    }
+
+    //connections are shared through the pool since cURL can't share them between threads
+    for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        if (pthread_mutex_init(&ens->share_mutex[i], NULL) != 0) {
+            goto fail;
+        }
+    }
+
+    ens->share = curl_share_init();
+    if (ens->share == NULL) {
+        goto fail;
+    }
+    if (curl_share_setopt(ens->share, CURLSHOPT_LOCKFUNC, ens_share_lock) != CURLSHE_OK ||
+        curl_share_setopt(ens->share, CURLSHOPT_UNLOCKFUNC, ens_share_unlock) != CURLSHE_OK ||
+        curl_share_setopt(ens->share, CURLSHOPT_USERDATA, ens) != CURLSHE_OK ||
+        curl_share_setopt(ens->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION) != CURLSHE_OK ||
+        curl_share_setopt(ens->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS) != CURLSHE_OK) {
+        goto fail;
+    }
+
+    if (pthread_mutex_init(&ens->tls_sessions_mutex, NULL) != 0) {
+        goto fail;
+    }
+    ens->ssls_export = (ens_ssls_export_t)dlsym(RTLD_DEFAULT, "curl_easy_ssls_export");
+    ens->ssls_import = (ens_ssls_import_t)dlsym(RTLD_DEFAULT, "curl_easy_ssls_import");
+
+    return ens;
+
+fail:
+    ens_free(ens);
+    return NULL;
+}
+
+static int
+ens_log(ens_t *ens, int err, int level, const char *fmt, ...) {
+    char msg[256];
+    va_list ap;
+
+    if (ens->log_function == NULL) {
+        return err;
+    }
+    if (level > ens->log_level) {
+        return err;
+    }
+
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+
+    ens->log_function(level, msg, ens->log_user_data);
+    return err;
+}
+
+//the schedule_mutex must be held
+static void
+ens_schedule_wake(ens_t *ens) {
+    uint64_t count = 1;
+
+    pthread_cond_signal(&ens->schedule_cond);
+
+    //the asynchronous engine sleeps in epoll_wait() instead
+    if (ens->async && write(ens->wake_fd, &count, sizeof(count)) != sizeof(count)) {
+        //the counter is already non-zero, so the thread will wake up anyway
+    }
+}
+
+//does nothing if the group is already scheduled or being sent, with the emails_mutex held
+static bool
+ens_schedule_group(ens_t *ens, ens_group_t *group) {
+    bool success = true;
+
+    if (group->busy) {
+        return true;
+    }
+
+    pthread_mutex_lock(&ens->schedule_mutex);
+    if (group->schedule_index == HEAP_INDEX_NONE) {
+        success = heap_push(ens->schedule, group);
+
+        //only wake the thread if its next deadline changed
+        if (success && group->schedule_index == 0) {
+            ens_schedule_wake(ens);
+        }
+    }
+    pthread_mutex_unlock(&ens->schedule_mutex);
+
+    return success;
+}
+
+//the caller gets a reference to the group
+static ens_group_t *
+ens_schedule_pop(ens_t *ens, time_t now) {
+    ens_group_t *group;
+
+    pthread_mutex_lock(&ens->schedule_mutex);
+    group = heap_peek(ens->schedule);
+    if (group != NULL && group->expires <= now) {
+        heap_pop(ens->schedule);
+        ens_group_ref(group);
+    }
+    else {
+        group = NULL;
+    }
+    pthread_mutex_unlock(&ens->schedule_mutex);
+
+    return group;
+}
+
+//sleeps until the next group is due or the context is stopped
+static void
+ens_schedule_wait(ens_t *ens) {
+    ens_group_t *group;
+    struct timespec ts;
+
+    pthread_mutex_lock(&ens->schedule_mutex);
+    while (ens->running) {
+        group = heap_peek(ens->schedule);
+        if (group == NULL) {
+            pthread_cond_wait(&ens->schedule_cond, &ens->schedule_mutex);
+        }
+        else if (group->expires > time(NULL)) {
+            ts.tv_sec = group->expires;
+            ts.tv_nsec = 0;
+            pthread_cond_timedwait(&ens->schedule_cond, &ens->schedule_mutex, &ts);
+        }
+        else {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ens->schedule_mutex);
+}
+
+//a gate is armed with the group's ID while it has an email waiting
+static atomic_uint_fast64_t *
+ens_drop_gate(ens_t *ens, ens_group_id_t id) {
+    return &ens->drop_gates[(uint32_t)((uint32_t)id * 2654435769U) >> (32 - ENS_DROP_GATES_SHIFT)];
+}
+
+static bool
+ens_drop_gate_armed(ens_t *ens, ens_group_id_t id) {
+    return atomic_load_explicit(ens_drop_gate(ens, id), memory_order_relaxed) == ENS_DROP_GATE_ARMED(id);
+}
+
+//unless another group has taken the gate over
+static void
+ens_drop_gate_clear(ens_t *ens, ens_group_id_t id) {
+    uint_fast64_t armed = ENS_DROP_GATE_ARMED(id);
+
+    atomic_compare_exchange_strong(ens_drop_gate(ens, id), &armed, 0);
+}
+
+//cached by address and checked by contents, NULL if it has to be formatted right away
+static const format_t *
+ens_format_get(ens_t *ens, const char *fmt) {
+    format_t *format, *expected;
+    format_t *_Atomic *slot;
+    unsigned int i, home;
+
+    home = (uint32_t)((uint32_t)((uintptr_t)fmt >> 3) * 2654435769U) >> (32 - ENS_FORMATS_SHIFT);
+
+    for (i = 0; i < ENS_FORMAT_PROBES; i++) {
+        slot = &ens->formats[(home + i) & (ENS_FORMATS - 1)];
+
+        format = atomic_load_explicit(slot, memory_order_acquire);
+        if (format == NULL) {
+            format = format_init(fmt);
+            if (format == NULL) {
+                return NULL;
+            }
+
+            //another thread may have cached something here in the meantime
+            expected = NULL;
+            if (!atomic_compare_exchange_strong(slot, &expected, format)) {
+                format_free(format);
+                format = expected;
+            }
+        }
+
+        if (strcmp(format_string(format), fmt) == 0) {
+            return format_deferrable(format) ? format : NULL;
+        }
+    }
+
+    return NULL;
+}
+
+static uint64_t
+ens_now_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t
+ens_fnv(uint64_t hash, const void *data, size_t len) {
+    const unsigned char *p = data;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash = (hash ^ p[i]) * ENS_FNV_PRIME;
+    }
+
+    return hash;
+}
+
+//hashes what coalescing compares, which is also what duplicates are told apart by
+static uint64_t
+ens_email_key_hash(const ens_email_key_t *key) {
+    uint64_t hash;
+    size_t left, len;
+    int i;
+
+    //the NUL that ends the subject keeps it apart from the body
+    hash = ens_fnv(ENS_FNV_OFFSET, key->subject, strlen(key->subject) + 1);
+
+    if (key->body != NULL) {
+        hash = ens_fnv(hash, key->body, key->body_len);
+    }
+    for (i = 0, left = key->body_len; key->body == NULL && i < key->iovcnt && left > 0; i++, left -= len) {
+        len = key->iov[i].iov_len < left ? key->iov[i].iov_len : left;
+        hash = ens_fnv(hash, key->iov[i].iov_base, len);
+    }
+
+    if (key->format != NULL) {
+        hash ^= (uintptr_t)key->format;
+    }
+
+    //0 marks an empty slot
+    return hash != 0 ? hash : 1;
+}
+
+//a deferred body is captured or formatted here once, and copied into the email if it's made
+static bool
+ens_email_key_init(ens_email_key_t *key, const ens_email_source_t *source, ens_email_storage_t storage, const format_t *format, size_t body_len) {
+    va_list ap;
+
+    key->subject = source->subject;
+    key->body = source->body;
+    key->body_len = body_len;
+    key->iov = source->iov;
+    key->iovcnt = source->iovcnt;
+    key->format = storage == ENS_EMAIL_DEFERRED ? format : NULL;
+    key->truncated = false;
+    key->made = NULL;
+
+    if (storage == ENS_EMAIL_OWNED) {
+        key->body_len = strlen(source->body);
+    }
+    else if (storage == ENS_EMAIL_SHARED) {
+        key->body = source->shared->body;
+        key->body_len = strlen(key->body);
+    }
+    else if (source->storage == ENS_EMAIL_DEFERRED) {
+        key->made = body_len < sizeof(key->buf) ? key->buf : malloc(body_len + 1);
+        if (key->made == NULL) {
+            return false;
+        }
+
+        va_copy(ap, *source->ap);
+        if (key->format != NULL) {
+            format_capture(format, key->made, ap);
+        }
+        else {
+            vsnprintf(key->made, body_len + 1, source->body, ap);
+        }
+        va_end(ap);
+
+        key->body = key->made;
+    }
+
+    key->hash = ens_email_key_hash(key);
+
+    return true;
+}
+
+static void
+ens_email_key_free(ens_email_key_t *key) {
+    if (key->made != key->buf) {
+        free(key->made);
+    }
+}
+
+static bool
+ens_coalesce_equal(const ens_coalesce_entry_t *entry, const ens_email_key_t *key) {
+    const ens_email_t *first = entry->email;
+    const char *p;
+    size_t left, len;
+    int i;
+
+    //the email was dropped to make room for newer ones
+    if (first == NULL) {
+        return false;
+    }
+
+    if (entry->body_len != key->body_len) {
+        return false;
+    }
+    if (entry->truncated) {
+        return strcmp(first->subject, key->subject) == 0;
+    }
+    if ((first->storage == ENS_EMAIL_DEFERRED) != (key->format != NULL)) {
+        return false;
+    }
+    if (key->format != NULL && first->format != key->format) {
+        return false;
+    }
+    if (strcmp(first->subject, key->subject) != 0) {
+        return false;
+    }
+
+    if (key->body != NULL) {
+        return memcmp(first->body, key->body, key->body_len) == 0;
+    }
+
+    p = first->body;
+    for (i = 0, left = key->body_len; i < key->iovcnt && left > 0; i++, left -= len, p += len) {
+        len = key->iov[i].iov_len < left ? key->iov[i].iov_len : left;
+        if (memcmp(p, key->iov[i].iov_base, len) != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+//counts a repeat or an email there's no room for, otherwise sets slot to where the email goes
+static bool
+ens_coalesce_counted(ens_coalesce_t *coalesce, const ens_email_key_t *key, time_t now, unsigned int *slot) {
+    ens_coalesce_entry_t *entry;
+    unsigned int i;
+
+    //the table is never more than half full, so there's always an empty slot
+    for (i = key->hash & coalesce->mask; coalesce->entries[i].hash != 0; i = (i + 1) & coalesce->mask) {
+        entry = &coalesce->entries[i];
+
+        if (entry->hash == key->hash && ens_coalesce_equal(entry, key)) {
+            ++entry->occurrences;
+            entry->last_seen = now;
+            return true;
+        }
+    }
+
+    if (coalesce->count >= coalesce->max) {
+        ++coalesce->dropped;
+        coalesce->dropped_seen[(key->hash / 64) % (ENS_COALESCE_SEEN_BITS / 64)] |= 1ULL << (key->hash % 64);
+        return true;
+    }
+
+    *slot = i;
+
+    return false;
+}
+
+//true if the email was only counted, so it doesn't have to be made
+static bool
+ens_coalesce_count(ens_group_t *group, const ens_email_key_t *key) {
+    unsigned int slot;
+    bool counted = false;
+
+    pthread_mutex_lock(&group->coalesce_mutex);
+    if (group->coalesce != NULL) {
+        counted = ens_coalesce_counted(group->coalesce, key, time(NULL), &slot);
+    }
+    pthread_mutex_unlock(&group->coalesce_mutex);
+
+    return counted;
+}
+
+//repeats and emails that don't fit are only counted, with pending set if it's queued
+static bool
+ens_coalesce_push(ens_group_t *group, unsigned int max, ens_email_t *email, const ens_email_key_t *key, unsigned int *pending) {
+    ens_coalesce_t *coalesce;
+    ens_coalesce_entry_t *entry;
+    time_t now;
+    unsigned int i;
+    bool queued = false;
+
+    now = time(NULL);
+
+    pthread_mutex_lock(&group->coalesce_mutex);
+
+    if (group->coalesce == NULL) {
+        group->coalesce = ens_coalesce_init(max);
+    }
+
+    //without a table, or room in it, every email is queued on its own
+    coalesce = group->coalesce;
+    if (coalesce == NULL || (coalesce->count < coalesce->max && (coalesce->count + 1) * 2 > coalesce->mask + 1 && !ens_coalesce_grow(coalesce))) {
+        queued = true;
+        goto done;
+    }
+
+    //another thread can have queued the same email since it was looked up
+    if (ens_coalesce_counted(coalesce, key, now, &i)) {
+        goto done;
+    }
+
+    entry = &coalesce->entries[i];
+    entry->hash = key->hash;
+    entry->email = email;
+    entry->body_len = key->body_len;
+    entry->truncated = key->truncated;
+    entry->occurrences = 1;
+    entry->first_seen = now;
+    entry->last_seen = now;
+    ++coalesce->count;
+
+    email->coalesced = entry;
+    queued = true;
+
+done:
+    if (queued) {
+        *pending = atomic_fetch_add(&group->pending, 1);
+        queue_mpsc_push(group->emails, &email->link);
+    }
+
+    pthread_mutex_unlock(&group->coalesce_mutex);
+
+    return queued;
+}
+
+//frees whatever no longer fits, and sets pending from before the email
+static bool
+ens_sample_push(ens_group_t *group, ens_email_t *email, unsigned int *pending) {
+    ens_sample_t *sample;
+    ens_email_t *evicted = NULL;
+    uint64_t x, j;
+
+    *pending = 1;
+
+    pthread_mutex_lock(&group->coalesce_mutex);
+
+    sample = group->sample;
+    if (sample == NULL) {
+        sample = ens_sample_init(group->sample_size, group->sample_edges);
+        if (sample == NULL) {
+            pthread_mutex_unlock(&group->coalesce_mutex);
+            return false;
+        }
+
+        group->sample = sample;
+        *pending = atomic_fetch_add(&group->pending, 1);
+    }
+
+    //the emails are put back in order by their number when they're sent
+    email->timestamp = ++sample->total;
+
+    if (sample->first_count < sample->edges) {
+        sample->first[sample->first_count++] = email;
+        goto done;
+    }
+
+    //the oldest of the last emails is one of the middle ones now
+    if (sample->edges > 0) {
+        if (sample->last_count < sample->edges) {
+            sample->last[(sample->last_start + sample->last_count++) % sample->edges] = email;
+            goto done;
+        }
+
+        evicted = sample->last[sample->last_start];
+        sample->last[sample->last_start] = email;
+        sample->last_start = (sample->last_start + 1) % sample->edges;
+        email = evicted;
+        evicted = NULL;
+    }
+
+    //Algorithm R: the nth email replaces a random one with a chance of size/n
+    ++sample->middle;
+    if (sample->reservoir_count < sample->size) {
+        sample->reservoir[sample->reservoir_count++] = email;
+        goto done;
+    }
+
+    x = sample->random;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    sample->random = x;
+
+    j = x % sample->middle;
+    if (j < sample->size) {
+        evicted = sample->reservoir[j];
+        sample->reservoir[j] = email;
+    }
+    else {
+        evicted = email;
+    }
+
+done:
+    pthread_mutex_unlock(&group->coalesce_mutex);
+
+    if (evicted != NULL) {
+        ens_group_email_free(group, evicted);
+    }
+
+    return true;
+}
+
+//returns the window the newer filter covers
+static uint64_t
+ens_dedup_rotate(ens_dedup_t *dedup) {
+    uint64_t now, generation, i, words;
+    unsigned int stale;
+
+    now = time(NULL) / dedup->window;
+    generation = atomic_load_explicit(&dedup->generation, memory_order_acquire);
+    if (now <= generation) {
+        return generation;
+    }
+
+    pthread_mutex_lock(&dedup->rotate_mutex);
+
+    generation = atomic_load_explicit(&dedup->generation, memory_order_relaxed);
+    if (now > generation) {
+        //after more than a window with no emails, both filters are too old
+        words = (dedup->mask + 1) / 64;
+        for (stale = 0; stale < 2; stale++) {
+            if (now == generation + 1 && stale == (generation & 1)) {
+                continue;
+            }
+
+            for (i = 0; i < words; i++) {
+                atomic_store_explicit(&dedup->words[stale * words + i], 0, memory_order_relaxed);
+            }
+        }
+
+        atomic_store_explicit(&dedup->generation, now, memory_order_release);
+        generation = now;
+    }
+
+    pthread_mutex_unlock(&dedup->rotate_mutex);
+
+    return generation;
+}
+
+static inline uint64_t
+ens_dedup_index(const ens_dedup_t *dedup, uint64_t hash, unsigned int i) {
+    uint64_t step;
+
+    step = (hash * 0x9e3779b97f4a7c15ULL) >> 32 | 1;
+
+    return (hash + i * step) & dedup->mask;
+}
+
+static bool
+ens_dedup_seen(ens_dedup_t *dedup, uint64_t hash) {
+    atomic_uint_fast64_t *words;
+    unsigned int filter, i;
+    uint64_t index;
+
+    for (filter = 0; filter < 2; filter++) {
+        words = dedup->words + filter * ((dedup->mask + 1) / 64);
+
+        for (i = 0; i < dedup->hashes; i++) {
+            index = ens_dedup_index(dedup, hash, i);
+            if (!(atomic_load_explicit(&words[index / 64], memory_order_relaxed) & 1ULL << (index % 64))) {
+                break;
+            }
+        }
+        if (i == dedup->hashes) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void
+ens_dedup_add(ens_dedup_t *dedup, uint64_t generation, uint64_t hash) {
+    atomic_uint_fast64_t *words;
+    unsigned int i;
+    uint64_t index;
+
+    words = dedup->words + (generation & 1) * ((dedup->mask + 1) / 64);
+    for (i = 0; i < dedup->hashes; i++) {
+        index = ens_dedup_index(dedup, hash, i);
+        atomic_fetch_or_explicit(&words[index / 64], 1ULL << (index % 64), memory_order_relaxed);
+    }
+}
+
+//returns the new first node and sets last to the new last node
+static queue_mpsc_node_t *
+ens_shard_batch_reverse(queue_mpsc_node_t *node, queue_mpsc_node_t **last) {
+    queue_mpsc_node_t *next, *first = NULL;
+
+    *last = node;
+
+    while (node != NULL) {
+        next = atomic_load_explicit(&node->next, memory_order_relaxed);
+        atomic_store_explicit(&node->next, first, memory_order_relaxed);
+        first = node;
+        node = next;
+    }
+
+    return first;
+}
+
+//the batch was counted once when it started, so only the difference is added
+static void
+ens_shard_flush(ens_shard_t *shard) {
+    queue_mpsc_node_t *first, *last, *node;
+    unsigned int count = 0;
+
+    node = atomic_exchange_explicit(&shard->batch, NULL, memory_order_acquire);
+    if (node == NULL) {
+        //the context's thread already collected it
+        return;
+    }
+
+    first = ens_shard_batch_reverse(node, &last);
+    for (node = first; node != NULL; node = atomic_load_explicit(&node->next, memory_order_relaxed)) {
+        ++count;
+    }
+
+    shard->count = 0;
+    atomic_fetch_add(&shard->group->pending, count - 1);
+    queue_mpsc_push_chain(shard->group->emails, first, last);
+}
+
+//returns the pending count from before if the email started a new batch
+static unsigned int
+ens_shard_push(ens_shard_t *shard, ens_email_t *email) {
+    queue_mpsc_node_t *old;
+    unsigned int pending = 1;
+
+    old = atomic_load_explicit(&shard->batch, memory_order_relaxed);
+    for (;;) {
+        //counted before it's stored so the context's thread never sees more batches than are pending
+        if (old == NULL) {
+            pending = atomic_fetch_add(&shard->group->pending, 1);
+            atomic_store_explicit(&email->link.next, NULL, memory_order_relaxed);
+            atomic_store_explicit(&shard->batch, &email->link, memory_order_release);
+            shard->count = 1;
+            break;
+        }
+
+        //the context's thread may take the batch in the meantime
+        atomic_store_explicit(&email->link.next, old, memory_order_relaxed);
+        if (atomic_compare_exchange_weak_explicit(&shard->batch, &old, &email->link, memory_order_release, memory_order_relaxed)) {
+            ++shard->count;
+            break;
+        }
+    }
+
+    if (shard->count >= shard->group->thread_batch) {
+        ens_shard_flush(shard);
+    }
+
+    return pending;
+}
+
+//flushes an exiting thread's batches and lets go of its shards
+static void
+ens_shards_destructor(void *data) {
+    ens_thread_shards_t *thread_shards = data;
+    ens_shard_t *shard;
+    unsigned int i;
+
+    for (i = 0; i < thread_shards->size; i++) {
+        shard = thread_shards->shards[i];
+
+        pthread_mutex_lock(&shard->mutex);
+        if (!shard->detached) {
+            ens_shard_flush(shard);
+        }
+        atomic_store(&shard->orphaned, true);
+        pthread_mutex_unlock(&shard->mutex);
+
+        ens_shard_unref(shard);
+    }
+
+    hmap_free(thread_shards->index);
+    free(thread_shards->shards);
+    free(thread_shards);
+    ens_thread_shards = NULL;
+}
+
+static void
+ens_shards_key_create() {
+    ens_shards_key_created = pthread_key_create(&ens_shards_key, ens_shards_destructor) == 0;
+}
+
+//NULL sends the email straight to the group's queue, and the caller keeps the group alive
+static ens_shard_t *
+ens_shard_get(ens_group_t *group) {
+    ens_thread_shards_t *thread_shards;
+    ens_shard_t *shard, **shards;
+    unsigned int i, capacity;
+
+    thread_shards = ens_thread_shards;
+    if (thread_shards == NULL) {
+        pthread_once(&ens_shards_once, ens_shards_key_create);
+        if (!ens_shards_key_created) {
+            return NULL;
+        }
+
+        thread_shards = calloc(1, sizeof(*thread_shards));
+        if (thread_shards == NULL) {
+            return NULL;
+        }
+        thread_shards->index = hmap_init();
+        if (thread_shards->index == NULL || pthread_setspecific(ens_shards_key, thread_shards) != 0) {
+            hmap_free(thread_shards->index);
+            free(thread_shards);
+            return NULL;
+        }
+
+        ens_thread_shards = thread_shards;
+    }
+
+    shard = hmap_get(thread_shards->index, group->shard_key);
+    if (shard != NULL) {
+        return shard;
+    }
+
+    //forget shards of groups that have been freed
+    i = 0;
+    while (i < thread_shards->size) {
+        shard = thread_shards->shards[i];
+
+        if (atomic_load(&shard->detached)) {
+            hmap_remove(thread_shards->index, shard->key);
+            thread_shards->shards[i] = thread_shards->shards[--thread_shards->size];
+            ens_shard_unref(shard);
+            continue;
+        }
+
+        ++i;
+    }
+
+    if (thread_shards->size == thread_shards->capacity) {
+        capacity = thread_shards->capacity == 0 ? 8 : thread_shards->capacity * 2;
+        shards = realloc(thread_shards->shards, sizeof(*shards) * capacity);
+        if (shards == NULL) {
+            return NULL;
+        }
+
+        thread_shards->shards = shards;
+        thread_shards->capacity = capacity;
+    }
+
+    shard = aligned_alloc(_Alignof(ens_shard_t), sizeof(*shard));
+    if (shard == NULL) {
+        return NULL;
+    }
+
+    memset(shard, 0, sizeof(*shard));
+    if (pthread_mutex_init(&shard->mutex, NULL) != 0) {
+        free(shard);
+        return NULL;
+    }
+
+    if (!hmap_put(thread_shards->index, group->shard_key, shard)) {
+        pthread_mutex_destroy(&shard->mutex);
+        free(shard);
+        return NULL;
+    }
+
+    //one reference for the thread and one for the group
+    shard->refs = 2;
+    shard->group = group;
+    shard->key = group->shard_key;
+
+    pthread_mutex_lock(&group->emails_mutex);
+    shard->next = group->shards;
+    group->shards = shard;
+    pthread_mutex_unlock(&group->emails_mutex);
+
+    thread_shards->shards[thread_shards->size++] = shard;
+
+    return shard;
+}
+
+static void
+ens_delivery_append(ens_delivery_t *delivery, queue_mpsc_node_t *node) {
+    //the node is off the queue, so its link can be reused for the delivery
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+
+    if (delivery->emails_last == NULL) {
+        delivery->emails = node;
+    }
+    else {
+        atomic_store_explicit(&delivery->emails_last->next, node, memory_order_relaxed);
+    }
+
+    delivery->emails_last = node;
+    ++delivery->emails_count;
+}
+
+typedef struct {
+    ens_email_t *email;
+    unsigned int index;
+} ens_email_order_t;
+
+static int
+ens_email_compare_timestamp(const void *a, const void *b) {
+    const ens_email_order_t *order_a = a, *order_b = b;
+
+    if (order_a->email->timestamp != order_b->email->timestamp) {
+        return order_a->email->timestamp < order_b->email->timestamp ? -1 : 1;
+    }
+
+    //each thread's emails were collected in the order it sent them
+    return order_a->index < order_b->index ? -1 : order_a->index > order_b->index;
+}
+
+//leaves each thread's emails in order if there isn't enough memory
+static void
+ens_delivery_sort(ens_delivery_t *delivery) {
+    ens_email_order_t *order;
+    queue_mpsc_node_t *node;
+    unsigned int i, count;
+
+    count = delivery->emails_count;
+    order = malloc(sizeof(*order) * count);
+    if (order == NULL) {
+        return;
+    }
+
+    node = delivery->emails;
+    for (i = 0; i < count; i++) {
+        order[i].email = (ens_email_t *)node;
+        order[i].index = i;
+        node = atomic_load_explicit(&node->next, memory_order_relaxed);
+    }
+
+    qsort(order, count, sizeof(*order), ens_email_compare_timestamp);
+
+    delivery->emails = NULL;
+    delivery->emails_last = NULL;
+    delivery->emails_count = 0;
+    for (i = 0; i < count; i++) {
+        ens_delivery_append(delivery, &order[i].email->link);
+    }
+
+    free(order);
+}
+
+static int
+ens_sample_compare(const void *a, const void *b) {
+    const ens_email_t *email_a = *(ens_email_t *const *)a, *email_b = *(ens_email_t *const *)b;
+
+    return email_a->timestamp < email_b->timestamp ? -1 : email_a->timestamp > email_b->timestamp;
+}
+
+//moves the sample onto the delivery in the order it was sent
+static void
+ens_delivery_append_sample(ens_delivery_t *delivery, ens_sample_t *sample) {
+    unsigned int i, kept;
+
+    qsort(sample->reservoir, sample->reservoir_count, sizeof(*sample->reservoir), ens_sample_compare);
+
+    for (i = 0; i < sample->first_count; i++) {
+        ens_delivery_append(delivery, &sample->first[i]->link);
+    }
+    for (i = 0; i < sample->reservoir_count; i++) {
+        ens_delivery_append(delivery, &sample->reservoir[i]->link);
+    }
+    for (i = 0; i < sample->last_count; i++) {
+        ens_delivery_append(delivery, &sample->last[(sample->last_start + i) % sample->edges]->link);
+    }
+
+    kept = sample->first_count + sample->reservoir_count + sample->last_count;
+    delivery->emails_left_out += sample->total - kept;
+    free(sample);
+}
+
+//only the thread that marked the group busy calls this, and it waits for a push in progress
+static void
+ens_delivery_drain(ens_delivery_t *delivery) {
+    ens_group_t *group;
+    ens_shard_t *shard, **prev;
+    queue_mpsc_node_t *node, *next, *last;
+    unsigned int taken;
+    bool sharded;
+
+    group = delivery->group;
+
+    ens_epoch_advance(group);
+
+    for (;;) {
+        taken = 0;
+
+        pthread_mutex_lock(&group->emails_mutex);
+        sharded = group->shards != NULL;
+        prev = &group->shards;
+        while ((shard = *prev) != NULL) {
+            node = atomic_exchange_explicit(&shard->batch, NULL, memory_order_acquire);
+            if (node != NULL) {
+                ++taken;
+
+                for (node = ens_shard_batch_reverse(node, &last); node != NULL; node = next) {
+                    next = atomic_load_explicit(&node->next, memory_order_relaxed);
+                    ens_delivery_append(delivery, node);
+                }
+            }
+
+            //an exited thread flushed its batch before it was orphaned
+            if (atomic_load(&shard->orphaned)) {
+                *prev = shard->next;
+                ens_shard_unref(shard);
+            }
+            else {
+                prev = &shard->next;
+            }
+        }
+        pthread_mutex_unlock(&group->emails_mutex);
+
+        //the coalescing table goes with the emails that are in it
+        pthread_mutex_lock(&group->coalesce_mutex);
+        while ((node = queue_mpsc_pop(group->emails)) != NULL) {
+            ens_delivery_append(delivery, node);
+            ++taken;
+        }
+        if (group->sample != NULL) {
+            ens_delivery_append_sample(delivery, group->sample);
+            group->sample = NULL;
+            ++taken;
+        }
+        if (group->coalesce != NULL) {
+            group->coalesce->next = delivery->coalesce;
+            delivery->coalesce = group->coalesce;
+            group->coalesce = NULL;
+        }
+        pthread_mutex_unlock(&group->coalesce_mutex);
+
+        //armed before the pending count is claimed, so this can't leave it armed
+        atomic_fetch_sub(&group->pending, taken);
+        ens_drop_gate_clear(delivery->ens, group->id);
+
+        //every email could have been dropped to make room for newer ones
+        if (delivery->emails_count > 0 || atomic_load(&group->pending) == 0) {
+            break;
+        }
+
+        sched_yield();
+    }
+
+    if (sharded && delivery->emails_count > 1) {
+        ens_delivery_sort(delivery);
+    }
+}
+
+static ens_email_t *
+ens_delivery_pop(ens_delivery_t *delivery) {
+    queue_mpsc_node_t *node;
+
+    node = delivery->emails;
+    if (node == NULL) {
+        return NULL;
+    }
+
+    delivery->emails = atomic_load_explicit(&node->next, memory_order_relaxed);
+    if (delivery->emails == NULL) {
+        delivery->emails_last = NULL;
+    }
+    --delivery->emails_count;
+
+    return (ens_email_t *)node;
+}
+
+static bool
+ens_email_write_body(buffer_t *buffer, ens_email_t *email) {
+    if (email->storage == ENS_EMAIL_DEFERRED) {
+        return format_render(email->format, email->body, buffer);
+    }
+
+    return buffer_write(buffer, (unsigned char *)email->body, strlen(email->body));
+}
+
+//returns false if the email was only sent once
+static bool
+ens_email_describe_occurrences(const ens_email_t *email, char *buf, size_t size) {
+    const ens_coalesce_entry_t *entry = email->coalesced;
+    char first[32], last[32];
+    struct tm tm;
+
+    if (entry == NULL || entry->occurrences < 2) {
+        return false;
+    }
+
+    strftime(first, sizeof(first), "%Y-%m-%d %H:%M:%S", localtime_r(&entry->first_seen, &tm));
+    strftime(last, sizeof(last), "%Y-%m-%d %H:%M:%S", localtime_r(&entry->last_seen, &tm));
+    snprintf(buf, size, "Occurrences: %u between %s and %s\n", entry->occurrences, first, last);
+
+    return true;
+}
+
+//returns false if the coalescing table didn't drop anything
+static bool
+ens_coalesce_describe_dropped(const ens_coalesce_t *coalesce, char *buf, size_t size) {
+    uint64_t seen[ENS_COALESCE_SEEN_BITS / 64] = {0};
+    unsigned int i, count = 0, dropped = 0, zeros = 0;
+    double distinct;
+
+    //a delivery that drained more than once has a table for each time
+    for (; coalesce != NULL; coalesce = coalesce->next) {
+        count += coalesce->count;
+        dropped += coalesce->dropped;
+        for (i = 0; i < ENS_COALESCE_SEEN_BITS / 64; i++) {
+            seen[i] |= coalesce->dropped_seen[i];
+        }
+    }
+
+    if (dropped == 0) {
+        return false;
+    }
+
+    for (i = 0; i < ENS_COALESCE_SEEN_BITS / 64; i++) {
+        zeros += 64 - __builtin_popcountll(seen[i]);
+    }
+
+    //linear counting, which saturates once every bit is set
+    distinct = zeros > 0 ? ENS_COALESCE_SEEN_BITS * log((double)ENS_COALESCE_SEEN_BITS / zeros) : dropped;
+    if (distinct > dropped) {
+        distinct = dropped;
+    }
+
+    snprintf(buf, size, "%u more emails, about %.0f of them different, were left out after %u different emails were collected", dropped, distinct < 1 ? 1 : distinct, count);
+
+    return true;
+}
+
+//the subject line, each email, then the coalescing note, one per call
+static bool
+ens_delivery_render_next(ens_delivery_t *delivery) {
+    ens_email_t *email;
+    char buf[160];
+    bool success;
+
+    buffer_clear(delivery->buffer);
+
+    if (delivery->read_state == ENS_READ_SUBJECT) {
+        delivery->read_state = ENS_READ_EMAILS;
+
+        //a sample says how many emails it was taken from
+        if (delivery->emails_left_out > 0) {
+            return buffer_writef(delivery->buffer, "Subject: %u of %llu Emails\r\n\r\n", delivery->emails_count,
+                                 (unsigned long long)(delivery->emails_count + delivery->emails_left_out));
+        }
+
+        return buffer_writef(delivery->buffer, "Subject: %u Emails\r\n\r\n", delivery->emails_count);
+    }
+
+    if (delivery->read_state == ENS_READ_DROPPED) {
+        delivery->read_state = ENS_READ_DONE;
+
+        return ens_coalesce_describe_dropped(delivery->coalesce, buf, sizeof(buf)) &&
+               buffer_writef(delivery->buffer, "\n\n%s", buf);
+    }
+
+    email = ens_delivery_pop(delivery);
+    if (email == NULL) {
+        delivery->read_state = ENS_READ_DROPPED;
+        return false;
+    }
+
+    if (delivery->mode == ENS_GROUP_MODE_DROP) {
+        success = buffer_writef(delivery->buffer, "Subject: %s\r\n\r\n", email->subject) &&
+                  ens_email_write_body(delivery->buffer, email) &&
+                  buffer_writef(delivery->buffer, "\n");
+    }
+    else {
+        success = (delivery->emails_read == 0 || buffer_writef(delivery->buffer, "\n\n")) &&
+                  buffer_writef(delivery->buffer, "Subject: %s\n", email->subject) &&
+                  (!ens_email_describe_occurrences(email, buf, sizeof(buf)) || buffer_writef(delivery->buffer, "%s", buf)) &&
+                  ens_email_write_body(delivery->buffer, email);
+    }
+
+    ++delivery->emails_read;
+    ens_group_email_free(delivery->group, email);
+
+    if (!success) {
+        ens_log(delivery->ens, ENS_ERROR_MEMORY, ENS_LOG_LEVEL_FATAL, "Failed to send email for group %d: Out of memory", delivery->group->id);
+        delivery->read_state = ENS_READ_ABORT;
+    }
+
+    return success;
+}
+
+//renders one part of the email at a time so a digest can be any size
+static size_t
+email_read(void *ptr, size_t size, size_t nmemb, void *user_data) {
+    ens_delivery_t *delivery;
+    size_t room, len, written = 0;
+    struct iovec *iov;
+    buffer_t *part = NULL;
+
+    delivery = (ens_delivery_t *)user_data;
+    room = size * nmemb;
+
+    while (written < room) {
+        //copy out whatever is left of the current part first
+        if (delivery->read_index < delivery->read_iovcnt) {
+            iov = &delivery->read_iov[delivery->read_index];
+
+            len = iov->iov_len - delivery->read_offset;
+            if (len > room - written) {
+                len = room - written;
+            }
+
+            memcpy((char *)ptr + written, (char *)iov->iov_base + delivery->read_offset, len);
+            delivery->read_offset += len;
+            written += len;
+
+            if (delivery->read_offset == iov->iov_len) {
+                ++delivery->read_index;
+                delivery->read_offset = 0;
+            }
+            continue;
+        }
+
+        switch (delivery->read_state) {
+            case ENS_READ_HEADERS:
+                //the recipients and sender were rendered before the group was unlocked
+                delivery->read_state = delivery->mode != ENS_GROUP_MODE_DROP ? ENS_READ_SUBJECT : ENS_READ_EMAILS;
+                part = delivery->envelope->headers;
+                break;
+            case ENS_READ_SUBJECT:
+            case ENS_READ_EMAILS:
+            case ENS_READ_DROPPED:
+                if (!ens_delivery_render_next(delivery)) {
+                    continue;
+                }
+                part = delivery->buffer;
+                break;
+            case ENS_READ_DONE:
+                return written;
+            case ENS_READ_ABORT:
+            default:
+                return CURL_READFUNC_ABORT;
+        }
+
+        delivery->read_iovcnt = buffer_iovec(part, delivery->read_iov, ENS_READ_IOV_MAX);
+        delivery->read_index = 0;
+        delivery->read_offset = 0;
+
+        if (delivery->read_iovcnt > ENS_READ_IOV_MAX) {
+            ens_log(delivery->ens, ENS_ERROR_MEMORY, ENS_LOG_LEVEL_ERROR, "Failed to send email for group %d: An email has too many pieces", delivery->group->id);
+            delivery->read_state = ENS_READ_ABORT;
+            delivery->read_iovcnt = 0;
+        }
+    }
+
+    return written;
+}
+
+//reuses a handle with a warm connection to the same host and credentials
+static CURL *
+ens_pool_get(ens_t *ens, const char *key) {
+    CURL *curl;
+
+    pthread_mutex_lock(&ens->pool_mutex);
+    curl = pool_get(ens->pool, key);
+    pthread_mutex_unlock(&ens->pool_mutex);
+
+    return curl != NULL ? curl : curl_easy_init();
+}
+
+//idle connections are closed outside the pool's lock since closing waits on the server
+static void
+ens_pool_put(ens_t *ens, const char *key, CURL *curl) {
+    CURL *expired;
+    bool pooled;
+    time_t now;
+
+    now = time(NULL);
+
+    //forget everything about the last email but keep the connection open
+    curl_easy_reset(curl);
+
+    pthread_mutex_lock(&ens->pool_mutex);
+    pooled = ens->pool_idle_timeout > 0 && pool_put(ens->pool, key, curl, now);
+    pthread_mutex_unlock(&ens->pool_mutex);
+
+    if (!pooled) {
+        curl_easy_cleanup(curl);
+    }
+
+    do {
+        pthread_mutex_lock(&ens->pool_mutex);
+        expired = pool_evict(ens->pool, now - ens->pool_idle_timeout);
+        pthread_mutex_unlock(&ens->pool_mutex);
+
+        if (expired != NULL) {
+            curl_easy_cleanup(expired);
+        }
+    } while (expired != NULL);
+}
+
+static bool
+ens_tls_sessions_write_field(FILE *f, const void *data, size_t len) {
+    uint32_t field_len = len;
+
+    return fwrite(&field_len, sizeof(field_len), 1, f) == 1 &&
+           (len == 0 || fwrite(data, 1, len, f) == len);
+}
+
+static void *
+ens_tls_sessions_read_field(FILE *f, size_t *len) {
+    uint32_t field_len;
+    void *data;
+
+    if (fread(&field_len, sizeof(field_len), 1, f) != 1 || field_len == 0 || field_len > ENS_TLS_SESSIONS_FIELD_MAX) {
+        return NULL;
+    }
+
+    data = malloc(field_len);
+    if (data == NULL) {
+        return NULL;
+    }
+    if (fread(data, 1, field_len, f) != field_len) {
+        free(data);
+        return NULL;
+    }
+
+    *len = field_len;
+    return data;
+}
+
+static CURLcode
+ens_tls_sessions_export(CURL *curl, void *user_data, const char *session_key, const unsigned char *shmac, size_t shmac_len, const unsigned char *sdata, size_t sdata_len, curl_off_t valid_until, int ietf_tls_id, const char *alpn, size_t earlydata_max) {
+    FILE *f = user_data;
+    int64_t expires = valid_until;
+
+    if (!ens_tls_sessions_write_field(f, session_key, strlen(session_key) + 1) ||
+        !ens_tls_sessions_write_field(f, shmac, shmac_len) ||
+        !ens_tls_sessions_write_field(f, sdata, sdata_len) ||
+        fwrite(&expires, sizeof(expires), 1, f) != 1) {
+        return CURLE_WRITE_ERROR;
+    }
+
+    return CURLE_OK;
+}
+
+//lets the first email to each host after a restart resume its TLS session
+static void
+ens_tls_sessions_load(ens_t *ens) {
+    FILE *f;
+    CURL *curl;
+    CURLcode ret = CURLE_OK;
+    char magic[sizeof(ENS_TLS_SESSIONS_MAGIC) - 1];
+    char *key;
+    unsigned char *shmac, *sdata;
+    size_t key_len, shmac_len, sdata_len;
+    int64_t expires;
+    unsigned int count = 0;
+    time_t now;
+
+    if (ens->tls_sessions_path[0] == '\0') {
+        return;
+    }
+    if (ens->ssls_import == NULL) {
+        ens_log(ens, ENS_ERROR_FILE, ENS_LOG_LEVEL_WARN, "Failed to load TLS sessions: cURL %s is too old to export TLS sessions", curl_version_info(CURLVERSION_NOW)->version);
+        return;
+    }
+
+    f = fopen(ens->tls_sessions_path, "rb");
+    if (f == NULL) {
+        if (errno != ENOENT) {
+            ens_log(ens, ENS_ERROR_FILE, ENS_LOG_LEVEL_WARN, "Failed to load TLS sessions from %s: %s", ens->tls_sessions_path, strerror(errno));
+        }
+        return;
+    }
+
+    curl = curl_easy_init();
+    if (curl == NULL) {
+        fclose(f);
+        ens_log(ens, ENS_ERROR_MEMORY, ENS_LOG_LEVEL_WARN, "Failed to load TLS sessions from %s: Out of memory", ens->tls_sessions_path);
+        return;
+    }
+    curl_easy_setopt(curl, CURLOPT_SHARE, ens->share);
+
+    if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) || memcmp(magic, ENS_TLS_SESSIONS_MAGIC, sizeof(magic)) != 0) {
+        ens_log(ens, ENS_ERROR_FILE, ENS_LOG_LEVEL_WARN, "Failed to load TLS sessions from %s: Unknown file format", ens->tls_sessions_path);
+        goto done;
+    }
+
+    now = time(NULL);
+
+    while (ret == CURLE_OK) {
+        shmac = sdata = NULL;
+
+        key = ens_tls_sessions_read_field(f, &key_len);
+        if (key == NULL) {
+            break;
+        }
+
+        shmac = ens_tls_sessions_read_field(f, &shmac_len);
+        sdata = ens_tls_sessions_read_field(f, &sdata_len);
+
+        if (shmac != NULL && sdata != NULL && key[key_len - 1] == '\0' && fread(&expires, sizeof(expires), 1, f) == 1) {
+            if (expires > now) {
+                ret = ens->ssls_import(curl, key, shmac, shmac_len, sdata, sdata_len);
+                count += ret == CURLE_OK;
+            }
+        }
+        else {
+            ret = CURLE_READ_ERROR;
+        }
+
+        free(key);
+        free(shmac);
+        free(sdata);
+    }
+
+    if (ret == CURLE_NOT_BUILT_IN) {
+        ens_log(ens, ENS_ERROR_FILE, ENS_LOG_LEVEL_WARN, "Failed to load TLS sessions from %s: cURL was built without support for exporting TLS sessions", ens->tls_sessions_path);
+    }
+    else if (ret != CURLE_OK) {
+        ens_log(ens, ENS_ERROR_FILE, ENS_LOG_LEVEL_WARN, "Failed to load TLS sessions from %s: %s", ens->tls_sessions_path, curl_easy_strerror(ret));
+    }
+    else {
+        ens_log(ens, ENS_ERROR_OK, ENS_LOG_LEVEL_INFO, "Loaded %u TLS sessions from %s", count, ens->tls_sessions_path);
+    }
+
+done:
+    curl_easy_cleanup(curl);
+    fclose(f);
+}
+
+//written next to the old file and renamed over it so a crash leaves no partial file
+static void
+ens_tls_sessions_save(ens_t *ens, CURL *curl) {
+    char path[ENS_PATH_MAX_LEN + 5];
+    FILE *f = NULL;
+    CURLcode ret;
+    int fd;
+
+    pthread_mutex_lock(&ens->tls_sessions_mutex);
+
+    //cURL is too old or was built without support for exporting sessions
+    if (ens->ssls_export == NULL) {
+        goto done;
+    }
+
+    snprintf(path, sizeof(path), "%s.tmp", ens->tls_sessions_path);
+
+    //the sessions are as sensitive as the password
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd != -1) {
+        f = fdopen(fd, "wb");
+        if (f == NULL) {
+            close(fd);
+        }
+    }
+    if (f == NULL) {
+        ens_log(ens, ENS_ERROR_FILE, ENS_LOG_LEVEL_WARN, "Failed to save TLS sessions to %s: %s", path, strerror(errno));
+        goto done;
+    }
+
+    if (fwrite(ENS_TLS_SESSIONS_MAGIC, 1, sizeof(ENS_TLS_SESSIONS_MAGIC) - 1, f) != sizeof(ENS_TLS_SESSIONS_MAGIC) - 1) {
+        ret = CURLE_WRITE_ERROR;
+    }
+    else {
+        ret = ens->ssls_export(curl, ens_tls_sessions_export, f);
+    }
+
+    if (fclose(f) != 0 && ret == CURLE_OK) {
+        ret = CURLE_WRITE_ERROR;
+    }
+
+    if (ret != CURLE_OK || rename(path, ens->tls_sessions_path) != 0) {
+        if (ret == CURLE_NOT_BUILT_IN) {
+            ens_log(ens, ENS_ERROR_FILE, ENS_LOG_LEVEL_WARN, "Failed to save TLS sessions to %s: cURL was built without support for exporting TLS sessions", ens->tls_sessions_path);
+            ens->ssls_export = NULL;
+        }
+        else if (ret == CURLE_OK) {
+            ens_log(ens, ENS_ERROR_FILE, ENS_LOG_LEVEL_WARN, "Failed to save TLS sessions to %s: %s", ens->tls_sessions_path, strerror(errno));
+        }
+        else {
+            ens_log(ens, ENS_ERROR_FILE, ENS_LOG_LEVEL_WARN, "Failed to save TLS sessions to %s: %s", ens->tls_sessions_path, curl_easy_strerror(ret));
+        }
+        unlink(path);
+    }
+
+done:
+    pthread_mutex_unlock(&ens->tls_sessions_mutex);
+}
+
+//the group's emails_mutex must be held
+static bool
+ens_send_email_prepare(ens_delivery_t *delivery) {
+    ens_group_t *group;
+
+    group = delivery->group;
+
+    delivery->envelope = ens_envelope_get(group);
+    if (delivery->envelope == NULL) {
+        return false;
+    }
+
+    snprintf(delivery->pool_key, sizeof(delivery->pool_key), "%s\n%s\n%s", group->config.host, group->config.username, group->config.ca_path);
+
+    //cURL keeps its own copy of each string option
+    delivery->curl = ens_pool_get(delivery->ens, delivery->pool_key);
+    if (delivery->curl == NULL) {
+        return false;
+    }
+
+    //new handles from the pool aren't attached to the share yet
+    curl_easy_setopt(delivery->curl, CURLOPT_SHARE, delivery->ens->share);
+    curl_easy_setopt(delivery->curl, CURLOPT_MAXAGE_CONN, (long)delivery->ens->pool_idle_timeout);
+    curl_easy_setopt(delivery->curl, CURLOPT_URL, group->config.host);
+    curl_easy_setopt(delivery->curl, CURLOPT_MAIL_FROM, group->config.from);
+    curl_easy_setopt(delivery->curl, CURLOPT_MAIL_RCPT, delivery->envelope->to);
+    if (group->config.username[0] != '\0') {
+        curl_easy_setopt(delivery->curl, CURLOPT_USERNAME, group->config.username);
+    }
+    if (group->config.password[0] != '\0') {
+        curl_easy_setopt(delivery->curl, CURLOPT_PASSWORD, group->config.password);
+    }
+    if (group->config.ca_path[0] != '\0') {
+        curl_easy_setopt(delivery->curl, CURLOPT_USE_SSL, (long)CURLUSESSL_ALL);
+        curl_easy_setopt(delivery->curl, CURLOPT_CAINFO, group->config.ca_path);
+        delivery->tls = true;
+    }
+
+    return true;
+}
+
+static void
+ens_send_email_setup(ens_delivery_t *delivery) {
+    curl_easy_setopt(delivery->curl, CURLOPT_READFUNCTION, email_read);
+    curl_easy_setopt(delivery->curl, CURLOPT_READDATA, delivery);
+    curl_easy_setopt(delivery->curl, CURLOPT_UPLOAD, 1L);
+    curl_easy_setopt(delivery->curl, CURLOPT_ERRORBUFFER, delivery->error);
+    curl_easy_setopt(delivery->curl, CURLOPT_PRIVATE, delivery);
+    //curl_easy_setopt(delivery->curl, CURLOPT_VERBOSE, 1L);
+}
+
+static void
+ens_send_email_result(ens_delivery_t *delivery, CURLcode ret) {
+    long code = 0, connects = 0;
+
+    curl_easy_getinfo(delivery->curl, CURLINFO_RESPONSE_CODE, &code);
+    curl_easy_getinfo(delivery->curl, CURLINFO_NUM_CONNECTS, &connects);
+
+    //no new connections means a pooled connection was reused
+    if (connects == 0) {
+        atomic_fetch_add(&delivery->ens->connection_hits, 1);
+    }
+    else {
+        atomic_fetch_add(&delivery->ens->connection_misses, 1);
+
+        if (delivery->tls && ret == CURLE_OK && delivery->ens->tls_sessions_path[0] != '\0') {
+            ens_tls_sessions_save(delivery->ens, delivery->curl);
+        }
+    }
+
+    if (ret != CURLE_OK) {
+        ens_log(delivery->ens, ENS_ERROR_EMAIL_FAILED, ENS_LOG_LEVEL_ERROR, "Failed to send email for group %d: %s: SMTP code %ld: %s", delivery->group->id, curl_easy_strerror(ret), code, delivery->error);
+    }
+}
+
+//the group's emails_mutex must be held
+static bool
+ens_send_email_file_prepare(ens_delivery_t *delivery) {
+    delivery->envelope = ens_envelope_get(delivery->group);
+
+    return delivery->envelope != NULL;
+}
+
+static void
+ens_file_write_buffer(FILE *f, buffer_t *buffer) {
+    struct iovec iov[ENS_READ_IOV_MAX];
+    int i, count;
+
+    count = buffer_iovec(buffer, iov, ENS_READ_IOV_MAX);
+    for (i = 0; i < count && i < ENS_READ_IOV_MAX; i++) {
+        fwrite(iov[i].iov_base, 1, iov[i].iov_len, f);
+    }
+}
+
+//TODO: error handling for fprintf?
+static int
+ens_send_email_file(ens_delivery_t *delivery) {
+    ens_group_t *group;
+    ens_email_t *email;
+    buffer_t *body = NULL;
+    time_t now;
+    struct tm now_tm;
+    char now_buf[32], buf[160];
+    unsigned int kept;
+
+    //only the context's thread touches the file
+    group = delivery->group;
+    kept = delivery->emails_count;
+
+    if (group->f == NULL) {
+        group->f = fopen(group->f_path, "w");
+        if (group->f == NULL) {
+            return ens_log(delivery->ens, ENS_ERROR_FILE, ENS_LOG_LEVEL_ERROR, "Failed to write to file for group %d: Could not open file: %s", group->id, strerror(errno));
+        }
+    }
+
+    now = time(NULL);
+    localtime_r(&now, &now_tm);
+    strftime(now_buf, sizeof(now_buf), "%Y-%m-%d %H:%M:%S", &now_tm);
+
+    while ((email = ens_delivery_pop(delivery)) != NULL) {
+        if (group->stats.emails_sent > 0) {
+            fprintf(group->f, "\n");
+        }
+
+        fprintf(group->f, "[%s]\n", now_buf);
+        ens_file_write_buffer(group->f, delivery->envelope->file_headers);
+        fprintf(group->f, "Subject: %s\n", email->subject);
+        if (ens_email_describe_occurrences(email, buf, sizeof(buf))) {
+            fputs(buf, group->f);
+        }
+        if (email->storage != ENS_EMAIL_DEFERRED) {
+            fprintf(group->f, "%s\n", email->body);
+        }
+        else if ((body = buffer_init()) != NULL && format_render(email->format, email->body, body)) {
+            ens_file_write_buffer(group->f, body);
+            fprintf(group->f, "\n");
+        }
+        else {
+            ens_log(delivery->ens, ENS_ERROR_MEMORY, ENS_LOG_LEVEL_FATAL, "Failed to write email for group %d: Out of memory", group->id);
+        }
+
+        buffer_free(body);
+        body = NULL;
+
+        ens_group_email_free(group, email);
+    }
+
+    if (ens_coalesce_describe_dropped(delivery->coalesce, buf, sizeof(buf))) {
+        fprintf(group->f, "\n[%s]\n%s\n", now_buf, buf);
+    }
+    if (delivery->emails_left_out > 0) {
+        fprintf(group->f, "\n[%s]\n%u of %llu emails were kept as a sample\n", now_buf, kept,
+                (unsigned long long)(kept + delivery->emails_left_out));
+    }
+
+    fflush(group->f);
+
+    return ENS_ERROR_OK;
+}
+
+static void
+ens_delivery_free(ens_delivery_t *delivery) {
+    if (delivery->curl != NULL) {
+        ens_pool_put(delivery->ens, delivery->pool_key, delivery->curl);
+    }
+    ens_envelope_unref(delivery->envelope);
+    ens_coalesce_free(delivery->coalesce);
+    buffer_free(delivery->buffer);
+
+    free(delivery);
+}
+
+//frees what's queued for a group that's been unregistered, unless it's being sent, in which case ens_deliver_end() calls this
+static void
+ens_group_discard(ens_t *ens, ens_group_t *group) {
+    ens_delivery_t *delivery;
+    ens_email_t *email;
+    bool claimed;
+
+    //the emails are freed with the group instead
+    delivery = calloc(1, sizeof(*delivery));
+    if (delivery == NULL) {
+        return;
+    }
+
+    delivery->ens = ens;
+    delivery->group = group;
+
+    //a send that lost the race with unregistering can push one more email at any time
+    for (;;) {
+        pthread_mutex_lock(&group->emails_mutex);
+        claimed = !group->registered && !group->busy && group->pending > 0;
+        if (claimed) {
+            group->busy = true;
+        }
+        pthread_mutex_unlock(&group->emails_mutex);
+
+        if (!claimed) {
+            break;
+        }
+
+        ens_delivery_drain(delivery);
+        while ((email = ens_delivery_pop(delivery)) != NULL) {
+            ens_group_email_free(group, email);
+        }
+
+        pthread_mutex_lock(&group->emails_mutex);
+        group->busy = false;
+        pthread_mutex_unlock(&group->emails_mutex);
+    }
+
+    ens_delivery_free(delivery);
+}
+
+//schedules the group again if more emails came in while it was sent
+static void
+ens_deliver_end(ens_delivery_t *delivery) {
+    ens_group_t *group;
+    ens_email_t *email;
+
+    group = delivery->group;
+
+    //make sure the emails are always cleared
+    while ((email = ens_delivery_pop(delivery)) != NULL) {
+        ens_group_email_free(group, email);
+    }
+
+    //the retired arena is normally empty now
+    ens_epoch_reset(&group->epochs[(atomic_load(&group->epoch) + 1) & 1]);
+
+    pthread_mutex_lock(&group->emails_mutex);
+    ++group->stats.emails_sent;
+    group->expires = delivery->now + group->config.interval;
+    group->busy = false;
+
+    //emails that came in while sending wait for the next interval
+    if (group->registered && group->pending > 0 && !ens_schedule_group(delivery->ens, group)) {
+        ens_log(delivery->ens, ENS_ERROR_MEMORY, ENS_LOG_LEVEL_FATAL, "Failed to schedule group %d: Out of memory", group->id);
+    }
+    pthread_mutex_unlock(&group->emails_mutex);
+
+    //unregistering couldn't take them back while they were being sent
+    if (!group->registered) {
+        ens_group_discard(delivery->ens, group);
+    }
+
+    ens_group_unref(group);
+    ens_delivery_free(delivery);
+}
+
+//drains the queue so the emails are sent without holding any locks
+static ens_delivery_t *
+ens_deliver_begin(ens_t *ens, ens_group_t *group) {
+    ens_delivery_t *delivery;
+    bool claimed = false, prepared = false;
+
+    delivery = calloc(1, sizeof(*delivery));
+    if (delivery == NULL || (delivery->buffer = buffer_init_ex(4096)) == NULL) {
+        free(delivery);
+        ens_log(ens, ENS_ERROR_MEMORY, ENS_LOG_LEVEL_FATAL, "Failed to send email for group %d: Out of memory", group->id);
+        return NULL;
+    }
+
+    delivery->ens = ens;
+    delivery->group = group;
+    delivery->now = time(NULL);
+
+    //the group can be unregistered while it waits for a worker
+    pthread_mutex_lock(&group->emails_mutex);
+    if (group->registered && !group->busy && group->pending > 0) {
+        group->busy = true;
+        claimed = true;
+
+        delivery->mode = group->config.mode;
+        delivery->file = group->f_path[0] != '\0';
+        prepared = delivery->file ? ens_send_email_file_prepare(delivery) : ens_send_email_prepare(delivery);
+    }
+    pthread_mutex_unlock(&group->emails_mutex);
+
+    if (!claimed) {
+        ens_delivery_free(delivery);
+        if (!group->registered) {
+            ens_group_discard(ens, group);
+        }
+        return NULL;
+    }
+
+    ens_group_ref(group);
+    ens_delivery_drain(delivery);
+
+    if (!prepared || delivery->emails_count == 0) {
+        if (!prepared) {
+            ens_log(ens, ENS_ERROR_MEMORY, ENS_LOG_LEVEL_FATAL, "Failed to send email for group %d: Out of memory", group->id);
+        }
+        ens_deliver_end(delivery);
+        return NULL;
+    }
+
+    return delivery;
+}
+
+static void
+ens_deliver(ens_t *ens, ens_group_t *group) {
+    ens_delivery_t *delivery;
+
+    delivery = ens_deliver_begin(ens, group);
+    if (delivery == NULL) {
+        return;
+    }
+
+    if (delivery->file) {
+        ens_send_email_file(delivery);
+    }
+    else {
+        ens_send_email_setup(delivery);
+        ens_send_email_result(delivery, curl_easy_perform(delivery->curl));
+    }
+
+    ens_deliver_end(delivery);
+}
+
+static int64_t
+ens_now_ms() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+//keeps the epoll set in sync with the sockets cURL waits on
+static int
+ens_async_socket(CURL *curl, curl_socket_t fd, int what, void *user_data, void *socket_data) {
+    ens_t *ens;
+    struct epoll_event event;
+
+    ens = (ens_t *)user_data;
+
+    if (what == CURL_POLL_REMOVE) {
+        epoll_ctl(ens->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
         return 0;
     }
 
-    //write each recipient
-    for (i = 0; i < alist_size(context->group->config.to); i++) {
-        if (!buffer_writef(context->buffer, "To: %s\r\n", alist_get(context->group->config.to, i))) {
-            ens_log(context->ens, ENS_ERROR_MEMORY, ENS_LOG_LEVEL_FATAL, "Failed to send email for group %d: Out of memory", context->group->id);
-            return CURL_READFUNC_ABORT;
+    memset(&event, 0, sizeof(event));
+    event.data.fd = fd;
+    if (what & CURL_POLL_IN) {
+        event.events |= EPOLLIN;
+    }
+    if (what & CURL_POLL_OUT) {
+        event.events |= EPOLLOUT;
+    }
+
+    //tells new sockets from ones already being watched
+    if (socket_data == NULL) {
+        epoll_ctl(ens->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+        curl_multi_assign(ens->multi, fd, ens);
+    }
+    else {
+        epoll_ctl(ens->epoll_fd, EPOLL_CTL_MOD, fd, &event);
+    }
+
+    return 0;
+}
+
+static int
+ens_async_timer(CURLM *multi, long timeout_ms, void *user_data) {
+    ens_t *ens;
+
+    ens = (ens_t *)user_data;
+    ens->multi_expires = timeout_ms < 0 ? -1 : ens_now_ms() + timeout_ms;
+
+    return 0;
+}
+
+//how long to sleep until cURL has a timeout or, if scheduled, a group is due
+static int
+ens_async_timeout(ens_t *ens, bool scheduled) {
+    int64_t timeout = -1, multi_timeout;
+    ens_group_t *group = NULL;
+    struct timespec ts;
+
+    if (scheduled) {
+        pthread_mutex_lock(&ens->schedule_mutex);
+        group = heap_peek(ens->schedule);
+        if (group != NULL) {
+            clock_gettime(CLOCK_REALTIME, &ts);
+            timeout = group->expires <= ts.tv_sec ? 0 : (int64_t)(group->expires - ts.tv_sec) * 1000 - ts.tv_nsec / 1000000 + 1;
+        }
+        pthread_mutex_unlock(&ens->schedule_mutex);
+    }
+
+    if (ens->multi_expires >= 0) {
+        multi_timeout = ens->multi_expires - ens_now_ms();
+        if (multi_timeout < 0) {
+            multi_timeout = 0;
+        }
+        if (timeout < 0 || multi_timeout < timeout) {
+            timeout = multi_timeout;
+        }
+    }
+
+    return timeout > INT32_MAX ? INT32_MAX : (int)timeout;
+}
+
+static void
+ens_async_remove(ens_t *ens, ens_delivery_t *delivery) {
+    unsigned int i;
+
+    curl_multi_remove_handle(ens->multi, delivery->curl);
+
+    for (i = 0; i < alist_size(ens->transfers); i++) {
+        if (alist_get(ens->transfers, i) == delivery) {
+            alist_remove(ens->transfers, i);
+            break;
+        }
+    }
+}
+
+//groups writing to a file are written right away
+static void
+ens_async_deliver(ens_t *ens, ens_group_t *group) {
+    ens_delivery_t *delivery;
+
+    delivery = ens_deliver_begin(ens, group);
+    if (delivery == NULL) {
+        return;
+    }
+
+    if (delivery->file) {
+        ens_send_email_file(delivery);
+        ens_deliver_end(delivery);
+        return;
+    }
+
+    ens_send_email_setup(delivery);
+
+    if (!alist_add(ens->transfers, delivery)) {
+        ens_log(ens, ENS_ERROR_MEMORY, ENS_LOG_LEVEL_FATAL, "Failed to send email for group %d: Out of memory", group->id);
+        ens_deliver_end(delivery);
+    }
+    else if (curl_multi_add_handle(ens->multi, delivery->curl) != CURLM_OK) {
+        alist_remove(ens->transfers, alist_size(ens->transfers) - 1);
+        ens_log(ens, ENS_ERROR_EMAIL_FAILED, ENS_LOG_LEVEL_ERROR, "Failed to send email for group %d: Could not start the transfer", group->id);
+        ens_deliver_end(delivery);
+    }
+}
+
+static void
+ens_async_done(ens_t *ens) {
+    ens_delivery_t *delivery;
+    CURLcode ret;
+    CURLMsg *msg;
+    int left;
+
+    while ((msg = curl_multi_info_read(ens->multi, &left)) != NULL) {
+        if (msg->msg != CURLMSG_DONE) {
+            continue;
         }
+
+        ret = msg->data.result;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&delivery);
+
+        ens_async_remove(ens, delivery);
+        ens_send_email_result(delivery, ret);
+        ens_deliver_end(delivery);
     }
+}
 
-    //write the sender
-    if (!buffer_writef(context->buffer, "From: %s\r\n", context->group->config.from)) {
-        ens_log(context->ens, ENS_ERROR_MEMORY, ENS_LOG_LEVEL_FATAL, "Failed to send email for group %d: Out of memory", context->group->id);
-        return CURL_READFUNC_ABORT;
+static bool
+ens_async_start(ens_t *ens) {
+    struct epoll_event event;
+
+    ens->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (ens->epoll_fd == -1) {
+        return false;
     }
 
-    //write the subject
-    switch (context->group->config.mode) {
-        case ENS_GROUP_MODE_DROP:
-            email = queue_pop(context->group->emails);
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = ens->wake_fd;
+    if (epoll_ctl(ens->epoll_fd, EPOLL_CTL_ADD, ens->wake_fd, &event) != 0) {
+        goto fail;
+    }
+
+    ens->multi = curl_multi_init();
+    if (ens->multi == NULL) {
+        goto fail;
+    }
 
-            success = buffer_writef(context->buffer, "Subject: %s\r\n", email->subject) &&
-                      buffer_writef(context->buffer, "\r\n") &&
-                      buffer_writef(context->buffer, "%s\n", email->body);
+    ens->multi_expires = -1;
+    curl_multi_setopt(ens->multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)ens->max_host_connections);
+    curl_multi_setopt(ens->multi, CURLMOPT_SOCKETFUNCTION, ens_async_socket);
+    curl_multi_setopt(ens->multi, CURLMOPT_SOCKETDATA, ens);
+    curl_multi_setopt(ens->multi, CURLMOPT_TIMERFUNCTION, ens_async_timer);
+    curl_multi_setopt(ens->multi, CURLMOPT_TIMERDATA, ens);
 
-            ens_email_free(email);
+    return true;
 
-            if (!success) {
-                ens_log(context->ens, ENS_ERROR_MEMORY, ENS_LOG_LEVEL_FATAL, "Failed to send email for group %d: Out of memory", context->group->id);
-                return CURL_READFUNC_ABORT;
+fail:
+    close(ens->epoll_fd);
+    ens->epoll_fd = -1;
+    return false;
+}
+
+//waits for and handles one round of socket events and cURL timeouts
+static void
+ens_async_poll(ens_t *ens, bool scheduled) {
+    struct epoll_event events[ENS_ASYNC_EVENTS];
+    uint64_t count;
+    int i, n, flags, handles;
+
+    n = epoll_wait(ens->epoll_fd, events, ENS_ASYNC_EVENTS, ens_async_timeout(ens, scheduled));
+
+    for (i = 0; i < n; i++) {
+        if (events[i].data.fd == ens->wake_fd) {
+            if (read(ens->wake_fd, &count, sizeof(count)) != sizeof(count)) {
+                //another wake up already reset the counter
             }
+            continue;
+        }
 
-            break;
-        case ENS_GROUP_MODE_COLLECT:
-            i = 0;
+        flags = 0;
+        if (events[i].events & EPOLLIN) {
+            flags |= CURL_CSELECT_IN;
+        }
+        if (events[i].events & EPOLLOUT) {
+            flags |= CURL_CSELECT_OUT;
+        }
+        if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+            flags |= CURL_CSELECT_ERR;
+        }
+
+        curl_multi_socket_action(ens->multi, events[i].data.fd, flags, &handles);
+    }
 
-            success = buffer_writef(context->buffer, "Subject: %u Emails\r\n", queue_size(context->group->emails)) &&
-                      buffer_writef(context->buffer, "\r\n");
+    if (ens->multi_expires >= 0 && ens_now_ms() >= ens->multi_expires) {
+        ens->multi_expires = -1;
+        curl_multi_socket_action(ens->multi, CURL_SOCKET_TIMEOUT, 0, &handles);
+    }
 
-            while (success && queue_size(context->group->emails) > 0) {
-                email = queue_pop(context->group->emails);
+    ens_async_done(ens);
+}
 
-                if (i > 0) {
-                    success = buffer_writef(context->buffer, "\n\n");
-                }
+//the emails still being sent are finished first, as the worker threads do
+static void
+ens_async_stop(ens_t *ens) {
+    while (alist_size(ens->transfers) > 0) {
+        ens_async_poll(ens, false);
+    }
 
-                if (success) {
-                    success = buffer_writef(context->buffer, "Subject: %s\n", email->subject) &&
-                              buffer_writef(context->buffer, "%s", email->body);
-                }
+    curl_multi_cleanup(ens->multi);
+    ens->multi = NULL;
+
+    close(ens->epoll_fd);
+    ens->epoll_fd = -1;
+}
+
+//drives cURL's multi interface from an epoll loop for ENS_OPTION_ASYNC
+static void *
+ens_process_async(void *user_data) {
+    ens_group_t *group;
+    ens_t *ens;
+
+    ens = (ens_t *)user_data;
+
+    while (ens->running) {
+        ens_async_poll(ens, true);
+
+        while (ens->running && (group = ens_schedule_pop(ens, time(NULL))) != NULL) {
+            ens_async_deliver(ens, group);
+            ens_group_unref(group);
+        }
+    }
+
+    ens_async_stop(ens);
+
+    return NULL;
+}
+
+//the worker takes over the caller's reference to the group
+static void
+ens_work_push(ens_t *ens, ens_group_t *group) {
+    bool success;
+
+    pthread_mutex_lock(&ens->work_mutex);
+    success = queue_push(ens->work, group);
+    if (success) {
+        pthread_cond_signal(&ens->work_cond);
+    }
+    pthread_mutex_unlock(&ens->work_mutex);
+
+    //don't lose the emails, just send them from this thread instead
+    if (!success) {
+        ens_deliver(ens, group);
+        ens_group_unref(group);
+    }
+}
+
+static void
+ens_check_groups(ens_t *ens) {
+    ens_group_t *group;
+
+    while (ens->running && (group = ens_schedule_pop(ens, time(NULL))) != NULL) {
+        if (ens->worker_threads > 0) {
+            ens_work_push(ens, group);
+        }
+        else {
+            ens_deliver(ens, group);
+            ens_group_unref(group);
+        }
+    }
+}
+
+static void *
+ens_process(void *user_data) {
+    ens_t *ens;
+
+    ens = (ens_t *)user_data;
+
+    while (ens->running) {
+        ens_schedule_wait(ens);
+        ens_check_groups(ens);
+    }
+
+    return NULL;
+}
+
+//a group is only handed to one worker at a time
+static void *
+ens_work(void *user_data) {
+    ens_t *ens;
+    ens_group_t *group;
+
+    ens = (ens_t *)user_data;
+
+    pthread_mutex_lock(&ens->work_mutex);
+    while (ens->running) {
+        group = queue_pop(ens->work);
+        if (group == NULL) {
+            pthread_cond_wait(&ens->work_cond, &ens->work_mutex);
+            continue;
+        }
+
+        pthread_mutex_unlock(&ens->work_mutex);
+        ens_deliver(ens, group);
+        ens_group_unref(group);
+        pthread_mutex_lock(&ens->work_mutex);
+    }
+
+    //put anything that wasn't sent back on the schedule for the next start
+    while ((group = queue_pop(ens->work)) != NULL) {
+        pthread_mutex_lock(&group->emails_mutex);
+        if (group->registered && group->pending > 0) {
+            ens_schedule_group(ens, group);
+        }
+        pthread_mutex_unlock(&group->emails_mutex);
+
+        ens_group_unref(group);
+    }
+    pthread_mutex_unlock(&ens->work_mutex);
+
+    return NULL;
+}
+
+static void
+ens_work_stop(ens_t *ens, unsigned int count, bool join) {
+    unsigned int i;
+
+    pthread_mutex_lock(&ens->work_mutex);
+    pthread_cond_broadcast(&ens->work_cond);
+    pthread_mutex_unlock(&ens->work_mutex);
+
+    for (i = 0; i < count; i++) {
+        if (join) {
+            pthread_join(ens->workers[i], NULL);
+        }
+        else {
+            pthread_detach(ens->workers[i]);
+        }
+    }
+
+    free(ens->workers);
+    ens->workers = NULL;
+}
+
+int
+ens_start(ens_t *ens) {
+    int ret = ENS_ERROR_OK;
+    unsigned int i;
+
+    if (ens->running) {
+        return ENS_ERROR_ALREADY_RUNNING;
+    }
+
+    ens->running = true;
+
+    ens_tls_sessions_load(ens);
+
+    //start the asynchronous engine, which doesn't need the worker threads
+    if (ens->async) {
+        if (!ens_async_start(ens)) {
+            ret = ens_log(ens, ENS_ERROR_THREAD, ENS_LOG_LEVEL_FATAL, "Failed to start the asynchronous engine");
+        }
+    }
+    else if (ens->worker_threads > 0) {
+        ens->workers = calloc(ens->worker_threads, sizeof(*ens->workers));
+        if (ens->workers == NULL) {
+            ret = ens_log(ens, ENS_ERROR_MEMORY, ENS_LOG_LEVEL_FATAL, "Failed to start the worker threads: Out of memory");
+        }
+
+        for (i = 0; ret == ENS_ERROR_OK && i < ens->worker_threads; i++) {
+            if (pthread_create(&ens->workers[i], NULL, ens_work, ens) != 0) {
+                ret = ens_log(ens, ENS_ERROR_THREAD, ENS_LOG_LEVEL_FATAL, "Failed to start worker thread %u: %s", i, strerror(errno));
+                ens->running = false;
+                ens_work_stop(ens, i, true);
+            }
+        }
+    }
+
+    //start the context's thread
+    if (ret == ENS_ERROR_OK) {
+        if (pthread_create(&ens->thread, NULL, ens->async ? ens_process_async : ens_process, ens) != 0) {
+            ret = ens_log(ens, ENS_ERROR_THREAD, ENS_LOG_LEVEL_FATAL, "Failed to start the thread: %s", strerror(errno));
+            ens->running = false;
+            if (ens->async) {
+                ens_async_stop(ens);
+            }
+            else if (ens->workers != NULL) {
+                ens_work_stop(ens, ens->worker_threads, true);
+            }
+        }
+    }
+    else {
+        ens->running = false;
+    }
+
+    return ret;
+}
+
+static int
+ens_stop_helper(ens_t *ens, bool join) {
+    ens_group_t *group;
+    unsigned int i;
+
+    if (!ens->running) {
+        return ENS_ERROR_NOT_RUNNING;
+    }
+
+    pthread_mutex_lock(&ens->schedule_mutex);
+    ens->running = false;
+    ens_schedule_wake(ens);
+    pthread_mutex_unlock(&ens->schedule_mutex);
+
+    if (join) {
+        pthread_join(ens->thread, NULL);
+    }
+
+    if (ens->workers != NULL) {
+        ens_work_stop(ens, ens->worker_threads, join);
+    }
+
+    //if any groups are writing to a file, close them now
+    i = 0;
+    pthread_rwlock_rdlock(&ens->groups_lock);
+    while ((group = hmap_next(ens->groups, &i)) != NULL) {
+        if (group->f != NULL) {
+            fclose(group->f);
+            group->f = NULL;
+        }
+    }
+    pthread_rwlock_unlock(&ens->groups_lock);
+
+    return ENS_ERROR_OK;
+}
+
+int
+ens_stop(ens_t *ens) {
+    return ens_stop_helper(ens, false);
+}
+
+int
+ens_stop_join(ens_t *ens) {
+    return ens_stop_helper(ens, true);
+}
+
+static ens_group_t *
+ens_group_find(ens_t *ens, ens_group_id_t id) {
+    return hmap_get(ens->groups, id);
+}
+
+int
+ens_group_register(ens_t *ens, ens_group_id_t id) {
+    int ret = ENS_ERROR_OK;
+    ens_group_t *group;
+
+    pthread_rwlock_wrlock(&ens->groups_lock);
+    group = ens_group_find(ens, id);
+    if (group != NULL) {
+        ret = ens_log(ens, ENS_ERROR_ALREADY_REGISTERED, ENS_LOG_LEVEL_ERROR, "Failed to register group %d Already registered", id);
+        goto done;
+    }
+
+    group = ens_group_init(ens);
+    if (group == NULL) {
+        ret = ens_log(ens, ENS_ERROR_MEMORY, ENS_LOG_LEVEL_FATAL, "Failed to register group %d: Out of memory", id);
+        goto done;
+    }
+
+    if (!hmap_put(ens->groups, id, group)) {
+        ens_group_free(group);
+        ret = ens_log(ens, ENS_ERROR_MEMORY, ENS_LOG_LEVEL_FATAL, "Failed to register group %d: Out of memory", id);
+        goto done;
+    }
+
+    group->id = id;
+    group->registered = true;
+
+done:
+    pthread_rwlock_unlock(&ens->groups_lock);
+
+    return ret;
+}
+
+int
+ens_group_unregister(ens_t *ens, ens_group_id_t id) {
+    ens_group_t *group;
+
+    pthread_rwlock_wrlock(&ens->groups_lock);
+    group = hmap_remove(ens->groups, id);
+    if (group != NULL) {
+        //the context's thread may still be sending the group's emails
+        pthread_mutex_lock(&group->emails_mutex);
+        group->registered = false;
+        pthread_mutex_unlock(&group->emails_mutex);
+
+        pthread_mutex_lock(&ens->schedule_mutex);
+        if (group->schedule_index != HEAP_INDEX_NONE) {
+            heap_remove(ens->schedule, group->schedule_index);
+        }
+        pthread_mutex_unlock(&ens->schedule_mutex);
+
+        //handles can keep the group around, but its emails are never sent
+        ens_group_discard(ens, group);
+        ens_drop_gate_clear(ens, id);
+        ens_group_unref(group);
+    }
+    pthread_rwlock_unlock(&ens->groups_lock);
+
+    if (group == NULL) {
+        return ens_log(ens, ENS_ERROR_NOT_REGISTERED, ENS_LOG_LEVEL_ERROR, "Failed to unregister group %d: Not registered", id);
+    }
+
+    return ENS_ERROR_OK;
+}
+
+static void
+ens_email_source_free(const ens_email_source_t *source) {
+    if (source->storage == ENS_EMAIL_OWNED) {
+        source->free_function((void *)source->subject);
+        source->free_function((void *)source->body);
+    }
+}
+
+static size_t
+ens_group_room(ens_t *ens, ens_group_t *group) {
+    ens_usage_t *usages[2] = {&group->queued, &ens->queued}, *maxes[2] = {&group->queued_max, &ens->queued_max};
+    size_t room = SIZE_MAX, max, used;
+    unsigned int i;
+
+    for (i = 0; i < 2; i++) {
+        max = atomic_load_explicit(&maxes[i]->bytes, memory_order_relaxed);
+        if (max == 0) {
+            continue;
+        }
+
+        used = atomic_load_explicit(&usages[i]->bytes, memory_order_relaxed);
+        if (used >= max) {
+            return 0;
+        }
+        if (max - used < room) {
+            room = max - used;
+        }
+    }
 
-                ens_email_free(email);
+    return room;
+}
 
-                if (!success) {
-                    ens_log(context->ens, ENS_ERROR_MEMORY, ENS_LOG_LEVEL_FATAL, "Failed to send email for group %d: Out of memory", context->group->id);
-                    return CURL_READFUNC_ABORT;
-                }
-            }
+//drops a COLLECT group's oldest emails until one of the size fits
+static bool
+ens_group_drop_oldest(ens_t *ens, ens_group_t *group, size_t bytes) {
+    queue_mpsc_node_t *node;
+    ens_email_t *email;
+    bool reserved;
+
+    //the context's thread drains the queue under the same lock
+    pthread_mutex_lock(&group->coalesce_mutex);
+    while (!(reserved = ens_group_reserve(ens, group, bytes)) && (node = queue_mpsc_pop(group->emails)) != NULL) {
+        email = (ens_email_t *)node;
+        if (email->coalesced != NULL) {
+            email->coalesced->email = NULL;
+        }
 
-            break;
+        atomic_fetch_sub(&group->pending, 1);
+        atomic_fetch_add_explicit(&group->stats.emails_dropped, 1, memory_order_relaxed);
+        ens_group_email_free(group, email);
     }
+    pthread_mutex_unlock(&group->coalesce_mutex);
 
-    //TODO: Handle larger emails instead of aborting
-    if (buffer_length(context->buffer) > size * nmemb) {
-        ens_log(context->ens, ENS_ERROR_MEMORY, ENS_LOG_LEVEL_ERROR, "Failed to send email for group %d: The email is %u bytes but cURL's buffer is only %zu", context->group->id, buffer_length(context->buffer), size * nmemb);
-        return CURL_READFUNC_ABORT;
-    }
+    return reserved;
+}
 
-    memcpy(ptr, buffer_data(context->buffer), buffer_length(context->buffer));
+//body_len is shortened if the body has to be truncated
+static bool
+ens_group_make_room(ens_t *ens, ens_group_t *group, int overflow, size_t fixed, size_t *body_len) {
+    size_t room;
 
-    return buffer_length(context->buffer);
-}
+    if (ens_group_reserve(ens, group, fixed + *body_len)) {
+        return true;
+    }
 
-static void
-ens_send_email(ens_t *ens, ens_group_t *group) {
-    struct curl_slist *to = NULL;
-    unsigned int i;
-    long code;
-    char error[CURL_ERROR_SIZE];
-    bool success = false;
-    ens_curl_context_t context;
-    CURL *curl;
-    CURLcode ret;
+    switch (overflow) {
+        case ENS_OVERFLOW_DROP_OLDEST:
+            return ens_group_drop_oldest(ens, group, fixed + *body_len);
+        case ENS_OVERFLOW_TRUNCATE:
+            //it's the number of emails that's over the limit if the body fits
+            room = ens_group_room(ens, group);
+            if (room <= fixed || room - fixed >= *body_len || !ens_group_reserve(ens, group, room)) {
+                return false;
+            }
 
-    context.ens = ens;
-    context.group = group;
-    context.buffer = buffer_init(4096);
-    if (context.buffer == NULL) {
-        ens_log(ens, ENS_ERROR_MEMORY, ENS_LOG_LEVEL_FATAL, "Failed to send email for group %d: Out of memory", group->id);
-        return;
+            *body_len = room - fixed;
+            return true;
+        default:
+            return false;
     }
+}
 
-    for (i = 0; i < alist_size(group->config.to); i++) {
-        to = curl_slist_append(to, alist_get(group->config.to, i));
+//sets wake if the group has to be scheduled, and owns the source's buffers from here on
+static int
+ens_group_queue_source(ens_t *ens, ens_group_t *group, const ens_email_source_t *source, bool *wake) {
+    int ret = ENS_ERROR_OK;
+    unsigned int pending = 0;
+    bool made = false;
+    ens_group_id_t id = group->id;
+    ens_shard_t *shard;
+    ens_email_t *email = NULL;
+    ens_email_storage_t storage;
+    const format_t *format = NULL;
+    size_t subject_len = 0, body_len = 0;
+    va_list ap;
+    int mode, len = 0, i;
+    unsigned int coalesce_max;
+    ens_dedup_t *dedup = NULL;
+    uint64_t generation = 0;
+    size_t fixed, body_bytes, limited, reserved = 0;
+    int overflow;
+    ens_email_key_t key;
+    char *p;
+
+    key.made = NULL;
+
+    atomic_fetch_add_explicit(&group->stats.emails_total, 1, memory_order_relaxed);
+
+    //claimed before the push so the context's thread never sees fewer pending than queued
+    mode = group->config.mode;
+    if (mode == ENS_GROUP_MODE_DROP) {
+        atomic_store(ens_drop_gate(ens, id), ENS_DROP_GATE_ARMED(id));
+        if (!atomic_compare_exchange_strong(&group->pending, &pending, 1)) {
+            ret = ENS_ERROR_NOT_READY;
+            goto done;
+        }
     }
 
-    curl = curl_easy_init();
-    curl_easy_setopt(curl, CURLOPT_URL, group->config.host);
-    curl_easy_setopt(curl, CURLOPT_MAIL_FROM, group->config.from);
-    curl_easy_setopt(curl, CURLOPT_MAIL_RCPT, to);
-    if (group->config.username[0] != '\0') {
-        curl_easy_setopt(curl, CURLOPT_USERNAME, group->config.username);
+    //only the parts that are copied take up room in the email
+    storage = source->storage;
+    if (storage != ENS_EMAIL_OWNED) {
+        subject_len = strlen(source->subject);
     }
-    if (group->config.password[0] != '\0') {
-        curl_easy_setopt(curl, CURLOPT_PASSWORD, group->config.password);
+    if (storage == ENS_EMAIL_INLINE && source->body == NULL) {
+        for (i = 0; i < source->iovcnt; i++) {
+            body_len += source->iov[i].iov_len;
+        }
     }
-    if (group->config.ca_path[0] != '\0') {
-        curl_easy_setopt(curl, CURLOPT_USE_SSL, (long)CURLUSESSL_ALL);
-        curl_easy_setopt(curl, CURLOPT_CAINFO, group->config.ca_path);
+    else if (storage == ENS_EMAIL_INLINE) {
+        body_len = strlen(source->body);
     }
-    curl_easy_setopt(curl, CURLOPT_READFUNCTION, email_read);
-    curl_easy_setopt(curl, CURLOPT_READDATA, &context);
-    curl_easy_setopt(curl, CURLOPT_UPLOAD, 1L);
-    curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, error);
-    //curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
-    ret = curl_easy_perform(curl);
-    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+    else if (storage == ENS_EMAIL_DEFERRED) {
+        if (group->deferred_format) {
+            format = ens_format_get(ens, source->body);
+        }
 
-    if (ret == CURLE_OK) {
-        success = true;
-    }
-    else {
-        ens_log(ens, ENS_ERROR_EMAIL_FAILED, ENS_LOG_LEVEL_ERROR, "Failed to send email for group %d: %s: SMTP code %d: %s", group->id, curl_easy_strerror(ret), code, error);
+        //the body is either a record of the arguments or formatted in place
+        va_copy(ap, *source->ap);
+        if (format != NULL) {
+            body_len = format_capture_size(format, ap);
+        }
+        else {
+            storage = ENS_EMAIL_INLINE;
+            len = vsnprintf(NULL, 0, source->body, ap);
+            body_len = len;
+        }
+        va_end(ap);
     }
 
-    curl_slist_free_all(to);
-    curl_easy_cleanup(curl);
+    //only a COLLECT group that doesn't coalesce can drop its oldest emails
+    overflow = atomic_load_explicit(&group->overflow, memory_order_relaxed);
+    if (overflow == ENS_OVERFLOW_DROP_OLDEST && (mode != ENS_GROUP_MODE_COLLECT || group->coalesce_max > 0)) {
+        overflow = ENS_OVERFLOW_DROP_NEWEST;
+    }
 
-    buffer_free(context.buffer);
+    //only the email that claimed the group is hashed, from its recorded arguments if it has them
+    dedup = mode == ENS_GROUP_MODE_DROP ? atomic_load_explicit(&group->dedup, memory_order_acquire) : NULL;
+    if (len >= 0 && dedup != NULL) {
+        if (!ens_email_key_init(&key, source, storage, format, body_len)) {
+            goto fail;
+        }
 
-    //make sure the emails are always cleared
-    if (!success) {
-        while (queue_size(group->emails) > 0) {
-            ens_group_free(queue_pop(group->emails));
+        generation = ens_dedup_rotate(dedup);
+        if (ens_dedup_seen(dedup, key.hash)) {
+            atomic_store(&group->pending, 0);
+            ens_drop_gate_clear(ens, id);
+            ret = ENS_ERROR_DUPLICATE;
+            goto done;
         }
     }
-}
 
-//TODO: error handling for fprintf?
-static int
-ens_send_email_file(ens_t *ens, ens_group_t *group) {
-    ens_email_t *email;
-    time_t now;
-    struct tm now_tm;
-    char now_buf[32];
-    const char *to;
-    unsigned int i;
+    //a repeat only counts, so it's looked up before room is made for it or anything is made
+    coalesce_max = mode == ENS_GROUP_MODE_COLLECT ? group->coalesce_max : 0;
+    if (len >= 0 && coalesce_max > 0) {
+        if (!ens_email_key_init(&key, source, storage, format, body_len)) {
+            goto fail;
+        }
 
-    if (group->f == NULL) {
-        group->f = fopen(group->f_path, "w");
-        if (group->f == NULL) {
-            return ens_log(ens, ENS_ERROR_FILE, ENS_LOG_LEVEL_ERROR, "Failed to write to file for group %d: Could not open file: %s", group->id, strerror(errno));
+        if (ens_coalesce_count(group, &key)) {
+            goto done;
         }
     }
 
-    now = time(NULL);
-    localtime_r(&now, &now_tm);
-    strftime(now_buf, sizeof(now_buf), "%Y-%m-%d %H:%M:%S", &now_tm);
+    fixed = sizeof(*email) + 2 + (storage == ENS_EMAIL_OWNED ? strlen(source->subject) : subject_len);
+    body_bytes = storage == ENS_EMAIL_OWNED ? strlen(source->body) : body_len;
+    limited = body_bytes;
 
-    while (queue_size(group->emails) > 0) {
-        email = queue_pop(group->emails);
+    if (len >= 0) {
+        if (!ens_group_make_room(ens, group, overflow, fixed, &limited)) {
+            atomic_fetch_add_explicit(&group->stats.emails_dropped, 1, memory_order_relaxed);
+            if (mode == ENS_GROUP_MODE_DROP) {
+                atomic_store(&group->pending, 0);
+                ens_drop_gate_clear(ens, id);
+            }
 
-        if (group->stats.emails_sent > 0) {
-            fprintf(group->f, "\n");
+            ret = ENS_ERROR_FULL;
+            goto done;
         }
+        reserved = fixed + limited;
+    }
 
-        fprintf(group->f, "[%s]\n", now_buf);
-        for (i = 0; i < alist_size(group->config.to); i++) {
-            to = alist_get(group->config.to, i);
-            fprintf(group->f, "To: %s\n", to);
+    //a truncated body is copied, whatever it was going to be made from
+    if (limited < body_bytes) {
+        atomic_fetch_add_explicit(&group->stats.emails_truncated, 1, memory_order_relaxed);
+        key.truncated = true;
+        if (storage == ENS_EMAIL_OWNED) {
+            subject_len = strlen(source->subject);
         }
-        fprintf(group->f, "From: %s\n", group->config.from);
-        fprintf(group->f, "Subject: %s\n", email->subject);
-        fprintf(group->f, "%s\n", email->body);
-
-        ens_email_free(email);
+        storage = ENS_EMAIL_INLINE;
+        format = NULL;
+        body_len = limited;
     }
 
-    return ENS_ERROR_OK;
-}
+    //dropped and coalesced emails give their memory back right away, which an arena can't
+    if (len >= 0 && mode == ENS_GROUP_MODE_COLLECT && overflow != ENS_OVERFLOW_DROP_OLDEST && coalesce_max == 0) {
+        email = ens_email_init_epoch(group, subject_len, body_len);
+    }
+    if (len >= 0 && email == NULL) {
+        email = ens_email_init(subject_len, body_len);
+    }
+fail:
+    if (email == NULL) {
+        if (mode == ENS_GROUP_MODE_DROP) {
+            atomic_store(&group->pending, 0);
+            ens_drop_gate_clear(ens, id);
+        }
+        if (reserved > 0) {
+            ens_group_unreserve(group, reserved);
+        }
 
-static void
-ens_check_groups(ens_t *ens) {
-    ens_group_t *group;
-    unsigned int i;
-    time_t now;
+        if (len < 0) {
+            ret = ens_log(ens, ENS_ERROR_FORMAT, ENS_LOG_LEVEL_ERROR, "Failed to send email for group %d: Could not format body: %s", id, strerror(errno));
+        }
+        else {
+            ret = ens_log(ens, ENS_ERROR_MEMORY, ENS_LOG_LEVEL_FATAL, "Failed to send email for group %d: Out of memory", id);
+        }
+        goto done;
+    }
+    email->bytes = reserved;
 
-    pthread_rwlock_rdlock(&ens->groups_lock);
-    for (i = 0; i < alist_size(ens->groups); i++) {
-        group = alist_get(ens->groups, i);
+    //the email is remembered once it's certain to be sent
+    if (dedup != NULL) {
+        ens_dedup_add(dedup, generation, key.hash);
+    }
 
-        now = time(NULL);
+    switch (storage) {
+        case ENS_EMAIL_INLINE:
+            memcpy(email->subject, source->subject, subject_len + 1);
+            if (key.made != NULL && key.format == NULL) {
+                memcpy(email->body, key.made, body_len);
+                email->body[body_len] = '\0';
+            }
+            else if (source->storage == ENS_EMAIL_DEFERRED) {
+                vsnprintf(email->body, body_len + 1, source->body, *source->ap);
+            }
+            else if (source->body == NULL) {
+                p = email->body;
+                for (i = 0; i < source->iovcnt && p < email->body + body_len; i++) {
+                    limited = email->body + body_len - p;
+                    if (limited > source->iov[i].iov_len) {
+                        limited = source->iov[i].iov_len;
+                    }
+
+                    memcpy(p, source->iov[i].iov_base, limited);
+                    p += limited;
+                }
+                *p = '\0';
+            }
+            else {
+                memcpy(email->body, source->body, body_len);
+                email->body[body_len] = '\0';
+            }
 
-        pthread_mutex_lock(&group->emails_mutex);
-        if (now >= group->expires && queue_size(group->emails) > 0) {
-            if (group->f != NULL) {
-                ens_send_email_file(ens, group);
+            //an owned email only ends up here if it was truncated
+            if (source->storage == ENS_EMAIL_OWNED) {
+                ens_email_source_free(source);
+            }
+            break;
+        case ENS_EMAIL_OWNED:
+            email->subject = (char *)source->subject;
+            email->body = (char *)source->body;
+            email->free_function = source->free_function;
+            break;
+        case ENS_EMAIL_SHARED:
+            memcpy(email->subject, source->subject, subject_len + 1);
+            email->body = source->shared->body;
+            email->shared = source->shared;
+            atomic_fetch_add(&source->shared->refs, 1);
+            break;
+        case ENS_EMAIL_DEFERRED:
+            memcpy(email->subject, source->subject, subject_len + 1);
+            if (key.made != NULL) {
+                memcpy(email->body, key.made, body_len);
             }
             else {
-                ens_send_email(ens, group);
+                format_capture(format, email->body, *source->ap);
             }
+            email->format = format;
+            break;
+    }
+    email->storage = storage;
+    email->coalesced = NULL;
+    made = true;
 
-            ++group->stats.emails_sent;
-            group->expires = now + group->config.interval;
+    if (coalesce_max > 0) {
+        if (ens_coalesce_push(group, coalesce_max, email, &key, &pending)) {
+            email = NULL;
+        }
+        else {
+            //a repeat, or there's no room for it, so there's nothing to queue
+            ens_group_email_free(group, email);
+            email = NULL;
+            pending = 1;
         }
-        pthread_mutex_unlock(&group->emails_mutex);
     }
-    pthread_rwlock_unlock(&ens->groups_lock);
-}
+    else if (mode == ENS_GROUP_MODE_SAMPLE) {
+        if (ens_sample_push(group, email, &pending)) {
+            email = NULL;
+        }
+        else {
+            //without a sample every email is queued on its own
+            pending = atomic_fetch_add(&group->pending, 1);
+        }
+    }
+    else if (mode == ENS_GROUP_MODE_COLLECT && group->thread_batch > 0) {
+        //the batches from each thread are put back in order by timestamp
+        email->timestamp = ens_now_ns();
+
+        shard = ens_shard_get(group);
+        if (shard != NULL) {
+            pending = ens_shard_push(shard, email);
+            email = NULL;
+        }
+        else {
+            pending = atomic_fetch_add(&group->pending, 1);
+        }
+    }
+    else if (mode == ENS_GROUP_MODE_COLLECT) {
+        pending = atomic_fetch_add(&group->pending, 1);
+    }
 
-static void *
-ens_process(void *user_data) {
-    ens_t *ens;
+    if (email != NULL) {
+        queue_mpsc_push(group->emails, &email->link);
+        email = NULL;
+    }
 
-    ens = (ens_t *)user_data;
-    ens->running = true;
+    //the group goes from idle to pending, so the context's thread needs waking
+    if (pending == 0) {
+        *wake = true;
+    }
 
-    while (ens->running) {
-        ens_check_groups(ens);
-        usleep(1000 * 100);
+done:
+    //an email from the group's arena must be freed while the group is alive
+    if (email != NULL) {
+        ens_group_email_free(group, email);
+    }
+    else if (!made) {
+        ens_email_source_free(source);
     }
 
-    return NULL;
+    ens_email_key_free(&key);
+
+    return ret;
 }
 
-int
-ens_start(ens_t *ens) {
-    int ret = ENS_ERROR_OK;
+static int
+ens_group_wake(ens_t *ens, ens_group_t *group) {
+    bool success = true;
 
-    if (ens->running) {
-        return ENS_ERROR_ALREADY_RUNNING;
+    //a send through a handle can race with the group being unregistered
+    pthread_mutex_lock(&group->emails_mutex);
+    if (group->registered) {
+        success = ens_schedule_group(ens, group);
     }
+    pthread_mutex_unlock(&group->emails_mutex);
 
-    //start the context's thread
-    if (ret == ENS_ERROR_OK) {
-        if (pthread_create(&ens->thread, NULL, ens_process, ens) != 0) {
-            ret = ens_log(ens, ENS_ERROR_THREAD, ENS_LOG_LEVEL_FATAL, "Failed to start the thread: %s", strerror(errno));
-        }
+    if (!success) {
+        return ens_log(ens, ENS_ERROR_MEMORY, ENS_LOG_LEVEL_FATAL, "Failed to schedule group %d: Out of memory", group->id);
     }
 
-    return ret;
+    return ENS_ERROR_OK;
 }
 
 static int
-ens_stop_helper(ens_t *ens, bool join) {
+ens_group_send_source(ens_t *ens, ens_group_id_t id, const ens_email_source_t *source) {
+    int ret;
+    bool wake = false;
     ens_group_t *group;
-    unsigned int i;
 
-    if (!ens->running) {
-        return ENS_ERROR_NOT_RUNNING;
+    //a DROP group with an email waiting rejects the email right away
+    if (ens_drop_gate_armed(ens, id)) {
+        ens_email_source_free(source);
+        return ENS_ERROR_NOT_READY;
     }
 
-    ens->running = false;
+    pthread_rwlock_rdlock(&ens->groups_lock);
 
-    if (join) {
-        pthread_join(ens->thread, NULL);
+    group = ens_group_find(ens, id);
+    if (group == NULL) {
+        ens_email_source_free(source);
+        ret = ens_log(ens, ENS_ERROR_NOT_REGISTERED, ENS_LOG_LEVEL_ERROR, "Failed to send email for group %d: Not registered", id);
+        goto done;
     }
 
-    //if any groups are writing to a file, close them now
-    for (i = 0; i < alist_size(ens->groups); i++) {
-        group = alist_get(ens->groups, i);
+    ret = ens_group_queue_source(ens, group, source, &wake);
+    if (wake) {
+        ret = ens_group_wake(ens, group);
+    }
 
-        if (group->f != NULL) {
-            fclose(group->f);
-            group->f = NULL;
+done:
+    pthread_rwlock_unlock(&ens->groups_lock);
+
+    return ret;
+}
+
+//looks up each run of messages for the same group once, and returns how many were queued
+static size_t
+ens_send_messages(ens_t *ens, const ens_group_id_t *id, const ens_message_t *msgs, size_t n, int *results) {
+    size_t i, run, queued = 0;
+    ens_group_id_t run_id;
+    ens_group_t *group;
+    bool wake;
+    int ret;
+    ens_email_source_t source = {
+        .storage = ENS_EMAIL_INLINE,
+    };
+
+    pthread_rwlock_rdlock(&ens->groups_lock);
+
+    for (run = 0; run < n; run = i) {
+        run_id = id != NULL ? *id : msgs[run].id;
+        group = ens_group_find(ens, run_id);
+        wake = false;
+
+        for (i = run; i < n && (id != NULL || msgs[i].id == run_id); i++) {
+            if (group == NULL) {
+                ret = ENS_ERROR_NOT_REGISTERED;
+            }
+            else if (ens_drop_gate_armed(ens, run_id)) {
+                ret = ENS_ERROR_NOT_READY;
+            }
+            else {
+                source.subject = msgs[i].subject;
+                source.body = msgs[i].body;
+                ret = ens_group_queue_source(ens, group, &source, &wake);
+            }
+
+            if (ret == ENS_ERROR_OK) {
+                ++queued;
+            }
+            if (results != NULL) {
+                results[i] = ret;
+            }
+        }
+
+        if (group == NULL) {
+            ens_log(ens, ENS_ERROR_NOT_REGISTERED, ENS_LOG_LEVEL_ERROR, "Failed to send %zu emails for group %d: Not registered", i - run, run_id);
+        }
+
+        //the emails are queued even if the group can't be scheduled, which is logged
+        if (wake) {
+            ens_group_wake(ens, group);
         }
     }
 
-    return ENS_ERROR_OK;
+    pthread_rwlock_unlock(&ens->groups_lock);
+
+    return queued;
 }
 
 int
-ens_stop(ens_t *ens) {
-    return ens_stop_helper(ens, false);
+ens_group_send(ens_t *ens, ens_group_id_t id, const char *subject, const char *body) {
+    ens_email_source_t source = {
+        .subject = subject,
+        .body = body,
+        .storage = ENS_EMAIL_INLINE,
+    };
+
+    return ens_group_send_source(ens, id, &source);
 }
 
 int
-ens_stop_join(ens_t *ens) {
-    return ens_stop_helper(ens, true);
+ens_group_send_owned(ens_t *ens, ens_group_id_t id, char *subject, char *body, ens_free_function_t free_fn) {
+    ens_email_source_t source = {
+        .subject = subject,
+        .body = body,
+        .storage = ENS_EMAIL_OWNED,
+        .free_function = free_fn != NULL ? free_fn : free,
+    };
+
+    return ens_group_send_source(ens, id, &source);
 }
 
-static ens_group_t *
-ens_group_find(ens_t *ens, ens_group_id_t id) {
-    ens_group_t *group;
-    unsigned int i;
+int
+ens_group_send_shared(ens_t *ens, ens_group_id_t id, const char *subject, ens_body_t *body) {
+    ens_email_source_t source = {
+        .subject = subject,
+        .storage = ENS_EMAIL_SHARED,
+        .shared = body,
+    };
+
+    return ens_group_send_source(ens, id, &source);
+}
 
-    for (i = 0; i < alist_size(ens->groups); i++) {
-        group = alist_get(ens->groups, i);
+ens_body_t *
+ens_body_init(char *body, ens_free_function_t free_fn) {
+    ens_body_t *shared;
 
-        if (group->id == id) {
-            return group;
-        }
+    if (free_fn == NULL) {
+        free_fn = free;
     }
 
-    return NULL;
-}
+    shared = malloc(sizeof(*shared));
+    if (shared == NULL) {
+        free_fn(body);
+        return NULL;
+    }
 
-int
-ens_group_register(ens_t *ens, ens_group_id_t id) {
-    int ret = ENS_ERROR_OK;
-    ens_group_t *group;
+    atomic_init(&shared->refs, 1);
+    shared->body = body;
+    shared->free_function = free_fn;
 
-    pthread_rwlock_wrlock(&ens->groups_lock);
-    group = ens_group_find(ens, id);
-    if (group != NULL) {
-        ret = ens_log(ens, ENS_ERROR_ALREADY_REGISTERED, ENS_LOG_LEVEL_ERROR, "Failed to register group %d Already registered", id);
-        goto done;
-    }
+    return shared;
+}
 
-    group = ens_group_init(ens);
-    if (group == NULL) {
-        ret = ens_log(ens, ENS_ERROR_MEMORY, ENS_LOG_LEVEL_FATAL, "Failed to register group %d: Out of memory", id);
-        goto done;
+void
+ens_body_unref(ens_body_t *body) {
+    if (body == NULL) {
+        return;
     }
 
-    if (!alist_add(ens->groups, group)) {
-        ens_group_free(group);
-        ret = ens_log(ens, ENS_ERROR_MEMORY, ENS_LOG_LEVEL_FATAL, "Failed to register group %d: Out of memory", id);
-        goto done;
+    if (atomic_fetch_sub(&body->refs, 1) == 1) {
+        body->free_function(body->body);
+        free(body);
     }
+}
 
-    group->id = id;
+int
+ens_group_sendf(ens_t *ens, ens_group_id_t id, const char *subject, const char *fmt, ...) {
+    ens_email_source_t source = {
+        .subject = subject,
+        .body = fmt,
+        .storage = ENS_EMAIL_DEFERRED,
+    };
+    va_list ap;
+    int ret;
 
-done:
-    pthread_rwlock_unlock(&ens->groups_lock);
+    va_start(ap, fmt);
+    source.ap = &ap;
+    ret = ens_group_send_source(ens, id, &source);
+    va_end(ap);
 
     return ret;
 }
 
-int
-ens_group_unregister(ens_t *ens, ens_group_id_t id) {
-    bool found = false;
+ens_group_handle_t *
+ens_group_acquire(ens_t *ens, ens_group_id_t id) {
+    ens_group_handle_t *handle = NULL;
     ens_group_t *group;
-    unsigned int i;
 
-    pthread_rwlock_wrlock(&ens->groups_lock);
-    for (i = 0; i < alist_size(ens->groups); i++) {
-        group = alist_get(ens->groups, i);
+    pthread_rwlock_rdlock(&ens->groups_lock);
 
-        if (group->id == id) {
-            alist_remove(ens->groups, i);
-            ens_group_free(group);
-            found = true;
-            break;
-        }
+    group = ens_group_find(ens, id);
+    if (group == NULL) {
+        ens_log(ens, ENS_ERROR_NOT_REGISTERED, ENS_LOG_LEVEL_ERROR, "Failed to acquire group %d: Not registered", id);
+        goto done;
     }
-    pthread_rwlock_unlock(&ens->groups_lock);
 
-    if (!found) {
-        return ens_log(ens, ENS_ERROR_NOT_REGISTERED, ENS_LOG_LEVEL_ERROR, "Failed to unregister group %d: Not registered", id);
+    handle = malloc(sizeof(*handle));
+    if (handle == NULL) {
+        ens_log(ens, ENS_ERROR_MEMORY, ENS_LOG_LEVEL_FATAL, "Failed to acquire group %d: Out of memory", id);
+        goto done;
     }
 
-    return ENS_ERROR_OK;
-}
+    handle->ens = ens;
+    handle->group = group;
+    ens_group_ref(group);
 
-int
-ens_group_send(ens_t *ens, ens_group_id_t id, const char *subject, const char *body) {
-    int ret = ENS_ERROR_OK;
-    bool success;
-    ens_group_t *group;
-    ens_email_t *email;
+done:
+    pthread_rwlock_unlock(&ens->groups_lock);
 
-    email = ens_email_init();
-    if (email == NULL) {
-        ret = ens_log(ens, ENS_ERROR_MEMORY, ENS_LOG_LEVEL_FATAL, "Failed to send email for group %d: Out of memory", id);
-        return ret;
+    return handle;
+}
+
+void
+ens_group_release(ens_group_handle_t *handle) {
+    if (handle == NULL) {
+        return;
     }
 
-    email->subject = strdup(subject);
-    email->body = strdup(body);
-    if (email->subject == NULL || email->body == NULL) {
-        ret = ens_log(ens, ENS_ERROR_MEMORY, ENS_LOG_LEVEL_FATAL, "Failed to send email for group %d: Out of memory", id);
-        goto done;
+    ens_group_unref(handle->group);
+    free(handle);
+}
+
+//the handle's reference keeps the group alive, so the groups_lock isn't needed
+static int
+ens_group_handle_send_source(ens_group_handle_t *handle, const ens_email_source_t *source) {
+    ens_t *ens = handle->ens;
+    ens_group_t *group = handle->group;
+    bool wake = false;
+    int ret;
+
+    if (ens_drop_gate_armed(ens, group->id)) {
+        ens_email_source_free(source);
+        return ENS_ERROR_NOT_READY;
     }
 
-    pthread_rwlock_rdlock(&ens->groups_lock);
-    group = ens_group_find(ens, id);
-    if (group == NULL) {
-        ret = ens_log(ens, ENS_ERROR_NOT_REGISTERED, ENS_LOG_LEVEL_ERROR, "Failed to send email for group %d: Not registered", id);
-        goto done;
+    if (!group->registered) {
+        ens_email_source_free(source);
+        return ens_log(ens, ENS_ERROR_NOT_REGISTERED, ENS_LOG_LEVEL_ERROR, "Failed to send email for group %d: Not registered", group->id);
     }
 
-    ++group->stats.emails_total;
-
-    if (group->config.mode == ENS_GROUP_MODE_DROP && queue_size(group->emails) > 0) {
-        ret = ENS_ERROR_NOT_READY;
-        goto done;
-    }
+    ret = ens_group_queue_source(ens, group, source, &wake);
 
-    pthread_mutex_lock(&group->emails_mutex);
-    success = queue_push(group->emails, email);
-    pthread_mutex_unlock(&group->emails_mutex);
+    //unregistering can have raced with the push, either this sees it or it sees the email
+    if (!group->registered) {
+        //the gate may have been cleared before this armed it
+        ens_drop_gate_clear(ens, group->id);
+        ens_group_discard(ens, group);
 
-    if (!success) {
-        ret = ens_log(ens, ENS_ERROR_MEMORY, ENS_LOG_LEVEL_FATAL, "Failed to send email for group %d: Out of memory", id);
-        goto done;
+        if (ret != ENS_ERROR_OK) {
+            return ret;
+        }
+        return ens_log(ens, ENS_ERROR_NOT_REGISTERED, ENS_LOG_LEVEL_ERROR, "Failed to send email for group %d: Not registered", group->id);
     }
 
-done:
-    pthread_rwlock_unlock(&ens->groups_lock);
-    if (ret != ENS_ERROR_OK) {
-        ens_email_free(email);
+    if (wake) {
+        ret = ens_group_wake(ens, group);
     }
 
     return ret;
 }
 
 int
-ens_group_sendf(ens_t *ens, ens_group_id_t id, const char *subject, const char *fmt, ...) {
+ens_group_send_h(ens_group_handle_t *handle, const char *subject, const char *body) {
+    ens_email_source_t source = {
+        .subject = subject,
+        .body = body,
+        .storage = ENS_EMAIL_INLINE,
+    };
+
+    return ens_group_handle_send_source(handle, &source);
+}
+
+int
+ens_group_sendf_h(ens_group_handle_t *handle, const char *subject, const char *fmt, ...) {
+    ens_email_source_t source = {
+        .subject = subject,
+        .body = fmt,
+        .storage = ENS_EMAIL_DEFERRED,
+    };
     va_list ap;
-    int ret, count;
-    char *body;
+    int ret;
 
     va_start(ap, fmt);
-    count = vasprintf(&body, fmt, ap);
+    source.ap = &ap;
+    ret = ens_group_handle_send_source(handle, &source);
     va_end(ap);
 
-    if (count == -1) {
-        return ens_log(ens, ENS_ERROR_MEMORY, ENS_LOG_LEVEL_FATAL, "Failed to send email for group %d: Out of memory", id);
-    }
+    return ret;
+}
 
-    ret = ens_group_send(ens, id, subject, body);
-    free(body);
+size_t
+ens_group_send_batch(ens_t *ens, ens_group_id_t id, const ens_message_t *msgs, size_t n, int *results) {
+    return ens_send_messages(ens, &id, msgs, n, results);
+}
 
-    return ret;
+size_t
+ens_send_batch(ens_t *ens, const ens_message_t *msgs, size_t n, int *results) {
+    return ens_send_messages(ens, NULL, msgs, n, results);
+}
+
+int
+ens_group_sendv(ens_t *ens, ens_group_id_t id, const char *subject, const struct iovec *iov, int iovcnt) {
+    ens_email_source_t source = {
+        .subject = subject,
+        .storage = ENS_EMAIL_INLINE,
+        .iov = iov,
+        .iovcnt = iovcnt,
+    };
+
+    return ens_group_send_source(ens, id, &source);
 }
 
 static int
@@ -758,6 +4266,7 @@ ens_set_option_mode(ens_t *ens, va_list ap) {
     switch (mode) {
         case ENS_GROUP_MODE_DROP:
         case ENS_GROUP_MODE_COLLECT:
+        case ENS_GROUP_MODE_SAMPLE:
             ens->config.mode = mode;
             break;
         default:
@@ -864,6 +4373,124 @@ ens_set_option_ca_path(ens_t *ens, va_list ap) {
     return ENS_ERROR_OK;
 }
 
+static int
+ens_set_option_worker_threads(ens_t *ens, va_list ap) {
+    int worker_threads;
+
+    worker_threads = va_arg(ap, int);
+
+    if (ens->running) {
+        return ens_log(ens, ENS_ERROR_ALREADY_RUNNING, ENS_LOG_LEVEL_ERROR, "Failed to set option ENS_OPTION_WORKER_THREADS: The context is running");
+    }
+    if (worker_threads < 0) {
+        return ens_log(ens, ENS_ERROR_UNKNOWN_OPTION_VALUE, ENS_LOG_LEVEL_ERROR, "Failed to set option ENS_OPTION_WORKER_THREADS: Value must not be negative");
+    }
+
+    ens->worker_threads = worker_threads;
+
+    return ENS_ERROR_OK;
+}
+
+static int
+ens_set_option_async(ens_t *ens, va_list ap) {
+    int async;
+
+    async = va_arg(ap, int);
+
+    if (ens->running) {
+        return ens_log(ens, ENS_ERROR_ALREADY_RUNNING, ENS_LOG_LEVEL_ERROR, "Failed to set option ENS_OPTION_ASYNC: The context is running");
+    }
+
+    ens->async = async != 0;
+
+    return ENS_ERROR_OK;
+}
+
+static int
+ens_set_option_connection_idle_timeout(ens_t *ens, va_list ap) {
+    int timeout;
+
+    timeout = va_arg(ap, int);
+
+    if (timeout < 0) {
+        return ens_log(ens, ENS_ERROR_UNKNOWN_OPTION_VALUE, ENS_LOG_LEVEL_ERROR, "Failed to set option ENS_OPTION_CONNECTION_IDLE_TIMEOUT: Value must not be negative");
+    }
+
+    pthread_mutex_lock(&ens->pool_mutex);
+    ens->pool_idle_timeout = timeout;
+    pthread_mutex_unlock(&ens->pool_mutex);
+
+    return ENS_ERROR_OK;
+}
+
+static int
+ens_set_option_max_host_connections(ens_t *ens, va_list ap) {
+    int max;
+
+    max = va_arg(ap, int);
+
+    if (ens->running) {
+        return ens_log(ens, ENS_ERROR_ALREADY_RUNNING, ENS_LOG_LEVEL_ERROR, "Failed to set option ENS_OPTION_MAX_HOST_CONNECTIONS: The context is running");
+    }
+    if (max < 0) {
+        return ens_log(ens, ENS_ERROR_UNKNOWN_OPTION_VALUE, ENS_LOG_LEVEL_ERROR, "Failed to set option ENS_OPTION_MAX_HOST_CONNECTIONS: Value must not be negative");
+    }
+
+    ens->max_host_connections = max;
+    pool_set_max_per_key(ens->pool, max);
+
+    return ENS_ERROR_OK;
+}
+
+static int
+ens_set_option_tls_sessions_file(ens_t *ens, va_list ap) {
+    const char *path;
+
+    path = va_arg(ap, const char *);
+
+    if (ens->running) {
+        return ens_log(ens, ENS_ERROR_ALREADY_RUNNING, ENS_LOG_LEVEL_ERROR, "Failed to set option ENS_OPTION_TLS_SESSIONS_FILE: The context is running");
+    }
+    if (path == NULL) {
+        path = "";
+    }
+    if (strlen(path) > ENS_PATH_MAX_LEN) {
+        return ens_log(ens, ENS_ERROR_TOO_LONG, ENS_LOG_LEVEL_ERROR, "Failed to set option ENS_OPTION_TLS_SESSIONS_FILE: Value must not exceed %d characters", ENS_PATH_MAX_LEN);
+    }
+
+    strcpy(ens->tls_sessions_path, path);
+
+    return ENS_ERROR_OK;
+}
+
+static int
+ens_set_option_max_emails(ens_t *ens, va_list ap) {
+    int max;
+
+    max = va_arg(ap, int);
+    if (max < 0) {
+        return ens_log(ens, ENS_ERROR_UNKNOWN_OPTION_VALUE, ENS_LOG_LEVEL_ERROR, "Failed to set option ENS_OPTION_MAX_EMAILS: Value must not be negative");
+    }
+
+    atomic_store(&ens->queued_max.emails, max);
+
+    return ENS_ERROR_OK;
+}
+
+static int
+ens_set_option_max_bytes(ens_t *ens, va_list ap) {
+    int max;
+
+    max = va_arg(ap, int);
+    if (max < 0) {
+        return ens_log(ens, ENS_ERROR_UNKNOWN_OPTION_VALUE, ENS_LOG_LEVEL_ERROR, "Failed to set option ENS_OPTION_MAX_BYTES: Value must not be negative");
+    }
+
+    atomic_store(&ens->queued_max.bytes, max);
+
+    return ENS_ERROR_OK;
+}
+
 static int
 ens_set_option_log_function(ens_t *ens, va_list ap) {
     ens->log_function = va_arg(ap, ens_log_function_t);
@@ -926,6 +4553,27 @@ ens_set_option(ens_t *ens, ens_option_t option, ...) {
         case ENS_OPTION_LOG_USER_DATA:
             ret = ens_set_option_log_user_data(ens, ap);
             break;
+        case ENS_OPTION_WORKER_THREADS:
+            ret = ens_set_option_worker_threads(ens, ap);
+            break;
+        case ENS_OPTION_ASYNC:
+            ret = ens_set_option_async(ens, ap);
+            break;
+        case ENS_OPTION_CONNECTION_IDLE_TIMEOUT:
+            ret = ens_set_option_connection_idle_timeout(ens, ap);
+            break;
+        case ENS_OPTION_MAX_HOST_CONNECTIONS:
+            ret = ens_set_option_max_host_connections(ens, ap);
+            break;
+        case ENS_OPTION_TLS_SESSIONS_FILE:
+            ret = ens_set_option_tls_sessions_file(ens, ap);
+            break;
+        case ENS_OPTION_MAX_EMAILS:
+            ret = ens_set_option_max_emails(ens, ap);
+            break;
+        case ENS_OPTION_MAX_BYTES:
+            ret = ens_set_option_max_bytes(ens, ap);
+            break;
         default:
             ret = ens_log(ens, ENS_ERROR_UNKNOWN_OPTION, ENS_LOG_LEVEL_ERROR, "Failed to set option: Option %d not found", option);
             break;
@@ -936,6 +4584,36 @@ ens_set_option(ens_t *ens, ens_option_t option, ...) {
     return ret;
 }
 
+int
+ens_get_info(ens_t *ens, ens_info_t info, ...) {
+    int ret = ENS_ERROR_OK;
+    va_list ap;
+
+    va_start(ap, info);
+
+    switch (info) {
+        case ENS_INFO_CONNECTION_HITS:
+            *va_arg(ap, uint64_t *) = atomic_load(&ens->connection_hits);
+            break;
+        case ENS_INFO_CONNECTION_MISSES:
+            *va_arg(ap, uint64_t *) = atomic_load(&ens->connection_misses);
+            break;
+        case ENS_INFO_QUEUED_EMAILS:
+            *va_arg(ap, uint64_t *) = atomic_load(&ens->queued.emails);
+            break;
+        case ENS_INFO_QUEUED_BYTES:
+            *va_arg(ap, uint64_t *) = atomic_load(&ens->queued.bytes);
+            break;
+        default:
+            ret = ens_log(ens, ENS_ERROR_UNKNOWN_OPTION, ENS_LOG_LEVEL_ERROR, "Failed to get info: Info %d not found", info);
+            break;
+    }
+
+    va_end(ap);
+
+    return ret;
+}
+
 static int
 ens_group_set_option_mode(ens_t *ens, ens_group_t *group, va_list ap) {
     int mode, ret = ENS_ERROR_OK;
@@ -945,7 +4623,9 @@ ens_group_set_option_mode(ens_t *ens, ens_group_t *group, va_list ap) {
     switch (mode) {
         case ENS_GROUP_MODE_DROP:
         case ENS_GROUP_MODE_COLLECT:
+        case ENS_GROUP_MODE_SAMPLE:
             group->config.mode = mode;
+            ens_drop_gate_clear(ens, group->id);
             break;
         default:
             ret = ens_log(ens, ENS_ERROR_UNKNOWN_OPTION_VALUE, ENS_LOG_LEVEL_ERROR, "Failed to set option ENS_GROUP_OPTION_MODE for group %d: Unknown value", group->id);
@@ -982,6 +4662,7 @@ ens_group_set_option_from(ens_t *ens, ens_group_t *group, va_list ap) {
     }
 
     strcpy(group->config.from, from);
+    ens_envelope_invalidate(group);
 
     return ENS_ERROR_OK;
 }
@@ -1002,6 +4683,7 @@ ens_group_set_option_to(ens_t *ens, ens_group_t *group, va_list ap) {
         free(to_copy);
         return ens_log(ens, ENS_ERROR_MEMORY, ENS_LOG_LEVEL_FATAL, "Failed to set option ENS_GROUP_OPTION_TO for group %d: Out of memory", group->id);
     }
+    ens_envelope_invalidate(group);
 
     return ENS_ERROR_OK;
 }
@@ -1066,6 +4748,178 @@ ens_group_set_option_ca_path(ens_t *ens, ens_group_t *group, va_list ap) {
     return ENS_ERROR_OK;
 }
 
+static int
+ens_group_set_option_thread_batch(ens_t *ens, ens_group_t *group, va_list ap) {
+    int thread_batch;
+
+    thread_batch = va_arg(ap, int);
+
+    if (thread_batch < 0) {
+        return ens_log(ens, ENS_ERROR_UNKNOWN_OPTION_VALUE, ENS_LOG_LEVEL_ERROR, "Failed to set option ENS_GROUP_OPTION_THREAD_BATCH for group %d: Value must not be negative", group->id);
+    }
+
+    group->thread_batch = thread_batch;
+
+    return ENS_ERROR_OK;
+}
+
+static int
+ens_group_set_option_deferred_format(ens_t *ens, ens_group_t *group, va_list ap) {
+    group->deferred_format = va_arg(ap, int) != 0;
+
+    return ENS_ERROR_OK;
+}
+
+//the old filter is kept until the group is freed since sends may still read it
+static int
+ens_group_dedup_reset(ens_t *ens, ens_group_t *group) {
+    ens_dedup_t *dedup = NULL, *old;
+
+    if (group->dedup_window > 0) {
+        dedup = ens_dedup_init(group->dedup_window, group->dedup_capacity, group->dedup_error_rate);
+        if (dedup == NULL) {
+            return ens_log(ens, ENS_ERROR_MEMORY, ENS_LOG_LEVEL_FATAL, "Failed to set duplicate filter for group %d: Out of memory", group->id);
+        }
+    }
+
+    old = atomic_exchange_explicit(&group->dedup, dedup, memory_order_acq_rel);
+    if (old != NULL) {
+        old->retired = group->dedup_retired;
+        group->dedup_retired = old;
+    }
+
+    return ENS_ERROR_OK;
+}
+
+static int
+ens_group_set_option_coalesce(ens_t *ens, ens_group_t *group, va_list ap) {
+    int coalesce;
+
+    coalesce = va_arg(ap, int);
+    if (coalesce < 0 || coalesce > ENS_COALESCE_MAX) {
+        return ens_log(ens, ENS_ERROR_UNKNOWN_OPTION_VALUE, ENS_LOG_LEVEL_ERROR, "Failed to set option ENS_GROUP_OPTION_COALESCE for group %d: Value must be between 0 and %d", group->id, ENS_COALESCE_MAX);
+    }
+
+    group->coalesce_max = coalesce;
+
+    return ENS_ERROR_OK;
+}
+
+static int
+ens_group_set_option_sample_size(ens_t *ens, ens_group_t *group, va_list ap) {
+    int size;
+
+    size = va_arg(ap, int);
+    if (size < 1 || size > ENS_SAMPLE_SIZE_MAX) {
+        return ens_log(ens, ENS_ERROR_UNKNOWN_OPTION_VALUE, ENS_LOG_LEVEL_ERROR, "Failed to set option ENS_GROUP_OPTION_SAMPLE_SIZE for group %d: Value must be between 1 and %d", group->id, ENS_SAMPLE_SIZE_MAX);
+    }
+
+    group->sample_size = size;
+
+    return ENS_ERROR_OK;
+}
+
+static int
+ens_group_set_option_sample_edges(ens_t *ens, ens_group_t *group, va_list ap) {
+    int edges;
+
+    edges = va_arg(ap, int);
+    if (edges < 0 || edges > ENS_SAMPLE_SIZE_MAX) {
+        return ens_log(ens, ENS_ERROR_UNKNOWN_OPTION_VALUE, ENS_LOG_LEVEL_ERROR, "Failed to set option ENS_GROUP_OPTION_SAMPLE_EDGES for group %d: Value must be between 0 and %d", group->id, ENS_SAMPLE_SIZE_MAX);
+    }
+
+    group->sample_edges = edges;
+
+    return ENS_ERROR_OK;
+}
+
+static int
+ens_group_set_option_duplicate_window(ens_t *ens, ens_group_t *group, va_list ap) {
+    int window;
+
+    window = va_arg(ap, int);
+    if (window < 0) {
+        return ens_log(ens, ENS_ERROR_UNKNOWN_OPTION_VALUE, ENS_LOG_LEVEL_ERROR, "Failed to set option ENS_GROUP_OPTION_DUPLICATE_WINDOW for group %d: Value must not be negative", group->id);
+    }
+
+    group->dedup_window = window;
+
+    return ens_group_dedup_reset(ens, group);
+}
+
+static int
+ens_group_set_option_duplicate_capacity(ens_t *ens, ens_group_t *group, va_list ap) {
+    int capacity;
+
+    capacity = va_arg(ap, int);
+    if (capacity < 1 || capacity > ENS_DEDUP_CAPACITY_MAX) {
+        return ens_log(ens, ENS_ERROR_UNKNOWN_OPTION_VALUE, ENS_LOG_LEVEL_ERROR, "Failed to set option ENS_GROUP_OPTION_DUPLICATE_CAPACITY for group %d: Value must be between 1 and %d", group->id, ENS_DEDUP_CAPACITY_MAX);
+    }
+
+    group->dedup_capacity = capacity;
+
+    return ens_group_dedup_reset(ens, group);
+}
+
+static int
+ens_group_set_option_duplicate_error_rate(ens_t *ens, ens_group_t *group, va_list ap) {
+    int error_rate;
+
+    error_rate = va_arg(ap, int);
+    if (error_rate < 1 || error_rate > ENS_DEDUP_ERROR_RATE_MAX) {
+        return ens_log(ens, ENS_ERROR_UNKNOWN_OPTION_VALUE, ENS_LOG_LEVEL_ERROR, "Failed to set option ENS_GROUP_OPTION_DUPLICATE_ERROR_RATE for group %d: Value must be between 1 and %d", group->id, ENS_DEDUP_ERROR_RATE_MAX);
+    }
+
+    group->dedup_error_rate = error_rate;
+
+    return ens_group_dedup_reset(ens, group);
+}
+
+static int
+ens_group_set_option_max_emails(ens_t *ens, ens_group_t *group, va_list ap) {
+    int max;
+
+    max = va_arg(ap, int);
+    if (max < 0) {
+        return ens_log(ens, ENS_ERROR_UNKNOWN_OPTION_VALUE, ENS_LOG_LEVEL_ERROR, "Failed to set option ENS_GROUP_OPTION_MAX_EMAILS for group %d: Value must not be negative", group->id);
+    }
+
+    atomic_store(&group->queued_max.emails, max);
+
+    return ENS_ERROR_OK;
+}
+
+static int
+ens_group_set_option_max_bytes(ens_t *ens, ens_group_t *group, va_list ap) {
+    int max;
+
+    max = va_arg(ap, int);
+    if (max < 0) {
+        return ens_log(ens, ENS_ERROR_UNKNOWN_OPTION_VALUE, ENS_LOG_LEVEL_ERROR, "Failed to set option ENS_GROUP_OPTION_MAX_BYTES for group %d: Value must not be negative", group->id);
+    }
+
+    atomic_store(&group->queued_max.bytes, max);
+
+    return ENS_ERROR_OK;
+}
+
+static int
+ens_group_set_option_overflow(ens_t *ens, ens_group_t *group, va_list ap) {
+    int overflow;
+
+    overflow = va_arg(ap, int);
+
+    switch (overflow) {
+        case ENS_OVERFLOW_DROP_NEWEST:
+        case ENS_OVERFLOW_DROP_OLDEST:
+        case ENS_OVERFLOW_TRUNCATE:
+            atomic_store(&group->overflow, overflow);
+            return ENS_ERROR_OK;
+        default:
+            return ens_log(ens, ENS_ERROR_UNKNOWN_OPTION_VALUE, ENS_LOG_LEVEL_ERROR, "Failed to set option ENS_GROUP_OPTION_OVERFLOW for group %d: Unknown value", group->id);
+    }
+}
+
 int
 ens_group_set_option(ens_t *ens, ens_group_id_t id, ens_group_option_t option, ...) {
     int ret = ENS_ERROR_OK;
@@ -1081,6 +4935,8 @@ ens_group_set_option(ens_t *ens, ens_group_id_t id, ens_group_option_t option, .
         goto done;
     }
 
+    //the context's thread copies the configuration under the same lock
+    pthread_mutex_lock(&group->emails_mutex);
     switch (option) {
         case ENS_GROUP_OPTION_MODE:
             ret = ens_group_set_option_mode(ens, group, ap);
@@ -1109,10 +4965,84 @@ ens_group_set_option(ens_t *ens, ens_group_id_t id, ens_group_option_t option, .
         case ENS_GROUP_OPTION_CA_PATH:
             ret = ens_group_set_option_ca_path(ens, group, ap);
             break;
+        case ENS_GROUP_OPTION_THREAD_BATCH:
+            ret = ens_group_set_option_thread_batch(ens, group, ap);
+            break;
+        case ENS_GROUP_OPTION_DEFERRED_FORMAT:
+            ret = ens_group_set_option_deferred_format(ens, group, ap);
+            break;
+        case ENS_GROUP_OPTION_COALESCE:
+            ret = ens_group_set_option_coalesce(ens, group, ap);
+            break;
+        case ENS_GROUP_OPTION_DUPLICATE_WINDOW:
+            ret = ens_group_set_option_duplicate_window(ens, group, ap);
+            break;
+        case ENS_GROUP_OPTION_DUPLICATE_CAPACITY:
+            ret = ens_group_set_option_duplicate_capacity(ens, group, ap);
+            break;
+        case ENS_GROUP_OPTION_DUPLICATE_ERROR_RATE:
+            ret = ens_group_set_option_duplicate_error_rate(ens, group, ap);
+            break;
+        case ENS_GROUP_OPTION_MAX_EMAILS:
+            ret = ens_group_set_option_max_emails(ens, group, ap);
+            break;
+        case ENS_GROUP_OPTION_MAX_BYTES:
+            ret = ens_group_set_option_max_bytes(ens, group, ap);
+            break;
+        case ENS_GROUP_OPTION_OVERFLOW:
+            ret = ens_group_set_option_overflow(ens, group, ap);
+            break;
+        case ENS_GROUP_OPTION_SAMPLE_SIZE:
+            ret = ens_group_set_option_sample_size(ens, group, ap);
+            break;
+        case ENS_GROUP_OPTION_SAMPLE_EDGES:
+            ret = ens_group_set_option_sample_edges(ens, group, ap);
+            break;
         default:
             ret = ens_log(ens, ENS_ERROR_UNKNOWN_OPTION, ENS_LOG_LEVEL_ERROR, "Failed to set option for group %d: Option %d not found", id, option);
             break;
     }
+    pthread_mutex_unlock(&group->emails_mutex);
+
+done:
+    pthread_rwlock_unlock(&ens->groups_lock);
+    va_end(ap);
+
+    return ret;
+}
+
+int
+ens_group_get_info(ens_t *ens, ens_group_id_t id, ens_group_info_t info, ...) {
+    int ret = ENS_ERROR_OK;
+    ens_group_t *group;
+    va_list ap;
+
+    va_start(ap, info);
+    pthread_rwlock_rdlock(&ens->groups_lock);
+
+    group = ens_group_find(ens, id);
+    if (group == NULL) {
+        ret = ens_log(ens, ENS_ERROR_NOT_REGISTERED, ENS_LOG_LEVEL_ERROR, "Failed to get info for group %d: Not registered", id);
+        goto done;
+    }
+
+    switch (info) {
+        case ENS_GROUP_INFO_QUEUED_EMAILS:
+            *va_arg(ap, uint64_t *) = atomic_load(&group->queued.emails);
+            break;
+        case ENS_GROUP_INFO_QUEUED_BYTES:
+            *va_arg(ap, uint64_t *) = atomic_load(&group->queued.bytes);
+            break;
+        case ENS_GROUP_INFO_EMAILS_DROPPED:
+            *va_arg(ap, uint64_t *) = atomic_load(&group->stats.emails_dropped);
+            break;
+        case ENS_GROUP_INFO_EMAILS_TRUNCATED:
+            *va_arg(ap, uint64_t *) = atomic_load(&group->stats.emails_truncated);
+            break;
+        default:
+            ret = ens_log(ens, ENS_ERROR_UNKNOWN_OPTION, ENS_LOG_LEVEL_ERROR, "Failed to get info for group %d: Info %d not found", id, info);
+            break;
+    }
 
 done:
     pthread_rwlock_unlock(&ens->groups_lock);
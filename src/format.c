@@ -0,0 +1,482 @@
+/**
+ * @file format.c
+ */
+
+#include <printf.h>
+#include <stdlib.h>
+#include <string.h>
+#include "format.h"
+
+#define FORMAT_NONE (-1) //!< The segment has no conversion.
+#define FORMAT_STAR (-2) //!< The precision is passed as an argument.
+
+/**
+ * @brief Some literal text and at most one conversion.
+ */
+typedef struct {
+    char *spec;             //!< The segment as its own format string.
+    int type;               //!< The type of the converted value, or FORMAT_NONE.
+    unsigned int stars;     //!< The number of '*' widths and precisions that come before the value.
+    int precision;          //!< The precision, FORMAT_NONE if there isn't one, or FORMAT_STAR if it's the last star.
+} format_segment_t;
+
+/**
+ * @brief The parsed format.
+ */
+struct format_t {
+    char *fmt;                  //!< A copy of the format string.
+    format_segment_t *segments; //!< The segments, in order.
+    unsigned int count;         //!< The number of segments.
+    char *specs;                //!< The storage for every segment's spec.
+    bool deferrable;            //!< Whether the arguments can be captured.
+};
+
+/**
+ * Returns whether a value of the type can be captured. Wide characters and
+ * pointers to store into can't.
+ */
+static bool
+format_type_supported(int type) {
+    if (type & PA_FLAG_PTR) {
+        return false;
+    }
+
+    switch (type & ~PA_FLAG_MASK) {
+        case PA_INT:
+        case PA_CHAR:
+        case PA_STRING:
+        case PA_POINTER:
+        case PA_FLOAT:
+        case PA_DOUBLE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * Splits the format string into segments that end right after each
+ * conversion. Returns <tt>false</tt> if the format can't be deferred or there
+ * isn't enough memory.
+ */
+static bool
+format_parse(format_t *format, const int *types, size_t args) {
+    const char *p, *start;
+    format_segment_t *segment;
+    size_t len, arg = 0;
+    char *spec;
+
+    len = strlen(format->fmt);
+
+    //there's never more than one segment for each character
+    format->segments = malloc(sizeof(*format->segments) * (len + 1));
+    format->specs = malloc(len * 2 + 2);
+    if (format->segments == NULL || format->specs == NULL) {
+        return false;
+    }
+
+    spec = format->specs;
+    start = p = format->fmt;
+
+    while (*p != '\0') {
+        if (*p != '%') {
+            ++p;
+            continue;
+        }
+
+        if (p[1] == '%') {
+            p += 2;
+            continue;
+        }
+
+        segment = &format->segments[format->count];
+        segment->stars = 0;
+        segment->precision = FORMAT_NONE;
+
+        for (++p; *p != '\0' && strchr("-+ #0'I", *p) != NULL; ++p) {
+        }
+
+        if (*p == '*') {
+            ++segment->stars;
+            ++p;
+        }
+        for (; *p >= '0' && *p <= '9'; ++p) {
+        }
+
+        if (*p == '.') {
+            ++p;
+            segment->precision = 0;
+            if (*p == '*') {
+                segment->precision = FORMAT_STAR;
+                ++segment->stars;
+                ++p;
+            }
+            for (; *p >= '0' && *p <= '9'; ++p) {
+                if (segment->precision < 100000000) {
+                    segment->precision = segment->precision * 10 + *p - '0';
+                }
+            }
+        }
+
+        for (; *p != '\0' && strchr("hlLqjzZt", *p) != NULL; ++p) {
+        }
+
+        //%m prints errno, which will have changed by the time it's rendered,
+        //and glibc reports %ls as an ordinary string
+        if (*p == '\0' || *p == 'm' || (*p == 's' && p[-1] == 'l')) {
+            return false;
+        }
+        ++p;
+
+        //the widths and precisions are ints
+        if (arg + segment->stars + 1 > args) {
+            return false;
+        }
+        arg += segment->stars;
+        segment->type = types[arg++];
+        if (!format_type_supported(segment->type)) {
+            return false;
+        }
+
+        segment->spec = spec;
+        memcpy(spec, start, p - start);
+        spec += p - start;
+        *spec++ = '\0';
+        ++format->count;
+
+        start = p;
+    }
+
+    if (arg != args) {
+        return false;
+    }
+
+    if (p > start) {
+        segment = &format->segments[format->count++];
+        segment->type = FORMAT_NONE;
+        segment->stars = 0;
+        segment->precision = FORMAT_NONE;
+        segment->spec = spec;
+        memcpy(spec, start, p - start);
+        spec[p - start] = '\0';
+    }
+
+    return true;
+}
+
+format_t *
+format_init(const char *fmt) {
+    format_t *format;
+    size_t args;
+    int *types;
+
+    format = calloc(1, sizeof(*format));
+    if (format == NULL) {
+        return NULL;
+    }
+
+    format->fmt = strdup(fmt);
+    if (format->fmt == NULL) {
+        free(format);
+        return NULL;
+    }
+
+    //positional arguments would need every argument captured before any of
+    //them could be rendered
+    if (strchr(fmt, '$') != NULL) {
+        return format;
+    }
+
+    args = parse_printf_format(fmt, 0, NULL);
+    types = malloc(sizeof(*types) * (args + 1));
+    if (types == NULL) {
+        format_free(format);
+        return NULL;
+    }
+    parse_printf_format(fmt, args, types);
+
+    format->deferrable = format_parse(format, types, args);
+    free(types);
+
+    if (!format->deferrable) {
+        free(format->segments);
+        free(format->specs);
+        format->segments = NULL;
+        format->specs = NULL;
+        format->count = 0;
+    }
+
+    return format;
+}
+
+void
+format_free(format_t *format) {
+    if (format == NULL) {
+        return;
+    }
+
+    free(format->segments);
+    free(format->specs);
+    free(format->fmt);
+    free(format);
+}
+
+const char *
+format_string(const format_t *format) {
+    return format->fmt;
+}
+
+bool
+format_deferrable(const format_t *format) {
+    return format->deferrable;
+}
+
+/**
+ * Returns the size of a value of the type in a record, not counting the
+ * characters of a string.
+ */
+static size_t
+format_type_size(int type) {
+    switch (type & ~PA_FLAG_MASK) {
+        case PA_STRING:
+            return 1; //whether the string is NULL
+        case PA_POINTER:
+            return sizeof(void *);
+        case PA_FLOAT:
+        case PA_DOUBLE:
+            return type & PA_FLAG_LONG_DOUBLE ? sizeof(long double) : sizeof(double);
+        default:
+            if (type & PA_FLAG_LONG_LONG) {
+                return sizeof(long long);
+            }
+            if (type & PA_FLAG_LONG) {
+                return sizeof(long);
+            }
+            return sizeof(int);
+    }
+}
+
+/**
+ * Returns how many characters of the string a conversion prints, which is
+ * never more than its precision. The string doesn't have to be terminated
+ * if it's at least that long.
+ */
+static size_t
+format_string_length(const format_segment_t *segment, int star, const char *str) {
+    int precision;
+
+    precision = segment->precision == FORMAT_STAR ? star : segment->precision;
+    if (precision < 0) {
+        return strlen(str);
+    }
+
+    return strnlen(str, precision);
+}
+
+size_t
+format_capture_size(const format_t *format, va_list ap) {
+    const format_segment_t *segment;
+    const char *str;
+    size_t size = 0;
+    unsigned int i, j;
+    int star = 0;
+
+    for (i = 0; i < format->count; i++) {
+        segment = &format->segments[i];
+        if (segment->type == FORMAT_NONE) {
+            continue;
+        }
+
+        for (j = 0; j < segment->stars; j++) {
+            star = va_arg(ap, int);
+            size += sizeof(int);
+        }
+
+        size += format_type_size(segment->type);
+
+        switch (segment->type & ~PA_FLAG_MASK) {
+            case PA_STRING:
+                str = va_arg(ap, const char *);
+                if (str != NULL) {
+                    size += format_string_length(segment, star, str) + 1;
+                }
+                break;
+            case PA_POINTER:
+                va_arg(ap, void *);
+                break;
+            case PA_FLOAT:
+            case PA_DOUBLE:
+                if (segment->type & PA_FLAG_LONG_DOUBLE) {
+                    va_arg(ap, long double);
+                }
+                else {
+                    va_arg(ap, double);
+                }
+                break;
+            default:
+                if (segment->type & PA_FLAG_LONG_LONG) {
+                    va_arg(ap, long long);
+                }
+                else if (segment->type & PA_FLAG_LONG) {
+                    va_arg(ap, long);
+                }
+                else {
+                    va_arg(ap, int);
+                }
+                break;
+        }
+    }
+
+    return size;
+}
+
+void
+format_capture(const format_t *format, void *record, va_list ap) {
+    const format_segment_t *segment;
+    unsigned char *p = record;
+    const char *str;
+    unsigned int i, j;
+    int star = 0;
+    size_t len;
+    union {
+        int i;
+        long l;
+        long long ll;
+        void *p;
+        double d;
+        long double ld;
+    } value;
+
+    for (i = 0; i < format->count; i++) {
+        segment = &format->segments[i];
+        if (segment->type == FORMAT_NONE) {
+            continue;
+        }
+
+        for (j = 0; j < segment->stars; j++) {
+            star = va_arg(ap, int);
+            memcpy(p, &star, sizeof(int));
+            p += sizeof(int);
+        }
+
+        switch (segment->type & ~PA_FLAG_MASK) {
+            case PA_STRING:
+                str = va_arg(ap, const char *);
+                *p++ = str != NULL;
+                if (str != NULL) {
+                    len = format_string_length(segment, star, str);
+                    memcpy(p, str, len);
+                    p[len] = '\0';
+                    p += len + 1;
+                }
+                continue;
+            case PA_POINTER:
+                value.p = va_arg(ap, void *);
+                break;
+            case PA_FLOAT:
+            case PA_DOUBLE:
+                if (segment->type & PA_FLAG_LONG_DOUBLE) {
+                    value.ld = va_arg(ap, long double);
+                }
+                else {
+                    value.d = va_arg(ap, double);
+                }
+                break;
+            default:
+                if (segment->type & PA_FLAG_LONG_LONG) {
+                    value.ll = va_arg(ap, long long);
+                }
+                else if (segment->type & PA_FLAG_LONG) {
+                    value.l = va_arg(ap, long);
+                }
+                else {
+                    value.i = va_arg(ap, int);
+                }
+                break;
+        }
+
+        //every member starts at the beginning of the union
+        len = format_type_size(segment->type);
+        memcpy(p, &value, len);
+        p += len;
+    }
+}
+
+//passes the segment's widths and precisions before the value
+#define FORMAT_WRITE(value) \
+    (segment->stars == 0 ? buffer_writef(buffer, segment->spec, value) : \
+     segment->stars == 1 ? buffer_writef(buffer, segment->spec, stars[0], value) : \
+                           buffer_writef(buffer, segment->spec, stars[0], stars[1], value))
+
+bool
+format_render(const format_t *format, const void *record, buffer_t *buffer) {
+    const format_segment_t *segment;
+    const unsigned char *p = record;
+    const char *str;
+    unsigned int i, j;
+    int stars[2];
+    bool success = true;
+    union {
+        int i;
+        long l;
+        long long ll;
+        void *p;
+        double d;
+        long double ld;
+    } value;
+
+    for (i = 0; success && i < format->count; i++) {
+        segment = &format->segments[i];
+        if (segment->type == FORMAT_NONE) {
+            success = buffer_writef(buffer, segment->spec);
+            continue;
+        }
+
+        for (j = 0; j < segment->stars; j++) {
+            memcpy(&stars[j], p, sizeof(int));
+            p += sizeof(int);
+        }
+
+        if ((segment->type & ~PA_FLAG_MASK) == PA_STRING) {
+            str = NULL;
+            if (*p++) {
+                str = (const char *)p;
+                p += strlen(str) + 1;
+            }
+
+            success = FORMAT_WRITE(str);
+            continue;
+        }
+
+        memcpy(&value, p, format_type_size(segment->type));
+        p += format_type_size(segment->type);
+
+        switch (segment->type & ~PA_FLAG_MASK) {
+            case PA_POINTER:
+                success = FORMAT_WRITE(value.p);
+                break;
+            case PA_FLOAT:
+            case PA_DOUBLE:
+                if (segment->type & PA_FLAG_LONG_DOUBLE) {
+                    success = FORMAT_WRITE(value.ld);
+                }
+                else {
+                    success = FORMAT_WRITE(value.d);
+                }
+                break;
+            default:
+                if (segment->type & PA_FLAG_LONG_LONG) {
+                    success = FORMAT_WRITE(value.ll);
+                }
+                else if (segment->type & PA_FLAG_LONG) {
+                    success = FORMAT_WRITE(value.l);
+                }
+                else {
+                    success = FORMAT_WRITE(value.i);
+                }
+                break;
+        }
+    }
+
+    return success;
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+/**
+ * @file format.h
+ * @author Scott Newman
+ *
+ * @brief Deferred printf() style formatting.
+ *
+ * A format string is parsed once into segments that each hold some literal
+ * text and at most one conversion. The arguments for a call can then be
+ * captured into a compact binary record, with strings copied, and the record
+ * rendered into a buffer later on, possibly on another thread. Format strings
+ * that use positional arguments, <tt>%n</tt>, <tt>%m</tt> or wide characters
+ * can't be deferred and have to be formatted right away.
+ */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "buffer.h"
+
+typedef struct format_t format_t;
+
+/**
+ * @brief Parses a format string.
+ *
+ * The format string is copied, so it only needs to stay valid for the call.
+ *
+ * @param[in] fmt The printf() style format string.
+ * @return The parsed format, or <tt>NULL</tt> if not enough memory was
+ * available.
+ */
+format_t * format_init(const char *fmt);
+
+/**
+ * @brief Frees the parsed format.
+ *
+ * @param[in] format The parsed format.
+ */
+void format_free(format_t *format);
+
+/**
+ * @brief Returns the format string the format was parsed from.
+ *
+ * @param[in] format The parsed format.
+ * @return The format's copy of the format string.
+ */
+const char * format_string(const format_t *format);
+
+/**
+ * @brief Returns whether the format's arguments can be captured.
+ *
+ * @param[in] format The parsed format.
+ * @return <tt>true</tt> if format_capture() can be used, otherwise
+ * <tt>false</tt> if the arguments must be formatted right away.
+ */
+bool format_deferrable(const format_t *format);
+
+/**
+ * @brief Returns how big a record of the arguments would be.
+ *
+ * @param[in] format The parsed format. Must be deferrable.
+ * @param[in] ap The arguments. This function consumes them, so pass a copy.
+ * @return The size of the record in bytes.
+ */
+size_t format_capture_size(const format_t *format, va_list ap);
+
+/**
+ * @brief Captures the arguments into a record.
+ *
+ * @param[in] format The parsed format. Must be deferrable.
+ * @param[out] record Room for format_capture_size() bytes. It doesn't need to
+ * be aligned.
+ * @param[in] ap The same arguments that were passed to format_capture_size().
+ */
+void format_capture(const format_t *format, void *record, va_list ap);
+
+/**
+ * @brief Formats a record and writes the result to a buffer.
+ *
+ * @param[in] format The parsed format the record was captured with.
+ * @param[in] record The record.
+ * @param[in] buffer The buffer to write to.
+ * @return <tt>true</tt>, otherwise <tt>false</tt> if not enough memory was
+ * available.
+ */
+bool format_render(const format_t *format, const void *record, buffer_t *buffer);
@@ -0,0 +1,176 @@
+/**
+ * @file heap.c
+ */
+
+#include <stdlib.h>
+#include "heap.h"
+
+/**
+ * @brief The heap.
+ *
+ * This structure represents the heap as an implicit binary tree stored in an
+ * array. The children of the item at index <tt>i</tt> are located at
+ * <tt>2i + 1</tt> and <tt>2i + 2</tt>.
+ */
+struct heap_t {
+    void **items;                                   //!< The array of items.
+    unsigned int size;                              //!< The number of items in the heap.
+    unsigned int capacity;                          //!< The capacity of the heap.
+    int (*compare)(const void *, const void *);     //!< Orders the items.
+    void (*index_func)(void *, unsigned int);       //!< Notified when an item moves.
+};
+
+heap_t *
+heap_init(int (*compare)(const void *, const void *), void (*index_func)(void *, unsigned int)) {
+    heap_t *heap;
+
+    heap = calloc(1, sizeof(*heap));
+    if (heap == NULL) {
+        return NULL;
+    }
+
+    heap->compare = compare;
+    heap->index_func = index_func;
+
+    return heap;
+}
+
+void
+heap_free(heap_t *heap) {
+    if (heap == NULL) {
+        return;
+    }
+
+    if (heap->items != NULL) {
+        free(heap->items);
+    }
+
+    free(heap);
+}
+
+unsigned int
+heap_size(heap_t *heap) {
+    return heap->size;
+}
+
+static void
+heap_set(heap_t *heap, unsigned int index, void *data) {
+    heap->items[index] = data;
+
+    if (heap->index_func != NULL) {
+        heap->index_func(data, index);
+    }
+}
+
+static void
+heap_sift_up(heap_t *heap, unsigned int index) {
+    void *data;
+    unsigned int parent;
+
+    data = heap->items[index];
+
+    while (index > 0) {
+        parent = (index - 1) / 2;
+        if (heap->compare(data, heap->items[parent]) >= 0) {
+            break;
+        }
+
+        heap_set(heap, index, heap->items[parent]);
+        index = parent;
+    }
+
+    heap_set(heap, index, data);
+}
+
+static void
+heap_sift_down(heap_t *heap, unsigned int index) {
+    void *data;
+    unsigned int child;
+
+    data = heap->items[index];
+
+    while ((child = index * 2 + 1) < heap->size) {
+        if (child + 1 < heap->size && heap->compare(heap->items[child + 1], heap->items[child]) < 0) {
+            ++child;
+        }
+        if (heap->compare(heap->items[child], data) >= 0) {
+            break;
+        }
+
+        heap_set(heap, index, heap->items[child]);
+        index = child;
+    }
+
+    heap_set(heap, index, data);
+}
+
+static bool
+heap_grow(heap_t *heap) {
+    void **new_items;
+    unsigned int new_capacity;
+
+    new_capacity = heap->capacity == 0 ? HEAP_CAPACITY_INITIAL : heap->capacity * 2;
+    new_items = realloc(heap->items, sizeof(void *) * new_capacity);
+    if (new_items == NULL) {
+        return false;
+    }
+
+    heap->items = new_items;
+    heap->capacity = new_capacity;
+
+    return true;
+}
+
+bool
+heap_push(heap_t *heap, void *data) {
+    if (heap->size >= heap->capacity) {
+        if (!heap_grow(heap)) {
+            return false;
+        }
+    }
+
+    heap->items[heap->size] = data;
+    heap_sift_up(heap, heap->size++);
+
+    return true;
+}
+
+void *
+heap_peek(heap_t *heap) {
+    return heap->size == 0 ? NULL : heap->items[0];
+}
+
+void *
+heap_pop(heap_t *heap) {
+    return heap_remove(heap, 0);
+}
+
+void *
+heap_remove(heap_t *heap, unsigned int index) {
+    void *data;
+
+    if (index >= heap->size) {
+        return NULL;
+    }
+
+    data = heap->items[index];
+    --heap->size;
+
+    //move the last item into the hole and restore the heap in whichever
+    //direction it needs to go
+    if (index < heap->size) {
+        heap->items[index] = heap->items[heap->size];
+        if (index > 0 && heap->compare(heap->items[index], heap->items[(index - 1) / 2]) < 0) {
+            heap_sift_up(heap, index);
+        }
+        else {
+            heap_sift_down(heap, index);
+        }
+    }
+
+    if (heap->index_func != NULL) {
+        heap->index_func(data, HEAP_INDEX_NONE);
+    }
+
+    return data;
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+/**
+ * @file heap.h
+ * @author Scott Newman
+ *
+ * @brief A binary min-heap data structure.
+ *
+ * A generic priority queue backed by a dynamically growing array. Items are
+ * ordered by a user supplied compare function and the smallest item is always
+ * at the top of the heap. An optional index function is notified every time
+ * an item moves within the heap so the owner of the item can remove it in
+ * O(log n) time with heap_remove().
+ */
+
+#include <stdbool.h>
+
+#define HEAP_CAPACITY_INITIAL 64          //!< The initial capacity of the heap.
+#define HEAP_INDEX_NONE       (~0U)       //!< The index given to items that are no longer in the heap.
+
+typedef struct heap_t heap_t;
+
+/**
+ * @brief Initializes the heap.
+ *
+ * This function must be called before any other heap function is used. No
+ * room for items is allocated until the first item is pushed.
+ *
+ * @param[in] compare The function used to order items. It returns a negative
+ * value, zero, or a positive value if the first item is less than, equal to,
+ * or greater than the second item.
+ * @param[in] index_func An optional function called with an item's new index
+ * whenever it moves, or #HEAP_INDEX_NONE when it leaves the heap. May be
+ * <tt>NULL</tt>.
+ * @return A pointer to the heap, or <tt>NULL</tt> if not enough memory was
+ * available.
+ */
+heap_t * heap_init(int (*compare)(const void *, const void *), void (*index_func)(void *, unsigned int));
+
+/**
+ * @brief Frees the heap.
+ *
+ * Releases the memory used by the heap. This does not free the user data of
+ * any items left in the heap.
+ *
+ * @param[in] heap The heap.
+ */
+void heap_free(heap_t *heap);
+
+/**
+ * @brief Returns the size of the heap.
+ *
+ * @param[in] heap The heap.
+ * @return The number of items in the heap.
+ */
+unsigned int heap_size(heap_t *heap);
+
+/**
+ * @brief Pushes an item onto the heap.
+ *
+ * @param[in] heap The heap.
+ * @param[in] data The user data to add.
+ * @return <tt>true</tt>, otherwise <tt>false</tt> if not enough memory was
+ * available.
+ */
+bool heap_push(heap_t *heap, void *data);
+
+/**
+ * @brief Returns the smallest item without removing it.
+ *
+ * @param[in] heap The heap.
+ * @return The smallest item, or <tt>NULL</tt> if the heap is empty.
+ */
+void * heap_peek(heap_t *heap);
+
+/**
+ * @brief Removes and returns the smallest item.
+ *
+ * @param[in] heap The heap.
+ * @return The smallest item, or <tt>NULL</tt> if the heap is empty.
+ */
+void * heap_pop(heap_t *heap);
+
+/**
+ * @brief Removes the item at the specified index.
+ *
+ * The index is the one last reported to the heap's index function.
+ *
+ * @param[in] heap The heap.
+ * @param[in] index The index of the item to remove.
+ * @return The removed item, or <tt>NULL</tt> if the index is out of range.
+ */
+void * heap_remove(heap_t *heap, unsigned int index);
@@ -0,0 +1,204 @@
+/**
+ * @file hmap.c
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include "hmap.h"
+
+/**
+ * @brief A slot in the hash map. The slot is empty when its data is
+ * <tt>NULL</tt>.
+ */
+typedef struct {
+    int key;                //!< The key.
+    void *data;             //!< The user data.
+} hmap_slot_t;
+
+/**
+ * @brief The hash map.
+ */
+struct hmap_t {
+    hmap_slot_t *slots;     //!< The array of slots.
+    unsigned int size;      //!< The number of items in the map.
+    unsigned int capacity;  //!< The number of slots, always a power of 2.
+};
+
+hmap_t *
+hmap_init() {
+    hmap_t *map;
+
+    map = calloc(1, sizeof(*map));
+    if (map == NULL) {
+        return NULL;
+    }
+
+    return map;
+}
+
+void
+hmap_free(hmap_t *map) {
+    hmap_free_func(map, NULL);
+}
+
+void
+hmap_free_func(hmap_t *map, void (*free_func)(void *)) {
+    unsigned int i;
+
+    if (map == NULL) {
+        return;
+    }
+
+    if (map->slots != NULL) {
+        if (free_func != NULL) {
+            for (i = 0; i < map->capacity; i++) {
+                if (map->slots[i].data != NULL) {
+                    free_func(map->slots[i].data);
+                }
+            }
+        }
+
+        free(map->slots);
+    }
+
+    free(map);
+}
+
+unsigned int
+hmap_size(hmap_t *map) {
+    return map->size;
+}
+
+/**
+ * Returns the slot a key would like to be in. Fibonacci hashing spreads out
+ * sequential keys, which are the most common kind.
+ */
+static unsigned int
+hmap_home(hmap_t *map, int key) {
+    return (uint32_t)((uint32_t)key * 2654435769U) >> (32 - __builtin_ctz(map->capacity));
+}
+
+/**
+ * Returns the slot the key is in, or the empty slot where it would go.
+ */
+static unsigned int
+hmap_find(hmap_t *map, int key) {
+    unsigned int i, mask;
+
+    mask = map->capacity - 1;
+
+    for (i = hmap_home(map, key); map->slots[i].data != NULL; i = (i + 1) & mask) {
+        if (map->slots[i].key == key) {
+            break;
+        }
+    }
+
+    return i;
+}
+
+static bool
+hmap_grow(hmap_t *map) {
+    hmap_slot_t *old_slots;
+    unsigned int old_capacity, i, j;
+
+    old_slots = map->slots;
+    old_capacity = map->capacity;
+
+    map->capacity = old_capacity == 0 ? HMAP_CAPACITY_INITIAL : old_capacity * 2;
+    map->slots = calloc(map->capacity, sizeof(*map->slots));
+    if (map->slots == NULL) {
+        map->slots = old_slots;
+        map->capacity = old_capacity;
+        return false;
+    }
+
+    for (i = 0; i < old_capacity; i++) {
+        if (old_slots[i].data != NULL) {
+            j = hmap_find(map, old_slots[i].key);
+            map->slots[j] = old_slots[i];
+        }
+    }
+
+    if (old_slots != NULL) {
+        free(old_slots);
+    }
+
+    return true;
+}
+
+void *
+hmap_get(hmap_t *map, int key) {
+    if (map->size == 0) {
+        return NULL;
+    }
+
+    return map->slots[hmap_find(map, key)].data;
+}
+
+bool
+hmap_put(hmap_t *map, int key, void *data) {
+    unsigned int i;
+
+    if ((map->size + 1) * 2 > map->capacity) {
+        if (!hmap_grow(map)) {
+            return false;
+        }
+    }
+
+    i = hmap_find(map, key);
+    if (map->slots[i].data == NULL) {
+        ++map->size;
+    }
+
+    map->slots[i].key = key;
+    map->slots[i].data = data;
+
+    return true;
+}
+
+void *
+hmap_remove(hmap_t *map, int key) {
+    void *data;
+    unsigned int i, j, home, mask;
+
+    if (map->size == 0) {
+        return NULL;
+    }
+
+    i = hmap_find(map, key);
+    data = map->slots[i].data;
+    if (data == NULL) {
+        return NULL;
+    }
+
+    //shift back every following item in the run that would rather be in the
+    //hole, so lookups never stop early at it
+    mask = map->capacity - 1;
+    for (j = (i + 1) & mask; map->slots[j].data != NULL; j = (j + 1) & mask) {
+        home = hmap_home(map, map->slots[j].key);
+
+        //leave the item alone if its home is cyclically within (i, j]
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j)) {
+            continue;
+        }
+
+        map->slots[i] = map->slots[j];
+        i = j;
+    }
+
+    map->slots[i].data = NULL;
+    --map->size;
+
+    return data;
+}
+
+void *
+hmap_next(hmap_t *map, unsigned int *iter) {
+    while (*iter < map->capacity) {
+        if (map->slots[(*iter)++].data != NULL) {
+            return map->slots[*iter - 1].data;
+        }
+    }
+
+    return NULL;
+}
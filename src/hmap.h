@@ -0,0 +1,104 @@
+#pragma once
+
+/**
+ * @file hmap.h
+ * @author Scott Newman
+ *
+ * @brief A hash map from integer keys to user data.
+ *
+ * An open-addressing hash table with linear probing. Lookups, insertions and
+ * removals take O(1) time on average regardless of how many items are in the
+ * map. Removals shift the following items back instead of leaving tombstones,
+ * so the map never slows down after many items come and go. The table holds
+ * at most half as many items as it has slots and doubles in size when it gets
+ * fuller than that. User data must not be <tt>NULL</tt>.
+ */
+
+#include <stdbool.h>
+
+#define HMAP_CAPACITY_INITIAL 64 //!< The initial number of slots in the map.
+
+typedef struct hmap_t hmap_t;
+
+/**
+ * @brief Initializes the hash map.
+ *
+ * This function must be called before any other hash map function is used.
+ * No room for items is allocated until the first item is added.
+ *
+ * @return A pointer to the map, or <tt>NULL</tt> if not enough memory was
+ * available.
+ */
+hmap_t * hmap_init();
+
+/**
+ * @brief Frees the hash map.
+ *
+ * This does not free the user data of any items left in the map. See
+ * hmap_free_func() for that.
+ *
+ * @param[in] map The hash map.
+ */
+void hmap_free(hmap_t *map);
+
+/**
+ * @brief Frees the hash map and its user data.
+ *
+ * @param[in] map The hash map.
+ * @param[in] free_func The function to call on each item left in the map.
+ */
+void hmap_free_func(hmap_t *map, void (*free_func)(void *));
+
+/**
+ * @brief Returns the number of items in the hash map.
+ *
+ * @param[in] map The hash map.
+ * @return The number of items.
+ */
+unsigned int hmap_size(hmap_t *map);
+
+/**
+ * @brief Gets the item stored under a key.
+ *
+ * @param[in] map The hash map.
+ * @param[in] key The key.
+ * @return The user data, or <tt>NULL</tt> if nothing is stored under the key.
+ */
+void * hmap_get(hmap_t *map, int key);
+
+/**
+ * @brief Stores an item under a key.
+ *
+ * Replaces any item already stored under the key.
+ *
+ * @param[in] map The hash map.
+ * @param[in] key The key.
+ * @param[in] data The user data to store. Must not be <tt>NULL</tt>.
+ * @return <tt>true</tt>, otherwise <tt>false</tt> if not enough memory was
+ * available.
+ */
+bool hmap_put(hmap_t *map, int key, void *data);
+
+/**
+ * @brief Removes the item stored under a key.
+ *
+ * This function does not free the user data, which is why it's returned.
+ *
+ * @param[in] map The hash map.
+ * @param[in] key The key.
+ * @return The user data, or <tt>NULL</tt> if nothing is stored under the key.
+ */
+void * hmap_remove(hmap_t *map, int key);
+
+/**
+ * @brief Iterates over the items in the hash map.
+ *
+ * Start with <tt>*iter</tt> set to 0 and call this until it returns
+ * <tt>NULL</tt>. The items are returned in no particular order. The map must
+ * not be changed while iterating over it.
+ *
+ * @param[in] map The hash map.
+ * @param[in,out] iter The position of the iteration.
+ * @return The next item, or <tt>NULL</tt> once every item has been returned.
+ */
+void * hmap_next(hmap_t *map, unsigned int *iter);
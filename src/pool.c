@@ -0,0 +1,161 @@
+/**
+ * @file pool.c
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "alist.h"
+#include "pool.h"
+
+/**
+ * @brief An idle object in the pool.
+ */
+typedef struct {
+    char *key;          //!< The key the object is stored under.
+    void *data;         //!< The object.
+    time_t idle_since;  //!< When the object was returned to the pool.
+} pool_item_t;
+
+/**
+ * @brief The pool.
+ *
+ * Idle objects are kept in the order they were returned, so the most
+ * recently used objects are at the end and the longest idle are at the
+ * front.
+ */
+struct pool_t {
+    alist_t *items;             //!< The idle objects.
+    unsigned int max_per_key;   //!< The maximum number of idle objects per key.
+};
+
+pool_t *
+pool_init(unsigned int max_per_key) {
+    pool_t *pool;
+
+    pool = calloc(1, sizeof(*pool));
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    pool->items = alist_init();
+    if (pool->items == NULL) {
+        free(pool);
+        return NULL;
+    }
+
+    pool->max_per_key = max_per_key;
+
+    return pool;
+}
+
+void
+pool_free_func(pool_t *pool, void (*free_func)(void *)) {
+    pool_item_t *item;
+    unsigned int i;
+
+    if (pool == NULL) {
+        return;
+    }
+
+    for (i = 0; i < alist_size(pool->items); i++) {
+        item = alist_get(pool->items, i);
+
+        if (free_func != NULL) {
+            free_func(item->data);
+        }
+
+        free(item->key);
+        free(item);
+    }
+
+    alist_free(pool->items);
+    free(pool);
+}
+
+void
+pool_set_max_per_key(pool_t *pool, unsigned int max_per_key) {
+    pool->max_per_key = max_per_key;
+}
+
+unsigned int
+pool_size(pool_t *pool) {
+    return alist_size(pool->items);
+}
+
+static void *
+pool_take(pool_t *pool, unsigned int index) {
+    pool_item_t *item;
+    void *data;
+
+    item = alist_remove(pool->items, index);
+    data = item->data;
+
+    free(item->key);
+    free(item);
+
+    return data;
+}
+
+void *
+pool_get(pool_t *pool, const char *key) {
+    pool_item_t *item;
+    unsigned int i;
+
+    for (i = alist_size(pool->items); i > 0; i--) {
+        item = alist_get(pool->items, i - 1);
+
+        if (strcmp(item->key, key) == 0) {
+            return pool_take(pool, i - 1);
+        }
+    }
+
+    return NULL;
+}
+
+bool
+pool_put(pool_t *pool, const char *key, void *data, time_t now) {
+    pool_item_t *item;
+    unsigned int i, count = 0;
+
+    for (i = 0; i < alist_size(pool->items); i++) {
+        item = alist_get(pool->items, i);
+
+        if (strcmp(item->key, key) == 0) {
+            ++count;
+        }
+    }
+
+    if (count >= pool->max_per_key) {
+        return false;
+    }
+
+    item = malloc(sizeof(*item));
+    if (item == NULL) {
+        return false;
+    }
+
+    item->key = strdup(key);
+    item->data = data;
+    item->idle_since = now;
+
+    if (item->key == NULL || !alist_add(pool->items, item)) {
+        free(item->key);
+        free(item);
+        return false;
+    }
+
+    return true;
+}
+
+void *
+pool_evict(pool_t *pool, time_t before) {
+    pool_item_t *item;
+
+    //the front of the list has been idle the longest
+    item = alist_get(pool->items, 0);
+    if (item == NULL || item->idle_since >= before) {
+        return NULL;
+    }
+
+    return pool_take(pool, 0);
+}
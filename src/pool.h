@@ -0,0 +1,91 @@
+#pragma once
+
+/**
+ * @file pool.h
+ * @author Scott Newman
+ *
+ * @brief A keyed pool of idle objects.
+ *
+ * Keeps objects that are expensive to create, such as network connections,
+ * around for reuse. Each object is stored under a string key and only handed
+ * back out for the same key. The most recently returned object for a key is
+ * handed out first since it's the most likely to still be usable. The pool
+ * does not free the objects itself; objects that are refused by pool_put() or
+ * taken out by pool_evict() must be freed by the caller.
+ */
+
+#include <stdbool.h>
+#include <time.h>
+
+typedef struct pool_t pool_t;
+
+/**
+ * @brief Initializes the pool.
+ *
+ * @param[in] max_per_key The maximum number of idle objects kept for each key.
+ * @return A pointer to the pool, or <tt>NULL</tt> if not enough memory was
+ * available.
+ */
+pool_t * pool_init(unsigned int max_per_key);
+
+/**
+ * @brief Frees the pool and its objects.
+ *
+ * @param[in] pool The pool.
+ * @param[in] free_func The function to call on each object left in the pool.
+ * May be <tt>NULL</tt>.
+ */
+void pool_free_func(pool_t *pool, void (*free_func)(void *));
+
+/**
+ * @brief Sets the maximum number of idle objects kept for each key.
+ *
+ * Objects already in the pool are not evicted if there are too many of them.
+ *
+ * @param[in] pool The pool.
+ * @param[in] max_per_key The maximum number of idle objects kept for each key.
+ */
+void pool_set_max_per_key(pool_t *pool, unsigned int max_per_key);
+
+/**
+ * @brief Returns the number of idle objects in the pool.
+ *
+ * @param[in] pool The pool.
+ * @return The number of idle objects.
+ */
+unsigned int pool_size(pool_t *pool);
+
+/**
+ * @brief Takes an idle object out of the pool.
+ *
+ * @param[in] pool The pool.
+ * @param[in] key The key the object was stored under.
+ * @return The most recently returned object for the key, or <tt>NULL</tt> if
+ * there isn't one.
+ */
+void * pool_get(pool_t *pool, const char *key);
+
+/**
+ * @brief Returns an object to the pool.
+ *
+ * @param[in] pool The pool.
+ * @param[in] key The key to store the object under.
+ * @param[in] data The object.
+ * @param[in] now The time the object became idle.
+ * @return <tt>true</tt> if the object was stored, otherwise <tt>false</tt> if
+ * the key already has the maximum number of idle objects or not enough memory
+ * was available, in which case the caller still owns the object.
+ */
+bool pool_put(pool_t *pool, const char *key, void *data, time_t now);
+
+/**
+ * @brief Takes an object that has been idle for too long out of the pool.
+ *
+ * Call this repeatedly until it returns <tt>NULL</tt> to evict every object
+ * that has been idle since before <tt>before</tt>.
+ *
+ * @param[in] pool The pool.
+ * @param[in] before Objects idle since before this time are evicted.
+ * @return An evicted object, or <tt>NULL</tt> if there are none left.
+ */
+void * pool_evict(pool_t *pool, time_t before);
@@ -6,31 +6,21 @@
 #include <string.h>
 #include "queue.h"
 
-/**
- * @brief The queue node structure.
- *
- * This structure represents the node that make up the queue. The
- * <tt>data</tt> pointer is a pointer to the user data. The <tt>prev</tt> node
- * pointer points to the previous node in the queue, and for the first node in
- * the queue, points to NULL. The <tt>next</tt> node pointer points to the
- * next node in the queue, and for the last node in queue, points to NULL.
- */
-typedef struct queue_node_t {
-    void *data;                 //!< The user data.
-    struct queue_node_t *prev;  //!< The previous node in the queue.
-    struct queue_node_t *next;  //!< The next node in the queue.
-} queue_node_t;
+#define QUEUE_CAPACITY_MIN 16 //!< The smallest the ring is ever allocated.
 
 /**
  * @brief The queue structure.
  *
- * This structure represents the queue itself with sentinel head and tail
- * nodes, providing quick access to either end of the queue.
+ * This structure represents the queue as a ring of user data pointers whose
+ * capacity is always a power of two, so wrapping around is a mask instead of
+ * a division. The ring doubles when it fills up and halves when it's down to
+ * a quarter full, so pushing and popping never allocate anything per element.
  */
 struct queue_t {
-    queue_node_t *head; //!< Points to the first node in the queue.
-    queue_node_t *tail; //!< Points to the last node in the queue.
-    unsigned int size;  //!< The number of nodes in the queue.
+    void **ring;            //!< The user data, starting at head and wrapping around.
+    unsigned int capacity;  //!< The number of slots in the ring.
+    unsigned int head;      //!< The index of the first element.
+    unsigned int size;      //!< The number of elements in the queue.
 };
 
 queue_t *
@@ -49,24 +39,19 @@ queue_free(queue_t *queue) {
 
 void
 queue_free_func(queue_t *queue, void (*free_func)(void *)) {
-    queue_node_t *node, *del;
+    unsigned int i;
 
     if (queue == NULL) {
         return;
     }
 
-    node = queue->head;
-    while (node != NULL) {
-        del = node;
-        node = node->next;
-
-        if (free_func != NULL) {
-            free_func(del->data);
+    if (free_func != NULL) {
+        for (i = 0; i < queue->size; i++) {
+            free_func(queue->ring[(queue->head + i) & (queue->capacity - 1)]);
         }
-
-        free(del);
     }
 
+    free(queue->ring);
     free(queue);
 }
 
@@ -75,29 +60,49 @@ queue_size(queue_t *queue) {
     return queue->size;
 }
 
-bool
-queue_push(queue_t *queue, void *data) {
-    queue_node_t *node;
+/**
+ * Moves the elements into a new ring of the given capacity, straightening
+ * them out so the first one is at the start.
+ */
+static bool
+queue_resize(queue_t *queue, unsigned int capacity) {
+    void **ring;
+    unsigned int first;
 
-    node = malloc(sizeof(*node));
-    if (node == NULL) {
+    ring = malloc(sizeof(*ring) * capacity);
+    if (ring == NULL) {
         return false;
     }
 
-    node->data = data;
-    node->next = NULL;
+    if (queue->size > 0) {
+        //the elements are in at most two runs, up to the end of the old ring
+        //and then from its start
+        first = queue->capacity - queue->head;
+        if (first > queue->size) {
+            first = queue->size;
+        }
 
-    if (queue->head == NULL) {
-        node->prev = NULL;
-        queue->head = node;
-        queue->tail = node;
+        memcpy(ring, queue->ring + queue->head, sizeof(*ring) * first);
+        memcpy(ring + first, queue->ring, sizeof(*ring) * (queue->size - first));
     }
-    else {
-        node->prev = queue->tail;
-        queue->tail->next = node;
-        queue->tail = node;
+
+    free(queue->ring);
+    queue->ring = ring;
+    queue->capacity = capacity;
+    queue->head = 0;
+
+    return true;
+}
+
+bool
+queue_push(queue_t *queue, void *data) {
+    if (queue->size == queue->capacity) {
+        if (!queue_resize(queue, queue->capacity == 0 ? QUEUE_CAPACITY_MIN : queue->capacity * 2)) {
+            return false;
+        }
     }
 
+    queue->ring[(queue->head + queue->size) & (queue->capacity - 1)] = data;
     ++queue->size;
 
     return true;
@@ -105,32 +110,120 @@ queue_push(queue_t *queue, void *data) {
 
 void *
 queue_pop(queue_t *queue) {
-    queue_node_t *node;
     void *data;
 
-    if (queue->head == NULL) {
+    if (queue->size == 0) {
         return NULL;
     }
 
-    node = queue->head;
-    data = queue->head->data;
+    data = queue->ring[queue->head];
+    queue->head = (queue->head + 1) & (queue->capacity - 1);
+    --queue->size;
 
-    if (node->next == NULL) {
-        queue->head = NULL;
-        queue->tail = NULL;
-    }
-    else {
-        queue->head = node->next;
-        queue->head->prev = NULL;
+    //give memory back after a burst, but keeping the bigger ring is fine if
+    //there isn't enough memory for the smaller one
+    if (queue->capacity > QUEUE_CAPACITY_MIN && queue->size <= queue->capacity / 4) {
+        queue_resize(queue, queue->capacity / 2);
     }
 
-    free(node);
-    --queue->size;
-
     return data;
 }
 
 void *
 queue_peek(queue_t *queue) {
-    return queue->head == NULL ? NULL : queue->head->data;
+    return queue->size == 0 ? NULL : queue->ring[queue->head];
+}
+
+/**
+ * @brief The multi-producer, single-consumer queue structure.
+ *
+ * Producers swap themselves into <tt>tail</tt> and then link the previous
+ * tail to themselves, so a push is a single atomic exchange. The consumer
+ * follows the links from <tt>head</tt>. The stub node keeps the list from
+ * ever being empty, which is what lets the two ends work independently. The
+ * ends are kept on separate cache lines so producers don't slow down the
+ * consumer.
+ */
+struct queue_mpsc_t {
+    _Alignas(64) queue_mpsc_node_t *_Atomic tail; //!< The last node pushed, written by producers.
+    _Alignas(64) queue_mpsc_node_t *head;         //!< The next node to pop, only used by the consumer.
+    queue_mpsc_node_t stub;                       //!< Placeholder node for when the queue is empty.
+};
+
+queue_mpsc_t *
+queue_mpsc_init() {
+    queue_mpsc_t *queue;
+
+    queue = aligned_alloc(_Alignof(queue_mpsc_t), sizeof(*queue));
+    if (queue == NULL) {
+        return NULL;
+    }
+
+    atomic_init(&queue->stub.next, NULL);
+    atomic_init(&queue->tail, &queue->stub);
+    queue->head = &queue->stub;
+
+    return queue;
+}
+
+void
+queue_mpsc_free(queue_mpsc_t *queue) {
+    free(queue);
+}
+
+void
+queue_mpsc_push(queue_mpsc_t *queue, queue_mpsc_node_t *node) {
+    queue_mpsc_push_chain(queue, node, node);
+}
+
+void
+queue_mpsc_push_chain(queue_mpsc_t *queue, queue_mpsc_node_t *first, queue_mpsc_node_t *last) {
+    queue_mpsc_node_t *prev;
+
+    atomic_store_explicit(&last->next, NULL, memory_order_relaxed);
+    prev = atomic_exchange_explicit(&queue->tail, last, memory_order_acq_rel);
+
+    //between the exchange and this store the consumer can't see the chain
+    atomic_store_explicit(&prev->next, first, memory_order_release);
+}
+
+queue_mpsc_node_t *
+queue_mpsc_pop(queue_mpsc_t *queue) {
+    queue_mpsc_node_t *head, *next;
+
+    head = queue->head;
+    next = atomic_load_explicit(&head->next, memory_order_acquire);
+
+    //skip over the stub
+    if (head == &queue->stub) {
+        if (next == NULL) {
+            return NULL;
+        }
+
+        queue->head = next;
+        head = next;
+        next = atomic_load_explicit(&head->next, memory_order_acquire);
+    }
+
+    if (next != NULL) {
+        queue->head = next;
+        return head;
+    }
+
+    //the head is the last node linked so far. If a producer is in the middle
+    //of pushing after it, wait for the push to finish.
+    if (head != atomic_load_explicit(&queue->tail, memory_order_acquire)) {
+        return NULL;
+    }
+
+    //put the stub back behind the last node so it can be popped
+    queue_mpsc_push(queue, &queue->stub);
+
+    next = atomic_load_explicit(&head->next, memory_order_acquire);
+    if (next != NULL) {
+        queue->head = next;
+        return head;
+    }
+
+    return NULL;
 }
@@ -6,21 +6,41 @@
  *
  * @brief A queue data structure.
  *
- * A generic queue data structure that uses previous and next pointers in
- * a linked list. All data put on the queue is appended to the back and all
- * data removed from the queue is removed from the front. This means the queue
- * is FIFO (first in, first out).
+ * A generic queue data structure that keeps pointers to the user data in a
+ * circular array, which grows and shrinks as needed. All data put on the
+ * queue is appended to the back and all data removed from the queue is
+ * removed from the front. This means the queue is FIFO (first in, first out).
+ *
+ * A lock-free multi-producer, single-consumer queue is also provided for data
+ * that many threads hand off to one thread. Any number of threads may push
+ * onto it at once without locking or allocating, but only one thread may pop
+ * from it at a time. The queue is intrusive: the user data embeds a
+ * #queue_mpsc_node_t instead of the queue allocating a node for it.
  */
 
 #include <stdbool.h>
+#include <stdatomic.h>
 
 typedef struct queue_t queue_t;
 
+/**
+ * @brief A node in a multi-producer, single-consumer queue.
+ *
+ * Embed this in the user data that's put on the queue. The queue owns the node
+ * from queue_mpsc_push() until queue_mpsc_pop() returns it.
+ */
+typedef struct queue_mpsc_node_t {
+    struct queue_mpsc_node_t *_Atomic next; //!< The next node in the queue.
+} queue_mpsc_node_t;
+
+typedef struct queue_mpsc_t queue_mpsc_t;
+
 /**
  * @brief Initializes the queue.
  *
- * Initializes the queue and sets the sentinel nodes to NULL. This function
- * must be the first function called before using any other queue functions.
+ * Initializes an empty queue. No memory is allocated for the elements until
+ * the first push. This function must be the first function called before
+ * using any other queue functions.
  *
  * @param[in] queue The queue.
  */
@@ -65,8 +85,8 @@ unsigned int queue_size(queue_t *queue);
 /**
  * @brief Pushes data onto the back of the queue.
  *
- * Adds a new node to the end of the queue. The queue's tail pointer will now
- * point to this new node.
+ * Adds the data to the end of the queue. Nothing is allocated unless the
+ * queue has to grow.
  *
  * @param[in] queue The queue.
  * @param[in] data A pointer to the data to add.
@@ -77,7 +97,7 @@ bool queue_push(queue_t *queue, void *data);
 /**
  * @brief Pops data off front of the queue.
  *
- * Removes a node from the front of the queue and returns the user data. This
+ * Removes the front of the queue and returns the user data. This
  * function may be safely called if the queue size is empty, in which case
  * <tt>NULL</tt> is returned.
  *
@@ -97,3 +117,62 @@ void * queue_pop(queue_t *queue);
  * @return The user data of the first node, or NULL if the queue is empty.
  */
 void * queue_peek(queue_t *queue);
+
+/**
+ * @brief Initializes a multi-producer, single-consumer queue.
+ *
+ * @return A pointer to the queue, or <tt>NULL</tt> if not enough memory was
+ * available.
+ */
+queue_mpsc_t * queue_mpsc_init();
+
+/**
+ * @brief Frees the memory used by a multi-producer, single-consumer queue.
+ *
+ * No other thread may be using the queue. Any nodes left on the queue are not
+ * freed; pop them off first.
+ *
+ * @param[in] queue The queue.
+ */
+void queue_mpsc_free(queue_mpsc_t *queue);
+
+/**
+ * @brief Pushes a node onto the back of a multi-producer, single-consumer
+ * queue.
+ *
+ * This function may be called from any number of threads at once. It never
+ * blocks and never fails.
+ *
+ * @param[in] queue The queue.
+ * @param[in] node The node embedded in the user data to add.
+ */
+void queue_mpsc_push(queue_mpsc_t *queue, queue_mpsc_node_t *node);
+
+/**
+ * @brief Pushes a chain of nodes onto the back of a multi-producer,
+ * single-consumer queue.
+ *
+ * The nodes from <tt>first</tt> to <tt>last</tt> must already be linked
+ * together through their <tt>next</tt> pointers. The whole chain is added
+ * with a single atomic exchange and stays in order, so a batch of nodes costs
+ * no more than one. This function may be called from any number of threads
+ * at once.
+ *
+ * @param[in] queue The queue.
+ * @param[in] first The first node of the chain.
+ * @param[in] last The last node of the chain.
+ */
+void queue_mpsc_push_chain(queue_mpsc_t *queue, queue_mpsc_node_t *first, queue_mpsc_node_t *last);
+
+/**
+ * @brief Pops a node off the front of a multi-producer, single-consumer queue.
+ *
+ * Only one thread may pop from the queue at a time. A push that's still in
+ * progress on another thread may not be visible yet, in which case this
+ * returns <tt>NULL</tt> even though the queue isn't empty; the node can be
+ * popped once the push finishes.
+ *
+ * @param[in] queue The queue.
+ * @return The first node, or <tt>NULL</tt> if no node is ready.
+ */
+queue_mpsc_node_t * queue_mpsc_pop(queue_mpsc_t *queue);
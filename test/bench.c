@@ -0,0 +1,422 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <ens.h>
+#include "../src/queue.h"
+
+/**
+ * Benchmarks for ENS. Emails are sent to a fake SMTP server running inside
+ * this process, so no test.conf is needed.
+ *
+ * Usage: bench workers [groups] [delay ms]
+ *        bench contention [threads] [emails per thread]
+ *        bench batch [threads] [emails per thread]
+ *
+ *   workers:    Measures how long it takes to send one email for each of
+ *               [groups] groups when the SMTP server takes [delay ms] to greet
+ *               each connection, with different numbers of worker threads and
+ *               with the asynchronous engine.
+ *   contention: Measures how many emails per second up to [threads] threads
+ *               can hand off to one consumer, first through a mutex and a
+ *               queue_t like groups used to and then through the lock-free
+ *               queue_mpsc_t, and then through ens_group_send() to one group,
+ *               without and with ENS_GROUP_OPTION_THREAD_BATCH.
+ *   batch:      Measures how many emails per second up to [threads] threads
+ *               can queue for one group, one at a time with ens_group_send()
+ *               and BATCH_SIZE at a time with ens_group_send_batch().
+ */
+
+#define BATCH_SIZE 64 //!< The number of emails each ens_group_send_batch() call queues.
+
+typedef struct {
+    int fd;
+    int port;
+    int delay_ms;
+    atomic_uint received;
+} smtp_server_t;
+
+static double
+now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *
+smtp_client(void *user_data) {
+    smtp_server_t *server;
+    char line[4096];
+    bool data = false;
+    pthread_t thread;
+    FILE *f;
+    int fd;
+
+    server = (smtp_server_t *)user_data;
+    fd = accept(server->fd, NULL, NULL);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    //accept the next connection on another thread
+    if (pthread_create(&thread, NULL, smtp_client, server) == 0) {
+        pthread_detach(thread);
+    }
+
+    //a slow server takes a while to greet each new connection
+    if (server->delay_ms > 0) {
+        usleep(1000 * server->delay_ms);
+    }
+
+    f = fdopen(fd, "r+");
+    setvbuf(f, NULL, _IONBF, 0);
+    fprintf(f, "220 bench\r\n");
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (data) {
+            if (strcmp(line, ".\r\n") == 0) {
+                data = false;
+                atomic_fetch_add(&server->received, 1);
+                fprintf(f, "250 OK\r\n");
+            }
+        }
+        else if (strncasecmp(line, "EHLO", 4) == 0) {
+            fprintf(f, "250 bench\r\n");
+        }
+        else if (strncasecmp(line, "DATA", 4) == 0) {
+            data = true;
+            fprintf(f, "354 Go ahead\r\n");
+        }
+        else if (strncasecmp(line, "QUIT", 4) == 0) {
+            fprintf(f, "221 Bye\r\n");
+            break;
+        }
+        else {
+            fprintf(f, "250 OK\r\n");
+        }
+    }
+
+    fclose(f);
+    return NULL;
+}
+
+static bool
+smtp_server_start(smtp_server_t *server, int delay_ms) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    pthread_t thread;
+
+    memset(server, 0, sizeof(*server));
+    server->delay_ms = delay_ms;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    server->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (server->fd == -1 ||
+        bind(server->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(server->fd, 128) != 0 ||
+        getsockname(server->fd, (struct sockaddr *)&addr, &len) != 0) {
+        fprintf(stderr, "Failed to start the SMTP server: %s\n", strerror(errno));
+        return false;
+    }
+
+    server->port = ntohs(addr.sin_port);
+
+    if (pthread_create(&thread, NULL, smtp_client, server) != 0) {
+        fprintf(stderr, "Failed to start the SMTP server: %s\n", strerror(errno));
+        return false;
+    }
+    pthread_detach(thread);
+
+    return true;
+}
+
+static ens_t *
+bench_init(smtp_server_t *server) {
+    char host[32];
+    ens_t *ens;
+
+    ens = ens_init();
+    if (ens == NULL) {
+        fprintf(stderr, "Failed to initialize ENS\n");
+        exit(EXIT_FAILURE);
+    }
+
+    snprintf(host, sizeof(host), "127.0.0.1:%d", server->port);
+
+    ens_set_option(ens, ENS_OPTION_HOST, host);
+    ens_set_option(ens, ENS_OPTION_FROM, "bench@localhost");
+    ens_set_option(ens, ENS_OPTION_TO, "bench@localhost");
+    ens_set_option(ens, ENS_OPTION_INTERVAL, 0);
+
+    return ens;
+}
+
+static void
+bench_workers(smtp_server_t *server, int groups) {
+    //-1 uses the asynchronous engine instead of worker threads
+    static const int workers[] = {0, 1, 2, 4, 8, 16, -1};
+    unsigned int i, start;
+    double elapsed, base = 0;
+    char label[16];
+    ens_t *ens;
+    int id;
+
+    printf("%8s %10s %12s %8s\n", "workers", "seconds", "emails/sec", "speedup");
+
+    for (i = 0; i < sizeof(workers) / sizeof(workers[0]); i++) {
+        ens = bench_init(server);
+        if (workers[i] < 0) {
+            ens_set_option(ens, ENS_OPTION_ASYNC, 1);
+            snprintf(label, sizeof(label), "async");
+        }
+        else {
+            ens_set_option(ens, ENS_OPTION_WORKER_THREADS, workers[i]);
+            snprintf(label, sizeof(label), "%d", workers[i]);
+        }
+
+        for (id = 0; id < groups; id++) {
+            ens_group_register(ens, id);
+            ens_group_send(ens, id, "Bench", "Benchmark email");
+        }
+
+        start = atomic_load(&server->received);
+        elapsed = now();
+
+        ens_start(ens);
+        while (atomic_load(&server->received) - start < (unsigned int)groups) {
+            usleep(1000);
+        }
+
+        elapsed = now() - elapsed;
+        if (base == 0) {
+            base = elapsed;
+        }
+
+        printf("%8s %10.3f %12.1f %7.2fx\n", label, elapsed, groups / elapsed, base / elapsed);
+
+        ens_stop_join(ens);
+        ens_free(ens);
+    }
+}
+
+typedef struct {
+    pthread_mutex_t mutex;
+    queue_t *queue;
+    queue_mpsc_t *mpsc;
+    queue_mpsc_node_t *nodes;
+    unsigned int per_thread;
+    atomic_uint next_thread;
+    ens_t *ens;
+} contention_t;
+
+static void *
+contention_mutex_producer(void *user_data) {
+    contention_t *contention = user_data;
+    unsigned int i;
+
+    for (i = 0; i < contention->per_thread; i++) {
+        pthread_mutex_lock(&contention->mutex);
+        queue_push(contention->queue, contention);
+        pthread_mutex_unlock(&contention->mutex);
+    }
+
+    return NULL;
+}
+
+static void *
+contention_mpsc_producer(void *user_data) {
+    contention_t *contention = user_data;
+    queue_mpsc_node_t *nodes;
+    unsigned int i;
+
+    //each thread pushes its own slice of the nodes, like emails it allocated
+    nodes = contention->nodes + atomic_fetch_add(&contention->next_thread, 1) * contention->per_thread;
+
+    for (i = 0; i < contention->per_thread; i++) {
+        queue_mpsc_push(contention->mpsc, &nodes[i]);
+    }
+
+    return NULL;
+}
+
+static void *
+contention_send_producer(void *user_data) {
+    contention_t *contention = user_data;
+    unsigned int i;
+
+    for (i = 0; i < contention->per_thread; i++) {
+        ens_group_send(contention->ens, 0, "Bench", "Benchmark email");
+    }
+
+    return NULL;
+}
+
+static void *
+contention_batch_producer(void *user_data) {
+    contention_t *contention = user_data;
+    ens_message_t msgs[BATCH_SIZE];
+    unsigned int i, n;
+
+    for (i = 0; i < BATCH_SIZE; i++) {
+        msgs[i].id = 0;
+        msgs[i].subject = "Bench";
+        msgs[i].body = "Benchmark email";
+    }
+
+    for (i = 0; i < contention->per_thread; i += n) {
+        n = contention->per_thread - i < BATCH_SIZE ? contention->per_thread - i : BATCH_SIZE;
+        ens_group_send_batch(contention->ens, 0, msgs, n, NULL);
+    }
+
+    return NULL;
+}
+
+/**
+ * Runs the producers and drains what they push from this thread in batches,
+ * the way the context's thread drains a group. Returns the emails per second.
+ */
+static double
+contention_run(contention_t *contention, void *(*producer)(void *), int threads) {
+    pthread_t tids[threads];
+    unsigned int consumed = 0, total;
+    double elapsed;
+    int i;
+
+    total = threads * contention->per_thread;
+    atomic_store(&contention->next_thread, 0);
+    elapsed = now();
+
+    for (i = 0; i < threads; i++) {
+        pthread_create(&tids[i], NULL, producer, contention);
+    }
+
+    if (producer == contention_mutex_producer) {
+        while (consumed < total) {
+            pthread_mutex_lock(&contention->mutex);
+            while (queue_pop(contention->queue) != NULL) {
+                ++consumed;
+            }
+            pthread_mutex_unlock(&contention->mutex);
+        }
+    }
+    else if (producer == contention_mpsc_producer) {
+        while (consumed < total) {
+            while (queue_mpsc_pop(contention->mpsc) != NULL) {
+                ++consumed;
+            }
+        }
+    }
+
+    for (i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    return total / (now() - elapsed);
+}
+
+static void
+bench_contention(int max_threads, unsigned int per_thread) {
+    contention_t contention;
+    double mutex, mpsc, send, batched;
+    int threads;
+
+    memset(&contention, 0, sizeof(contention));
+    pthread_mutex_init(&contention.mutex, NULL);
+    contention.per_thread = per_thread;
+    contention.queue = queue_init();
+    contention.mpsc = queue_mpsc_init();
+    contention.nodes = calloc((size_t)max_threads * per_thread, sizeof(*contention.nodes));
+    if (contention.queue == NULL || contention.mpsc == NULL || contention.nodes == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%8s %14s %14s %8s %14s %14s\n", "threads", "mutex/sec", "mpsc/sec", "speedup", "send/sec", "batched/sec");
+
+    for (threads = 1; threads <= max_threads; threads *= 2) {
+        mutex = contention_run(&contention, contention_mutex_producer, threads);
+        mpsc = contention_run(&contention, contention_mpsc_producer, threads);
+
+        //the group's interval never expires, so this only measures queueing
+        contention.ens = ens_init();
+        ens_set_option(contention.ens, ENS_OPTION_MODE, ENS_GROUP_MODE_COLLECT);
+        ens_set_option(contention.ens, ENS_OPTION_INTERVAL, 3600);
+        ens_group_register(contention.ens, 0);
+        send = contention_run(&contention, contention_send_producer, threads);
+        ens_group_set_option(contention.ens, 0, ENS_GROUP_OPTION_THREAD_BATCH, 256);
+        batched = contention_run(&contention, contention_send_producer, threads);
+        ens_free(contention.ens);
+
+        printf("%8d %14.0f %14.0f %7.2fx %14.0f %14.0f\n", threads, mutex, mpsc, mpsc / mutex, send, batched);
+    }
+
+    free(contention.nodes);
+    queue_mpsc_free(contention.mpsc);
+    queue_free(contention.queue);
+    pthread_mutex_destroy(&contention.mutex);
+}
+
+static void
+bench_batch(int max_threads, unsigned int per_thread) {
+    contention_t contention;
+    double send, batch;
+    int threads;
+
+    memset(&contention, 0, sizeof(contention));
+    contention.per_thread = per_thread;
+
+    printf("%8s %14s %14s %8s\n", "threads", "send/sec", "batch/sec", "speedup");
+
+    for (threads = 1; threads <= max_threads; threads *= 2) {
+        //the group's interval never expires, so this only measures queueing
+        contention.ens = ens_init();
+        ens_set_option(contention.ens, ENS_OPTION_MODE, ENS_GROUP_MODE_COLLECT);
+        ens_set_option(contention.ens, ENS_OPTION_INTERVAL, 3600);
+        ens_group_register(contention.ens, 0);
+        send = contention_run(&contention, contention_send_producer, threads);
+        batch = contention_run(&contention, contention_batch_producer, threads);
+        ens_free(contention.ens);
+
+        printf("%8d %14.0f %14.0f %7.2fx\n", threads, send, batch, batch / send);
+    }
+}
+
+int
+main(int argc, char **argv) {
+    smtp_server_t server;
+    const char *mode;
+
+    mode = argc > 1 ? argv[1] : "workers";
+
+    if (strcmp(mode, "workers") == 0) {
+        if (!smtp_server_start(&server, argc > 3 ? atoi(argv[3]) : 20)) {
+            return 1;
+        }
+
+        bench_workers(&server, argc > 2 ? atoi(argv[2]) : 64);
+    }
+    else if (strcmp(mode, "contention") == 0) {
+        bench_contention(argc > 2 ? atoi(argv[2]) : 32, argc > 3 ? atoi(argv[3]) : 200000);
+    }
+    else if (strcmp(mode, "batch") == 0) {
+        bench_batch(argc > 2 ? atoi(argv[2]) : 32, argc > 3 ? atoi(argv[3]) : 200000);
+    }
+    else {
+        fprintf(stderr, "Unknown benchmark '%s'\n", mode);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,609 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <ens.h>
+
+/**
+ * Tests for how groups treat the emails sent to them. Every group writes to a
+ * file instead of sending, so no test.conf is needed.
+ *
+ * Usage: groups
+ */
+
+#define CHECK(expr) \
+    do { \
+        if (!(expr)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #expr); \
+            return false; \
+        } \
+    } while (0)
+
+#define WAIT_MS 5000 //!< How long to wait for a group's emails to be written.
+
+/**
+ * Makes a context whose groups are only sent once an hour, so emails sent
+ * before it's started all go into the first email.
+ */
+static ens_t *
+context_init() {
+    ens_t *ens;
+
+    ens = ens_init();
+    if (ens == NULL) {
+        return NULL;
+    }
+
+    ens_set_option(ens, ENS_OPTION_INTERVAL, 3600);
+
+    return ens;
+}
+
+static bool
+group_init(ens_t *ens, ens_group_id_t id, int mode, const char *path) {
+    unlink(path);
+
+    return ens_group_register(ens, id) == ENS_ERROR_OK &&
+           ens_group_set_option(ens, id, ENS_GROUP_OPTION_MODE, mode) == ENS_ERROR_OK &&
+           ens_group_set_option(ens, id, ENS_GROUP_OPTION_FILE, path) == ENS_ERROR_OK;
+}
+
+static uint64_t
+group_info(ens_t *ens, ens_group_id_t id, ens_group_info_t info) {
+    uint64_t value = UINT64_MAX;
+
+    ens_group_get_info(ens, id, info, &value);
+
+    return value;
+}
+
+/**
+ * Returns how many lines of the file start with the prefix.
+ */
+static int
+file_count(const char *path, const char *prefix) {
+    char line[4096];
+    int count = 0;
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (f == NULL) {
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (strncmp(line, prefix, strlen(prefix)) == 0) {
+            ++count;
+        }
+    }
+
+    fclose(f);
+
+    return count;
+}
+
+/**
+ * Returns the numbers of the lines that start with the prefix, in order.
+ */
+static int
+file_numbers(const char *path, const char *prefix, int *numbers, int max) {
+    char line[4096];
+    int count = 0;
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (f == NULL) {
+        return -1;
+    }
+
+    while (count < max && fgets(line, sizeof(line), f) != NULL) {
+        if (strncmp(line, prefix, strlen(prefix)) == 0) {
+            numbers[count++] = atoi(line + strlen(prefix));
+        }
+    }
+
+    fclose(f);
+
+    return count;
+}
+
+/**
+ * Waits for the file to have <tt>count</tt> lines that start with the prefix.
+ * Returns <tt>false</tt> if that takes too long.
+ */
+static bool
+file_wait(const char *path, const char *prefix, int count) {
+    int i;
+
+    for (i = 0; i < WAIT_MS; i++) {
+        if (file_count(path, prefix) >= count) {
+            return true;
+        }
+        usleep(1000);
+    }
+
+    return false;
+}
+
+/**
+ * Stops and frees the context, which closes the groups' files.
+ */
+static void
+context_free(ens_t *ens) {
+    ens_stop_join(ens);
+    ens_free(ens);
+}
+
+/**
+ * Starts the context, waits for <tt>count</tt> emails to be written to the
+ * file and frees the context.
+ */
+static bool
+context_finish(ens_t *ens, const char *path, int count) {
+    bool written;
+
+    written = ens_start(ens) == ENS_ERROR_OK && file_wait(path, "Subject: ", count);
+    context_free(ens);
+
+    return written;
+}
+
+static bool
+test_owned() {
+    const char *path = "groups_owned.txt";
+    ens_body_t *body;
+    ens_t *ens;
+
+    ens = context_init();
+    CHECK(ens != NULL);
+    CHECK(group_init(ens, 1, ENS_GROUP_MODE_COLLECT, path));
+
+    CHECK(ens_group_send_owned(ens, 1, strdup("Owned"), strdup("owned body"), free) == ENS_ERROR_OK);
+
+    //a shared body outlives the caller's reference until it's sent
+    body = ens_body_init(strdup("shared body"), free);
+    CHECK(body != NULL);
+    CHECK(ens_group_send_shared(ens, 1, "Shared", body) == ENS_ERROR_OK);
+    CHECK(ens_group_send_shared(ens, 1, "Shared", body) == ENS_ERROR_OK);
+    ens_body_unref(body);
+
+    CHECK(ens_group_send_owned(ens, 2, strdup("Owned"), strdup("no group"), free) == ENS_ERROR_NOT_REGISTERED);
+    CHECK(context_finish(ens, path, 3));
+
+    CHECK(file_count(path, "Subject: Owned") == 1);
+    CHECK(file_count(path, "Subject: Shared") == 2);
+    CHECK(file_count(path, "owned body") == 1);
+    CHECK(file_count(path, "shared body") == 2);
+
+    return true;
+}
+
+static bool
+test_deferred() {
+    const char *path = "groups_deferred.txt";
+    char arg[16];
+    ens_t *ens;
+
+    ens = context_init();
+    CHECK(ens != NULL);
+    CHECK(group_init(ens, 1, ENS_GROUP_MODE_COLLECT, path));
+    CHECK(ens_group_set_option(ens, 1, ENS_GROUP_OPTION_DEFERRED_FORMAT, 1) == ENS_ERROR_OK);
+
+    //the arguments are captured, so they can change before the email is sent
+    strcpy(arg, "body");
+    CHECK(ens_group_sendf(ens, 1, "Deferred", "deferred %s %d %.1f", arg, 7, 0.5) == ENS_ERROR_OK);
+    strcpy(arg, "changed");
+    CHECK(ens_group_sendf(ens, 1, "Deferred", "%2$s %1$s", "order", "reversed") == ENS_ERROR_OK);
+    CHECK(context_finish(ens, path, 2));
+
+    CHECK(file_count(path, "deferred body 7 0.5") == 1);
+    CHECK(file_count(path, "reversed order") == 1);
+
+    return true;
+}
+
+static bool
+test_sendv() {
+    const char *path = "groups_sendv.txt";
+    struct iovec iov[3] = {{"gath", 4}, {"ered", 4}, {" body", 5}};
+    ens_t *ens;
+
+    ens = context_init();
+    CHECK(ens != NULL);
+    CHECK(group_init(ens, 1, ENS_GROUP_MODE_COLLECT, path));
+
+    CHECK(ens_group_sendv(ens, 1, "Gathered", iov, 3) == ENS_ERROR_OK);
+    CHECK(ens_group_sendv(ens, 1, "Empty", iov, 0) == ENS_ERROR_OK);
+    CHECK(context_finish(ens, path, 2));
+
+    CHECK(file_count(path, "gathered body") == 1);
+    CHECK(file_count(path, "Subject: Empty") == 1);
+
+    return true;
+}
+
+/**
+ * Counts the messages the context logs in the <tt>int</tt> its user data
+ * points to.
+ */
+static void
+log_count(int level, const char *msg, void *user_data) {
+    ++*(int *)user_data;
+}
+
+static bool
+test_batch() {
+    const char *paths[2] = {"groups_batch.txt", "groups_batch_drop.txt"};
+    ens_message_t msgs[] = {
+        {1, "Batch", "one"},
+        {1, "Batch", "two"},
+        {3, "Batch", "no group"},
+        {3, "Batch", "no group"},
+        {2, "Drop", "first"},
+        {2, "Drop", "second"},
+        {1, "Batch", "three"},
+    };
+    int expected[] = {
+        ENS_ERROR_OK,
+        ENS_ERROR_OK,
+        ENS_ERROR_NOT_REGISTERED,
+        ENS_ERROR_NOT_REGISTERED,
+        ENS_ERROR_OK,
+        ENS_ERROR_NOT_READY,
+        ENS_ERROR_OK,
+    };
+    int results[7], logged = 0;
+    bool written;
+    ens_t *ens;
+    int i;
+
+    ens = context_init();
+    CHECK(ens != NULL);
+    CHECK(group_init(ens, 1, ENS_GROUP_MODE_COLLECT, paths[0]));
+    CHECK(group_init(ens, 2, ENS_GROUP_MODE_DROP, paths[1]));
+    ens_set_option(ens, ENS_OPTION_LOG_FUNCTION, log_count);
+    ens_set_option(ens, ENS_OPTION_LOG_USER_DATA, &logged);
+    ens_set_option(ens, ENS_OPTION_LOG_LEVEL, ENS_LOG_LEVEL_ERROR);
+
+    //each message gets what ens_group_send() would have returned
+    memset(results, 0x55, sizeof(results));
+    CHECK(ens_send_batch(ens, msgs, 7, results) == 4);
+    for (i = 0; i < 7; i++) {
+        CHECK(results[i] == expected[i]);
+    }
+
+    //a run of messages for a group that isn't registered is logged once
+    CHECK(logged == 1);
+
+    //the IDs are ignored when the group is given
+    CHECK(ens_group_send_batch(ens, 1, msgs + 2, 2, results) == 2);
+    CHECK(results[0] == ENS_ERROR_OK && results[1] == ENS_ERROR_OK);
+    CHECK(ens_group_send_batch(ens, 3, msgs, 2, results) == 0);
+    CHECK(results[0] == ENS_ERROR_NOT_REGISTERED && results[1] == ENS_ERROR_NOT_REGISTERED);
+    CHECK(logged == 2);
+    CHECK(ens_group_send_batch(ens, 2, msgs, 2, NULL) == 0);
+
+    written = ens_start(ens) == ENS_ERROR_OK &&
+              file_wait(paths[0], "Subject: ", 5) &&
+              file_wait(paths[1], "Subject: ", 1);
+    context_free(ens);
+    CHECK(written);
+
+    CHECK(file_count(paths[0], "Subject: Batch") == 5);
+    CHECK(file_count(paths[0], "no group") == 2);
+    CHECK(file_count(paths[1], "first") == 1);
+    CHECK(file_count(paths[1], "second") == 0);
+
+    return true;
+}
+
+static bool
+test_handle() {
+    const char *path = "groups_handle.txt";
+    ens_group_handle_t *handle;
+    uint64_t queued;
+    ens_t *ens;
+
+    ens = context_init();
+    CHECK(ens != NULL);
+    CHECK(group_init(ens, 1, ENS_GROUP_MODE_COLLECT, path));
+    CHECK(ens_group_acquire(ens, 2) == NULL);
+
+    handle = ens_group_acquire(ens, 1);
+    CHECK(handle != NULL);
+    CHECK(ens_group_send_h(handle, "Handle", "handle body") == ENS_ERROR_OK);
+    CHECK(ens_group_sendf_h(handle, "Handle", "handle %s", "formatted") == ENS_ERROR_OK);
+
+    //the handle keeps the group alive, but it can't be sent to once it's gone
+    CHECK(ens_group_register(ens, 2) == ENS_ERROR_OK);
+    CHECK(ens_group_set_option(ens, 2, ENS_GROUP_OPTION_FILE, path) == ENS_ERROR_OK);
+    ens_group_release(handle);
+
+    handle = ens_group_acquire(ens, 2);
+    CHECK(handle != NULL);
+    CHECK(ens_group_send_h(handle, "Handle", "dropped") == ENS_ERROR_OK);
+    CHECK(ens_get_info(ens, ENS_INFO_QUEUED_EMAILS, &queued) == ENS_ERROR_OK && queued == 3);
+    CHECK(ens_group_unregister(ens, 2) == ENS_ERROR_OK);
+    CHECK(ens_group_send_h(handle, "Handle", "unregistered") == ENS_ERROR_NOT_REGISTERED);
+
+    //what it had queued stops counting against the context's limits right away
+    CHECK(ens_get_info(ens, ENS_INFO_QUEUED_EMAILS, &queued) == ENS_ERROR_OK && queued == 2);
+    ens_group_release(handle);
+
+    CHECK(context_finish(ens, path, 2));
+
+    CHECK(file_count(path, "Subject: Handle") == 2);
+    CHECK(file_count(path, "handle body") == 1);
+    CHECK(file_count(path, "handle formatted") == 1);
+    CHECK(file_count(path, "dropped") == 0);
+
+    return true;
+}
+
+static bool
+test_coalesce() {
+    const char *path = "groups_coalesce.txt";
+    struct iovec iov[2] = {{"hel", 3}, {"lo", 2}};
+    ens_t *ens;
+    int i;
+
+    ens = context_init();
+    CHECK(ens != NULL);
+    CHECK(group_init(ens, 1, ENS_GROUP_MODE_COLLECT, path));
+    CHECK(ens_group_set_option(ens, 1, ENS_GROUP_OPTION_COALESCE, -1) == ENS_ERROR_UNKNOWN_OPTION_VALUE);
+    CHECK(ens_group_set_option(ens, 1, ENS_GROUP_OPTION_COALESCE, 2) == ENS_ERROR_OK);
+
+    //two different emails fit, the other two are only counted
+    for (i = 0; i < 12; i++) {
+        CHECK(ens_group_sendf(ens, 1, "Repeat", "email %d", i % 4) == ENS_ERROR_OK);
+    }
+    CHECK(context_finish(ens, path, 2));
+
+    CHECK(file_count(path, "Subject: Repeat") == 2);
+    CHECK(file_count(path, "Occurrences: 3 between") == 2);
+    CHECK(file_count(path, "email 0") == 1);
+    CHECK(file_count(path, "email 1") == 1);
+    CHECK(file_count(path, "email 2") == 0);
+    CHECK(file_count(path, "6 more emails, about ") == 1);
+
+    //the table grows past its first size, and repeats are never queued
+    ens = context_init();
+    CHECK(ens != NULL);
+    CHECK(group_init(ens, 1, ENS_GROUP_MODE_COLLECT, path));
+    CHECK(ens_group_set_option(ens, 1, ENS_GROUP_OPTION_COALESCE, 100) == ENS_ERROR_OK);
+    for (i = 0; i < 120; i++) {
+        CHECK(ens_group_sendf(ens, 1, "Grown", "email %d", i % 40) == ENS_ERROR_OK);
+        CHECK(ens_group_sendv(ens, 1, "Grown", iov, 2) == ENS_ERROR_OK);
+    }
+    CHECK(group_info(ens, 1, ENS_GROUP_INFO_QUEUED_EMAILS) == 41);
+    CHECK(context_finish(ens, path, 41));
+
+    CHECK(file_count(path, "Subject: Grown") == 41);
+    CHECK(file_count(path, "Occurrences: 3 between") == 40);
+    CHECK(file_count(path, "Occurrences: 120 between") == 1);
+
+    return true;
+}
+
+static bool
+test_duplicates() {
+    const char *path = "groups_duplicates.txt";
+    struct iovec iov[2] = {{"hel", 3}, {"lo", 2}};
+    ens_body_t *body;
+    bool written;
+    ens_t *ens;
+
+    ens = context_init();
+    CHECK(ens != NULL);
+    CHECK(group_init(ens, 1, ENS_GROUP_MODE_DROP, path));
+    CHECK(ens_group_set_option(ens, 1, ENS_GROUP_OPTION_INTERVAL, 0) == ENS_ERROR_OK);
+    CHECK(ens_group_set_option(ens, 1, ENS_GROUP_OPTION_DUPLICATE_ERROR_RATE, 0) == ENS_ERROR_UNKNOWN_OPTION_VALUE);
+    CHECK(ens_group_set_option(ens, 1, ENS_GROUP_OPTION_DUPLICATE_ERROR_RATE, 1000) == ENS_ERROR_OK);
+    CHECK(ens_group_set_option(ens, 1, ENS_GROUP_OPTION_DUPLICATE_WINDOW, 60) == ENS_ERROR_OK);
+    CHECK(ens_start(ens) == ENS_ERROR_OK);
+
+    //the same subject and body is a duplicate however it's sent
+    CHECK(ens_group_send(ens, 1, "Hello", "hello") == ENS_ERROR_OK);
+    CHECK(file_wait(path, "Subject: Hello", 1));
+    CHECK(ens_group_send(ens, 1, "Hello", "hello") == ENS_ERROR_DUPLICATE);
+    CHECK(ens_group_sendf(ens, 1, "Hello", "%s", "hello") == ENS_ERROR_DUPLICATE);
+    CHECK(ens_group_sendv(ens, 1, "Hello", iov, 2) == ENS_ERROR_DUPLICATE);
+    body = ens_body_init(strdup("hello"), free);
+    CHECK(body != NULL);
+    CHECK(ens_group_send_shared(ens, 1, "Hello", body) == ENS_ERROR_DUPLICATE);
+    ens_body_unref(body);
+
+    CHECK(ens_group_send(ens, 1, "Goodbye", "hello") == ENS_ERROR_OK);
+    CHECK(file_wait(path, "Subject: Goodbye", 1));
+
+    //a deferred body is told apart by its format string and arguments
+    CHECK(ens_group_set_option(ens, 1, ENS_GROUP_OPTION_DEFERRED_FORMAT, 1) == ENS_ERROR_OK);
+    CHECK(ens_group_sendf(ens, 1, "Deferred", "number %d", 1) == ENS_ERROR_OK);
+    CHECK(file_wait(path, "Subject: Deferred", 1));
+    CHECK(ens_group_sendf(ens, 1, "Deferred", "number %d", 1) == ENS_ERROR_DUPLICATE);
+    CHECK(ens_group_sendf(ens, 1, "Deferred", "number %d", 2) == ENS_ERROR_OK);
+    CHECK(file_wait(path, "Subject: Deferred", 2));
+
+    //turning it off forgets what was sent
+    CHECK(ens_group_set_option(ens, 1, ENS_GROUP_OPTION_DUPLICATE_WINDOW, 0) == ENS_ERROR_OK);
+    CHECK(ens_group_send(ens, 1, "Hello", "hello") == ENS_ERROR_OK);
+    written = file_wait(path, "Subject: Hello", 2);
+    context_free(ens);
+    CHECK(written);
+
+    CHECK(file_count(path, "Subject: Hello") == 2);
+    CHECK(file_count(path, "Subject: Goodbye") == 1);
+    CHECK(file_count(path, "Subject: Deferred") == 2);
+
+    return true;
+}
+
+static bool
+test_overflow() {
+    const char *paths[3] = {"groups_newest.txt", "groups_oldest.txt", "groups_truncate.txt"};
+    char big[2000];
+    bool written;
+    ens_t *ens;
+    int i;
+
+    ens = context_init();
+    CHECK(ens != NULL);
+    CHECK(group_init(ens, 1, ENS_GROUP_MODE_COLLECT, paths[0]));
+    CHECK(group_init(ens, 2, ENS_GROUP_MODE_COLLECT, paths[1]));
+    CHECK(group_init(ens, 3, ENS_GROUP_MODE_COLLECT, paths[2]));
+    CHECK(ens_group_set_option(ens, 1, ENS_GROUP_OPTION_MAX_EMAILS, 3) == ENS_ERROR_OK);
+    CHECK(ens_group_set_option(ens, 2, ENS_GROUP_OPTION_MAX_EMAILS, 3) == ENS_ERROR_OK);
+    CHECK(ens_group_set_option(ens, 2, ENS_GROUP_OPTION_OVERFLOW, ENS_OVERFLOW_DROP_OLDEST) == ENS_ERROR_OK);
+    CHECK(ens_group_set_option(ens, 3, ENS_GROUP_OPTION_MAX_BYTES, 1000) == ENS_ERROR_OK);
+    CHECK(ens_group_set_option(ens, 3, ENS_GROUP_OPTION_OVERFLOW, ENS_OVERFLOW_TRUNCATE) == ENS_ERROR_OK);
+    CHECK(ens_group_set_option(ens, 3, ENS_GROUP_OPTION_OVERFLOW, 7) == ENS_ERROR_UNKNOWN_OPTION_VALUE);
+
+    //the newest emails are turned away, or the oldest make room for them
+    for (i = 0; i < 5; i++) {
+        CHECK(ens_group_sendf(ens, 1, "Newest", "body %d", i) == (i < 3 ? ENS_ERROR_OK : ENS_ERROR_FULL));
+        CHECK(ens_group_sendf(ens, 2, "Oldest", "body %d", i) == ENS_ERROR_OK);
+    }
+    CHECK(group_info(ens, 1, ENS_GROUP_INFO_QUEUED_EMAILS) == 3);
+    CHECK(group_info(ens, 1, ENS_GROUP_INFO_EMAILS_DROPPED) == 2);
+    CHECK(group_info(ens, 2, ENS_GROUP_INFO_QUEUED_EMAILS) == 3);
+    CHECK(group_info(ens, 2, ENS_GROUP_INFO_EMAILS_DROPPED) == 2);
+
+    //the body is cut to what fits, until nothing of it does
+    memset(big, 'x', sizeof(big) - 1);
+    big[sizeof(big) - 1] = '\0';
+    CHECK(ens_group_send(ens, 3, "Truncated", big) == ENS_ERROR_OK);
+    CHECK(group_info(ens, 3, ENS_GROUP_INFO_EMAILS_TRUNCATED) == 1);
+    CHECK(group_info(ens, 3, ENS_GROUP_INFO_QUEUED_BYTES) <= 1000);
+    CHECK(ens_group_send(ens, 3, "Truncated", big) == ENS_ERROR_FULL);
+    CHECK(group_info(ens, 3, ENS_GROUP_INFO_EMAILS_DROPPED) == 1);
+
+    written = ens_start(ens) == ENS_ERROR_OK &&
+              file_wait(paths[0], "Subject: ", 3) &&
+              file_wait(paths[1], "Subject: ", 3) &&
+              file_wait(paths[2], "Subject: ", 1);
+    context_free(ens);
+    CHECK(written);
+
+    CHECK(file_count(paths[0], "body ") == 3);
+    CHECK(file_count(paths[0], "body 3") == 0);
+    CHECK(file_count(paths[1], "body ") == 3);
+    CHECK(file_count(paths[1], "body 0") == 0);
+    CHECK(file_count(paths[1], "body 4") == 1);
+    CHECK(file_count(paths[2], big) == 0);
+    CHECK(file_count(paths[2], "xxx") == 1);
+
+    //the context's limit covers every group together
+    ens = context_init();
+    CHECK(ens != NULL);
+    CHECK(ens_set_option(ens, ENS_OPTION_MAX_EMAILS, 4) == ENS_ERROR_OK);
+    CHECK(group_init(ens, 1, ENS_GROUP_MODE_COLLECT, paths[0]));
+    CHECK(group_init(ens, 2, ENS_GROUP_MODE_COLLECT, paths[1]));
+    for (i = 0; i < 3; i++) {
+        CHECK(ens_group_send(ens, 1, "Context", "one") == ENS_ERROR_OK);
+    }
+    CHECK(ens_group_send(ens, 2, "Context", "two") == ENS_ERROR_OK);
+    CHECK(ens_group_send(ens, 2, "Context", "two") == ENS_ERROR_FULL);
+    ens_free(ens);
+
+    //repeats of coalesced emails are only counted, even at the limits
+    ens = context_init();
+    CHECK(ens != NULL);
+    CHECK(group_init(ens, 1, ENS_GROUP_MODE_COLLECT, paths[0]));
+    CHECK(group_init(ens, 3, ENS_GROUP_MODE_COLLECT, paths[2]));
+    CHECK(ens_group_set_option(ens, 1, ENS_GROUP_OPTION_COALESCE, 10) == ENS_ERROR_OK);
+    CHECK(ens_group_set_option(ens, 1, ENS_GROUP_OPTION_MAX_EMAILS, 2) == ENS_ERROR_OK);
+    CHECK(ens_group_set_option(ens, 3, ENS_GROUP_OPTION_COALESCE, 10) == ENS_ERROR_OK);
+    CHECK(ens_group_set_option(ens, 3, ENS_GROUP_OPTION_MAX_BYTES, 1000) == ENS_ERROR_OK);
+    CHECK(ens_group_set_option(ens, 3, ENS_GROUP_OPTION_OVERFLOW, ENS_OVERFLOW_TRUNCATE) == ENS_ERROR_OK);
+    for (i = 0; i < 3; i++) {
+        CHECK(ens_group_sendf(ens, 1, "Coalesced", "body %d", 0) == ENS_ERROR_OK);
+        CHECK(ens_group_sendf(ens, 1, "Coalesced", "body %d", 1) == ENS_ERROR_OK);
+        CHECK(ens_group_send(ens, 3, "Truncated", big) == ENS_ERROR_OK);
+    }
+    CHECK(ens_group_sendf(ens, 1, "Coalesced", "body %d", 2) == ENS_ERROR_FULL);
+    CHECK(group_info(ens, 1, ENS_GROUP_INFO_QUEUED_EMAILS) == 2);
+    CHECK(group_info(ens, 1, ENS_GROUP_INFO_EMAILS_DROPPED) == 1);
+    CHECK(group_info(ens, 3, ENS_GROUP_INFO_QUEUED_EMAILS) == 1);
+    CHECK(group_info(ens, 3, ENS_GROUP_INFO_EMAILS_TRUNCATED) == 1);
+    CHECK(group_info(ens, 3, ENS_GROUP_INFO_EMAILS_DROPPED) == 0);
+
+    written = ens_start(ens) == ENS_ERROR_OK &&
+              file_wait(paths[0], "Subject: ", 2) &&
+              file_wait(paths[2], "Subject: ", 1);
+    context_free(ens);
+    CHECK(written);
+
+    CHECK(file_count(paths[0], "Occurrences: 3 between") == 2);
+    CHECK(file_count(paths[2], "Occurrences: 3 between") == 1);
+
+    return true;
+}
+
+static bool
+test_sample() {
+    const char *path = "groups_sample.txt";
+    int numbers[16], count, i;
+    ens_t *ens;
+
+    ens = context_init();
+    CHECK(ens != NULL);
+    CHECK(group_init(ens, 1, ENS_GROUP_MODE_SAMPLE, path));
+    CHECK(ens_group_set_option(ens, 1, ENS_GROUP_OPTION_SAMPLE_SIZE, 0) == ENS_ERROR_UNKNOWN_OPTION_VALUE);
+    CHECK(ens_group_set_option(ens, 1, ENS_GROUP_OPTION_SAMPLE_SIZE, 3) == ENS_ERROR_OK);
+    CHECK(ens_group_set_option(ens, 1, ENS_GROUP_OPTION_SAMPLE_EDGES, 2) == ENS_ERROR_OK);
+
+    //the sample never holds more than its size
+    for (i = 0; i < 1000; i++) {
+        CHECK(ens_group_sendf(ens, 1, "Sampled", "email %d", i) == ENS_ERROR_OK);
+        CHECK(group_info(ens, 1, ENS_GROUP_INFO_QUEUED_EMAILS) <= 7);
+    }
+    CHECK(group_info(ens, 1, ENS_GROUP_INFO_QUEUED_EMAILS) == 7);
+    CHECK(context_finish(ens, path, 7));
+
+    CHECK(file_count(path, "Subject: Sampled") == 7);
+    CHECK(file_count(path, "7 of 1000 emails were kept as a sample") == 1);
+
+    //the first and last emails, with the sample between them in order
+    count = file_numbers(path, "email ", numbers, 16);
+    CHECK(count == 7);
+    CHECK(numbers[0] == 0 && numbers[1] == 1);
+    CHECK(numbers[5] == 998 && numbers[6] == 999);
+    for (i = 2; i < 5; i++) {
+        CHECK(numbers[i] > numbers[i - 1] && numbers[i] < 998);
+    }
+
+    return true;
+}
+
+int
+main(int argc, char **argv) {
+    struct {
+        const char *name;
+        bool (*run)();
+    } tests[] = {
+        {"owned", test_owned},
+        {"deferred", test_deferred},
+        {"sendv", test_sendv},
+        {"batch", test_batch},
+        {"handle", test_handle},
+        {"coalesce", test_coalesce},
+        {"duplicates", test_duplicates},
+        {"overflow", test_overflow},
+        {"sample", test_sample},
+    };
+    unsigned int i, failed = 0;
+
+    for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        if (tests[i].run()) {
+            printf("ok   %s\n", tests[i].name);
+        }
+        else {
+            printf("FAIL %s\n", tests[i].name);
+            ++failed;
+        }
+    }
+
+    return failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,479 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include "../src/queue.h"
+#include "../src/hmap.h"
+#include "../src/heap.h"
+#include "../src/buffer.h"
+#include "../src/format.h"
+
+/**
+ * Tests for the data structures ENS is built on. They don't send any emails,
+ * so no test.conf is needed.
+ *
+ * Usage: unit
+ */
+
+#define CHECK(expr) \
+    do { \
+        if (!(expr)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #expr); \
+            return false; \
+        } \
+    } while (0)
+
+#define ITEM(i) ((void *)(uintptr_t)((i) + 1)) //!< Queue and map data can't be NULL.
+
+typedef struct {
+    int value;
+    unsigned int index;
+} heap_item_t;
+
+/**
+ * Pops every element and checks they come out in order, starting at
+ * <tt>first</tt>.
+ */
+static bool
+queue_check_drain(queue_t *queue, unsigned int first, unsigned int count) {
+    unsigned int i;
+
+    for (i = 0; i < count; i++) {
+        CHECK(queue_size(queue) == count - i);
+        CHECK(queue_peek(queue) == ITEM(first + i));
+        CHECK(queue_pop(queue) == ITEM(first + i));
+    }
+
+    CHECK(queue_size(queue) == 0);
+    CHECK(queue_pop(queue) == NULL);
+    CHECK(queue_peek(queue) == NULL);
+
+    return true;
+}
+
+static bool
+test_queue() {
+    queue_t *queue;
+    unsigned int i, next = 0, first = 0;
+
+    queue = queue_init();
+    CHECK(queue != NULL);
+    CHECK(queue_pop(queue) == NULL);
+
+    //move the head most of the way around the ring before it has to grow, so
+    //the elements are wrapped when they're copied
+    for (i = 0; i < 12; i++) {
+        CHECK(queue_push(queue, ITEM(next++)));
+    }
+    for (i = 0; i < 10; i++) {
+        CHECK(queue_pop(queue) == ITEM(first++));
+    }
+    for (i = 0; i < 100; i++) {
+        CHECK(queue_push(queue, ITEM(next++)));
+    }
+    CHECK(queue_check_drain(queue, first, next - first));
+
+    //keep a few elements in the queue while the head laps the ring many times
+    first = next;
+    for (i = 0; i < 5; i++) {
+        CHECK(queue_push(queue, ITEM(next++)));
+    }
+    for (i = 0; i < 1000; i++) {
+        CHECK(queue_push(queue, ITEM(next++)));
+        CHECK(queue_pop(queue) == ITEM(first++));
+    }
+    CHECK(queue_check_drain(queue, first, next - first));
+
+    //grow large, then shrink while wrapped
+    for (i = 0; i < 5000; i++) {
+        CHECK(queue_push(queue, ITEM(i)));
+    }
+    for (i = 0; i < 4990; i++) {
+        CHECK(queue_pop(queue) == ITEM(i));
+        if (i % 3 == 0) {
+            CHECK(queue_push(queue, ITEM(5000 + i / 3)));
+        }
+    }
+    CHECK(queue_size(queue) == 10 + 1664);
+    CHECK(queue_check_drain(queue, 4990, 10 + 1664));
+
+    queue_free(queue);
+
+    return true;
+}
+
+typedef struct {
+    queue_mpsc_node_t link;
+    int value;
+} mpsc_item_t;
+
+static bool
+test_queue_mpsc() {
+    mpsc_item_t items[10];
+    queue_mpsc_t *queue;
+    mpsc_item_t *item;
+    int i;
+
+    queue = queue_mpsc_init();
+    CHECK(queue != NULL);
+    CHECK(queue_mpsc_pop(queue) == NULL);
+
+    for (i = 0; i < 10; i++) {
+        items[i].value = i;
+    }
+
+    queue_mpsc_push(queue, &items[0].link);
+    queue_mpsc_push(queue, &items[1].link);
+
+    //a chain is linked first to last before it's pushed
+    for (i = 2; i < 9; i++) {
+        atomic_store(&items[i].link.next, i < 8 ? &items[i + 1].link : NULL);
+    }
+    queue_mpsc_push_chain(queue, &items[2].link, &items[8].link);
+    queue_mpsc_push(queue, &items[9].link);
+
+    for (i = 0; i < 10; i++) {
+        item = (mpsc_item_t *)queue_mpsc_pop(queue);
+        CHECK(item != NULL);
+        CHECK(item->value == i);
+    }
+    CHECK(queue_mpsc_pop(queue) == NULL);
+
+    //the queue still works once it's been emptied
+    queue_mpsc_push(queue, &items[3].link);
+    CHECK(queue_mpsc_pop(queue) == &items[3].link);
+    CHECK(queue_mpsc_pop(queue) == NULL);
+
+    queue_mpsc_free(queue);
+
+    return true;
+}
+
+static bool
+test_hmap() {
+    static bool present[4096];
+    unsigned int i, iter, count, order[4096];
+    hmap_t *map;
+    void *data;
+    int key;
+
+    map = hmap_init();
+    CHECK(map != NULL);
+    CHECK(hmap_get(map, 1) == NULL);
+    CHECK(hmap_remove(map, 1) == NULL);
+
+    //multiples of a power of two crowd into the same few clusters, which is
+    //where removals have to shift the items after them back
+    for (i = 0; i < 4096; i++) {
+        key = (int)(i * 1024);
+        CHECK(hmap_put(map, key, ITEM(i)));
+        present[i] = true;
+    }
+    CHECK(hmap_size(map) == 4096);
+    CHECK(hmap_put(map, 0, ITEM(7)));
+    CHECK(hmap_get(map, 0) == ITEM(7));
+    CHECK(hmap_put(map, 0, ITEM(0)));
+    CHECK(hmap_size(map) == 4096);
+
+    //remove in a scrambled order and check every key after each removal
+    for (i = 0; i < 4096; i++) {
+        order[i] = i;
+    }
+    srand(1);
+    for (i = 4095; i > 0; i--) {
+        count = rand() % (i + 1);
+        iter = order[i];
+        order[i] = order[count];
+        order[count] = iter;
+    }
+
+    for (i = 0; i < 4096; i++) {
+        CHECK(hmap_remove(map, (int)(order[i] * 1024)) == ITEM(order[i]));
+        present[order[i]] = false;
+
+        if (i % 64 != 0 && i < 4032) {
+            continue;
+        }
+        for (count = 0; count < 4096; count++) {
+            CHECK(hmap_get(map, (int)(count * 1024)) == (present[count] ? ITEM(count) : NULL));
+        }
+    }
+    CHECK(hmap_size(map) == 0);
+
+    //negative keys and iteration
+    for (i = 0; i < 100; i++) {
+        CHECK(hmap_put(map, -(int)i, ITEM(i)));
+    }
+    iter = 0;
+    count = 0;
+    while ((data = hmap_next(map, &iter)) != NULL) {
+        CHECK(hmap_get(map, -(int)((uintptr_t)data - 1)) == data);
+        ++count;
+    }
+    CHECK(count == 100);
+
+    hmap_free(map);
+
+    return true;
+}
+
+static int
+heap_item_compare(const void *a, const void *b) {
+    const heap_item_t *item_a = a, *item_b = b;
+
+    return item_a->value < item_b->value ? -1 : item_a->value > item_b->value;
+}
+
+static void
+heap_item_index(void *data, unsigned int index) {
+    ((heap_item_t *)data)->index = index;
+}
+
+static bool
+test_heap() {
+    heap_item_t items[500], *item;
+    heap_t *heap;
+    int i, last;
+
+    heap = heap_init(heap_item_compare, heap_item_index);
+    CHECK(heap != NULL);
+    CHECK(heap_pop(heap) == NULL);
+    CHECK(heap_remove(heap, 0) == NULL);
+
+    srand(2);
+    for (i = 0; i < 500; i++) {
+        items[i].value = rand() % 1000;
+        items[i].index = HEAP_INDEX_NONE;
+        CHECK(heap_push(heap, &items[i]));
+        CHECK(items[i].index != HEAP_INDEX_NONE);
+    }
+
+    //every item's index must still find it after the others have moved it
+    for (i = 0; i < 500; i += 3) {
+        CHECK(heap_remove(heap, items[i].index) == &items[i]);
+        CHECK(items[i].index == HEAP_INDEX_NONE);
+    }
+    for (i = 1; i < 500; i += 3) {
+        CHECK(heap_remove(heap, items[i].index) == &items[i]);
+    }
+    CHECK(heap_size(heap) == 166);
+
+    last = -1;
+    while ((item = heap_peek(heap)) != NULL) {
+        CHECK(heap_pop(heap) == item);
+        CHECK(item->value >= last);
+        CHECK(item->index == HEAP_INDEX_NONE);
+        last = item->value;
+    }
+    CHECK(heap_size(heap) == 0);
+
+    heap_free(heap);
+
+    return true;
+}
+
+/**
+ * Copies the buffer's chunks out into one string.
+ */
+static char *
+buffer_flatten(buffer_t *buffer) {
+    struct iovec iov[64];
+    char *str, *p;
+    int i, count;
+
+    count = buffer_iovec(buffer, iov, 64);
+    if (count > 64) {
+        return NULL;
+    }
+
+    str = malloc(buffer_length(buffer) + 1);
+    if (str == NULL) {
+        return NULL;
+    }
+
+    p = str;
+    for (i = 0; i < count; i++) {
+        memcpy(p, iov[i].iov_base, iov[i].iov_len);
+        p += iov[i].iov_len;
+    }
+    *p = '\0';
+
+    return str;
+}
+
+static bool
+test_buffer() {
+    char expected[20000], piece[1000], *flat;
+    size_t len = 0;
+    buffer_t *buffer;
+    int i;
+
+    buffer = buffer_init();
+    CHECK(buffer != NULL);
+    CHECK(buffer_length(buffer) == 0);
+    CHECK(buffer_iovec(buffer, NULL, 0) == 0);
+
+    //pieces of every size land across many chunks
+    for (i = 0; i < 40; i++) {
+        memset(piece, 'a' + i % 26, (size_t)i * 20 + 1);
+        CHECK(buffer_write(buffer, (unsigned char *)piece, (size_t)i * 20 + 1));
+        memcpy(expected + len, piece, (size_t)i * 20 + 1);
+        len += (size_t)i * 20 + 1;
+
+        CHECK(buffer_writef(buffer, "[%d:%s]", i, i % 2 ? "odd" : "even"));
+        len += sprintf(expected + len, "[%d:%s]", i, i % 2 ? "odd" : "even");
+    }
+    CHECK(buffer_length(buffer) == len);
+
+    flat = buffer_flatten(buffer);
+    CHECK(flat != NULL);
+    CHECK(strcmp(flat, expected) == 0);
+    free(flat);
+
+    //a formatted piece bigger than any chunk so far
+    memset(piece, 'z', sizeof(piece) - 1);
+    piece[sizeof(piece) - 1] = '\0';
+    buffer_clear(buffer);
+    CHECK(buffer_length(buffer) == 0);
+    CHECK(buffer_writef(buffer, "%s%s%s", piece, piece, piece));
+    CHECK(buffer_length(buffer) == 3 * (sizeof(piece) - 1));
+    flat = buffer_flatten(buffer);
+    CHECK(flat != NULL);
+    CHECK(strspn(flat, "z") == 3 * (sizeof(piece) - 1));
+    free(flat);
+
+    buffer_free(buffer);
+
+    return true;
+}
+
+/**
+ * Captures the arguments with the parsed format, renders them and checks the
+ * result matches vsnprintf().
+ */
+static bool
+format_check(const char *fmt, ...) {
+    char expected[512], *rendered;
+    format_t *format;
+    buffer_t *buffer;
+    void *record;
+    size_t size;
+    va_list ap, copy;
+
+    va_start(ap, fmt);
+    va_copy(copy, ap);
+    vsnprintf(expected, sizeof(expected), fmt, copy);
+    va_end(copy);
+
+    format = format_init(fmt);
+    CHECK(format != NULL);
+    CHECK(format_deferrable(format));
+    CHECK(strcmp(format_string(format), fmt) == 0);
+
+    va_copy(copy, ap);
+    size = format_capture_size(format, copy);
+    va_end(copy);
+
+    record = malloc(size + 1);
+    CHECK(record != NULL);
+    format_capture(format, record, ap);
+    va_end(ap);
+
+    buffer = buffer_init();
+    CHECK(buffer != NULL);
+    CHECK(format_render(format, record, buffer));
+
+    rendered = buffer_flatten(buffer);
+    CHECK(rendered != NULL);
+    if (strcmp(rendered, expected) != 0) {
+        fprintf(stderr, "format \"%s\": got \"%s\", expected \"%s\"\n", fmt, rendered, expected);
+        return false;
+    }
+
+    free(rendered);
+    buffer_free(buffer);
+    free(record);
+    format_free(format);
+
+    return true;
+}
+
+static bool
+test_format() {
+    char unterminated[5] = {'h', 'e', 'l', 'l', 'o'};
+    char fmt[32];
+    format_t *format;
+
+    CHECK(format_check("plain text"));
+    CHECK(format_check("100%% %d%%", 42));
+    CHECK(format_check("%d %u %x %o %c", -7, 7u, 255, 8, 'q'));
+    CHECK(format_check("%ld %lld %hd %zu", -1L, 1LL << 40, (short)-3, (size_t)12345));
+    CHECK(format_check("%5.2f|%-8e|%g", 3.14159, 0.000123, 1e20));
+    CHECK(format_check("%Lf %.3Lf", (long double)1.5, (long double)2.0 / 3));
+    CHECK(format_check("[%s] [%10s] [%-6s]", "abc", "right", "left"));
+    CHECK(format_check("%s and %s", "", (char *)NULL));
+    CHECK(format_check("%p", (void *)0x1234));
+    CHECK(format_check("%*d|%-*.*f", 6, 42, 10, 3, 1.25));
+    CHECK(format_check("trailing %d text", 1));
+
+    //a precision limits how much of a string is read, so it needn't be
+    //terminated
+    CHECK(format_check("[%.*s]", 5, unterminated));
+    CHECK(format_check("[%.3s]", unterminated));
+    CHECK(format_check("[%8.*s]", 2, unterminated));
+    CHECK(format_check("[%.*s]", -1, "negative means no precision"));
+
+    //the format is copied, so the string it came from can change
+    strcpy(fmt, "%d apples");
+    format = format_init(fmt);
+    CHECK(format != NULL);
+    strcpy(fmt, "%s pears");
+    CHECK(strcmp(format_string(format), "%d apples") == 0);
+    format_free(format);
+
+    //formats that can't be deferred
+    format = format_init("%2$s %1$s");
+    CHECK(format != NULL && !format_deferrable(format));
+    format_free(format);
+    format = format_init("%m");
+    CHECK(format != NULL && !format_deferrable(format));
+    format_free(format);
+    format = format_init("%n");
+    CHECK(format != NULL && !format_deferrable(format));
+    format_free(format);
+    format = format_init("%ls");
+    CHECK(format != NULL && !format_deferrable(format));
+    format_free(format);
+
+    return true;
+}
+
+int
+main(int argc, char **argv) {
+    struct {
+        const char *name;
+        bool (*run)();
+    } tests[] = {
+        {"queue", test_queue},
+        {"queue_mpsc", test_queue_mpsc},
+        {"hmap", test_hmap},
+        {"heap", test_heap},
+        {"buffer", test_buffer},
+        {"format", test_format},
+    };
+    unsigned int i, failed = 0;
+
+    for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        if (tests[i].run()) {
+            printf("ok   %s\n", tests[i].name);
+        }
+        else {
+            printf("FAIL %s\n", tests[i].name);
+            ++failed;
+        }
+    }
+
+    return failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}